@@ -0,0 +1,133 @@
+#pragma once
+
+#include <cstdint>
+#include <iterator>
+#include <map>
+
+// Best-fit free-list over [0, capacity). Only bookkeeping: callers map the
+// returned offsets into a buffer they own. Freed ranges are coalesced with
+// their neighbours so long-running scenes do not fragment.
+class RangeAllocator
+{
+public:
+	explicit RangeAllocator(uint64_t capacity = 0)
+	{
+		reset(capacity);
+	}
+
+	void reset(uint64_t capacity)
+	{
+		byOffset.clear();
+		bySize.clear();
+		total = capacity;
+		allocated = 0;
+		if (capacity > 0)
+		{
+			insert(0, capacity);
+		}
+	}
+
+	// alignment does not have to be a power of two, so vertex ranges can be
+	// aligned to their stride
+	bool allocate(uint64_t size, uint64_t alignment, uint64_t& offset)
+	{
+		if (size == 0)
+		{
+			offset = 0;
+			return true;
+		}
+		alignment = alignment == 0 ? 1 : alignment;
+		for (auto candidate = bySize.lower_bound(size); candidate != bySize.end(); ++candidate)
+		{
+			uint64_t blockOffset = candidate->second;
+			uint64_t blockSize = candidate->first;
+			uint64_t aligned = (blockOffset + alignment - 1) / alignment * alignment;
+			if (aligned + size > blockOffset + blockSize)
+			{
+				continue;
+			}
+			erase(blockOffset);
+			if (aligned > blockOffset)
+			{
+				insert(blockOffset, aligned - blockOffset);
+			}
+			if (aligned + size < blockOffset + blockSize)
+			{
+				insert(aligned + size, blockOffset + blockSize - aligned - size);
+			}
+			allocated += size;
+			offset = aligned;
+			return true;
+		}
+		return false;
+	}
+
+	void free(uint64_t offset, uint64_t size)
+	{
+		if (size == 0)
+		{
+			return;
+		}
+		allocated -= size;
+		auto next = byOffset.lower_bound(offset);
+		if (next != byOffset.end() && offset + size == next->first)
+		{
+			size += next->second;
+			erase(next->first);
+		}
+		next = byOffset.lower_bound(offset);
+		if (next != byOffset.begin())
+		{
+			auto previous = std::prev(next);
+			if (previous->first + previous->second == offset)
+			{
+				offset = previous->first;
+				size += previous->second;
+				erase(previous->first);
+			}
+		}
+		insert(offset, size);
+	}
+
+	uint64_t capacity() const
+	{
+		return total;
+	}
+
+	uint64_t used() const
+	{
+		return allocated;
+	}
+
+	size_t fragments() const
+	{
+		return byOffset.size();
+	}
+
+private:
+	void insert(uint64_t offset, uint64_t size)
+	{
+		byOffset[offset] = size;
+		bySize.insert(std::make_pair(size, offset));
+	}
+
+	void erase(uint64_t offset)
+	{
+		auto block = byOffset.find(offset);
+		auto range = bySize.equal_range(block->second);
+		for (auto it = range.first; it != range.second; ++it)
+		{
+			if (it->second == offset)
+			{
+				bySize.erase(it);
+				break;
+			}
+		}
+		byOffset.erase(block);
+	}
+
+	std::map<uint64_t, uint64_t> byOffset;
+	std::multimap<uint64_t, uint64_t> bySize;
+	uint64_t total;
+	uint64_t allocated;
+};
@@ -0,0 +1,312 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "jobs.hpp"
+#include "texture.hpp"
+
+// Bottom-left skyline bin packer (Jylanki, "A Thousand Ways to Pack the
+// Bin"). The skyline is the list of top edges of everything placed so far;
+// a rectangle goes where its top ends lowest.
+class SkylinePacker
+{
+public:
+	SkylinePacker(uint32_t width, uint32_t height) : width(width), height(height), usedHeight(0)
+	{
+		skyline.push_back(Segment{ 0, 0, width });
+	}
+
+	bool insert(uint32_t w, uint32_t h, uint32_t& x, uint32_t& y)
+	{
+		size_t best = skyline.size();
+		uint32_t bestTop = UINT32_MAX;
+		for (size_t i = 0; i < skyline.size(); i++)
+		{
+			uint32_t top;
+			if (fit(i, w, h, top) && top + h < bestTop)
+			{
+				best = i;
+				bestTop = top + h;
+				y = top;
+			}
+		}
+		if (best == skyline.size())
+		{
+			return false;
+		}
+		x = skyline[best].x;
+		place(best, x, bestTop, w);
+		usedHeight = std::max(usedHeight, bestTop);
+		return true;
+	}
+
+	uint32_t width;
+	uint32_t height;
+	uint32_t usedHeight;
+
+private:
+	struct Segment
+	{
+		uint32_t x;
+		uint32_t y;
+		uint32_t width;
+	};
+	std::vector<Segment> skyline;
+
+	// Lowest y at which a w x h rectangle starting at segment i clears every
+	// segment below it
+	bool fit(size_t i, uint32_t w, uint32_t h, uint32_t& y) const
+	{
+		uint32_t x = skyline[i].x;
+		if (x + w > width)
+		{
+			return false;
+		}
+		y = 0;
+		for (size_t j = i; j < skyline.size() && skyline[j].x < x + w; j++)
+		{
+			y = std::max(y, skyline[j].y);
+			if (y + h > height)
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	void place(size_t i, uint32_t x, uint32_t top, uint32_t w)
+	{
+		skyline.insert(skyline.begin() + i, Segment{ x, top, w });
+		uint32_t right = x + w;
+		for (size_t j = i + 1; j < skyline.size() && skyline[j].x < right;)
+		{
+			uint32_t end = skyline[j].x + skyline[j].width;
+			if (end <= right)
+			{
+				skyline.erase(skyline.begin() + j);
+				continue;
+			}
+			skyline[j].width = end - right;
+			skyline[j].x = right;
+			break;
+		}
+		for (size_t j = 0; j + 1 < skyline.size();)
+		{
+			if (skyline[j].y == skyline[j + 1].y)
+			{
+				skyline[j].width += skyline[j + 1].width;
+				skyline.erase(skyline.begin() + j + 1);
+				continue;
+			}
+			j++;
+		}
+	}
+};
+
+// Packs small textures into shared RGBA8 pages so objects using them can
+// share one image. Entries are surrounded by a gutter of repeated edge
+// texels and placed on a grid of the gutter size, so every one of the
+// page's mip levels keeps at least a one texel gutter and filtering never
+// pulls in a neighbour.
+class TextureAtlas
+{
+public:
+	static const uint32_t maxTextureSize = 256;
+	static const uint32_t gutter = 8;
+	// log2(gutter) + 1
+	static const uint32_t pageLevels = 4;
+	static const uint32_t noPage = UINT32_MAX;
+
+	// Where one input texture ended up. uvTransform maps the mesh's own uv
+	// into the page as offset.xy + scale.zw * uv, accounting for the v flip
+	// the shaders apply.
+	struct Placement
+	{
+		uint32_t page;
+		glm::vec4 uvTransform;
+	};
+
+	std::vector<Texture> pages;
+	std::vector<Placement> placements;
+
+	static bool Fits(const Texture& texture)
+	{
+		return !texture.empty() && texture.width <= maxTextureSize && texture.height <= maxTextureSize;
+	}
+
+	// One placement per input; textures that do not fit keep page == noPage.
+	// Identical textures share an entry. Pages are pageSize wide and only as
+	// tall as their contents, and get block compressed when any of their
+	// inputs was.
+	static TextureAtlas Build(const std::vector<const Texture*>& textures, uint32_t pageSize = 2048)
+	{
+		TextureAtlas atlas;
+		atlas.placements.assign(textures.size(), Placement{ noPage, glm::vec4(0.f, 0.f, 1.f, 1.f) });
+
+		// Unique contents, tallest first. Hash matches are confirmed since
+		// distinct textures can collide.
+		std::multimap<uint64_t, size_t> unique;
+		std::vector<Entry> entries;
+		std::vector<size_t> entryOf(textures.size(), SIZE_MAX);
+		for (size_t i = 0; i < textures.size(); i++)
+		{
+			if (!Fits(*textures[i]))
+			{
+				continue;
+			}
+			uint64_t hash = textures[i]->contentHash();
+			auto candidates = unique.equal_range(hash);
+			for (auto candidate = candidates.first; candidate != candidates.second; ++candidate)
+			{
+				if (entries[candidate->second].texture->sameContents(*textures[i]))
+				{
+					entryOf[i] = candidate->second;
+					break;
+				}
+			}
+			if (entryOf[i] == SIZE_MAX)
+			{
+				entryOf[i] = entries.size();
+				unique.insert(std::make_pair(hash, entries.size()));
+				entries.push_back(Entry{ textures[i], noPage, 0, 0 });
+			}
+		}
+		std::vector<size_t> order(entries.size());
+		for (size_t i = 0; i < order.size(); i++)
+		{
+			order[i] = i;
+		}
+		std::stable_sort(order.begin(), order.end(), [&entries](size_t a, size_t b)
+		{
+			const Texture& ta = *entries[a].texture;
+			const Texture& tb = *entries[b].texture;
+			return ta.height != tb.height ? ta.height > tb.height : ta.width > tb.width;
+		});
+
+		// sRGB and UNORM textures cannot share a page
+		std::vector<SkylinePacker> packers;
+		std::vector<bool> pageSrgb;
+		for (size_t i : order)
+		{
+			Entry& entry = entries[i];
+			uint32_t w = padded(entry.texture->width);
+			uint32_t h = padded(entry.texture->height);
+			for (size_t page = 0; page <= packers.size(); page++)
+			{
+				if (page == packers.size())
+				{
+					packers.push_back(SkylinePacker(pageSize, pageSize));
+					pageSrgb.push_back(entry.texture->srgb);
+				}
+				if (pageSrgb[page] == entry.texture->srgb && packers[page].insert(w, h, entry.x, entry.y))
+				{
+					entry.page = static_cast<uint32_t>(page);
+					break;
+				}
+			}
+		}
+
+		std::vector<bool> compressed(packers.size(), false);
+		for (size_t page = 0; page < packers.size(); page++)
+		{
+			// Heights are multiples of the gutter, so the trimmed page stays on the grid
+			atlas.pages.push_back(Texture::Create(pageSize, packers[page].usedHeight, pageSrgb[page], pageLevels));
+		}
+		ThreadPool::Shared().parallelFor(entries.size(), [&](size_t i)
+		{
+			entries[i].copyInto(atlas.pages[entries[i].page]);
+		});
+		for (const auto& entry : entries)
+		{
+			compressed[entry.page] = compressed[entry.page] || entry.texture->compression != TextureCompression::None;
+			atlas.entryTexels += static_cast<uint64_t>(entry.texture->width) * entry.texture->height;
+		}
+		for (size_t page = 0; page < atlas.pages.size(); page++)
+		{
+			atlas.pages[page].generateMips();
+			atlas.pageTexels += static_cast<uint64_t>(atlas.pages[page].width) * atlas.pages[page].height;
+			if (compressed[page])
+			{
+				atlas.pages[page].compress(TextureCompression::Auto);
+			}
+		}
+
+		for (size_t i = 0; i < textures.size(); i++)
+		{
+			if (entryOf[i] == SIZE_MAX)
+			{
+				continue;
+			}
+			const Entry& entry = entries[entryOf[i]];
+			const Texture& page = atlas.pages[entry.page];
+			glm::vec2 size(static_cast<float>(page.width), static_cast<float>(page.height));
+			glm::vec2 origin(static_cast<float>(entry.x + gutter), static_cast<float>(entry.y + gutter));
+			glm::vec2 extent(static_cast<float>(entry.texture->width), static_cast<float>(entry.texture->height));
+			// Row 0 is sampled at v = 1, so the entry's v range starts at its bottom row
+			atlas.placements[i].page = entry.page;
+			atlas.placements[i].uvTransform = glm::vec4(origin.x / size.x, 1.f - (origin.y + extent.y) / size.y,
+				extent.x / size.x, extent.y / size.y);
+			atlas.packedCount++;
+		}
+		atlas.uniqueCount = entries.size();
+		return atlas;
+	}
+
+	// Packed textures, pages and how much of the pages' area holds texels
+	std::string statistics() const
+	{
+		char text[192];
+		snprintf(text, sizeof(text), "%zu textures (%zu unique) packed into %zu pages, %.1f%% occupied, images %zu -> %zu",
+			packedCount, uniqueCount, pages.size(), pageTexels == 0 ? 0.0 : 100.0 * entryTexels / pageTexels,
+			packedCount, pages.size());
+		return text;
+	}
+
+	size_t packedCount = 0;
+	size_t uniqueCount = 0;
+	uint64_t entryTexels = 0;
+	uint64_t pageTexels = 0;
+
+private:
+	struct Entry
+	{
+		const Texture* texture;
+		uint32_t page;
+		// Top-left of the gutter
+		uint32_t x;
+		uint32_t y;
+
+		// Writes level 0 and the gutter around it, which repeats the edge
+		void copyInto(Texture& page) const
+		{
+			Texture source = *texture;
+			source.decompress();
+			const uint8_t* src = source.data();
+			uint32_t w = source.width;
+			uint32_t h = source.height;
+			for (uint32_t row = 0; row < padded(h); row++)
+			{
+				uint32_t sy = std::min(row < gutter ? 0 : row - gutter, h - 1);
+				uint8_t* dst = &page.pixels[(static_cast<size_t>(y + row) * page.width + x) * Texture::bytesPerPixel];
+				const uint8_t* line = src + static_cast<size_t>(sy) * w * Texture::bytesPerPixel;
+				for (uint32_t column = 0; column < padded(w); column++)
+				{
+					uint32_t sx = std::min(column < gutter ? 0 : column - gutter, w - 1);
+					memcpy(dst + column * Texture::bytesPerPixel, line + sx * Texture::bytesPerPixel, Texture::bytesPerPixel);
+				}
+			}
+		}
+	};
+
+	// Texels plus a gutter on both sides, rounded up to the gutter grid
+	static uint32_t padded(uint32_t size)
+	{
+		return (size + 3 * gutter - 1) / gutter * gutter;
+	}
+};
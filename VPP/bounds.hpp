@@ -0,0 +1,229 @@
+#pragma once
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstddef>
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "simd.hpp"
+
+// Positions as one array per axis, the layout SIMD reductions want. The
+// arrays are padded to a multiple of four with copies of the last point so
+// the padding never changes a min, max or distance.
+struct PositionStream
+{
+	std::vector<float> x;
+	std::vector<float> y;
+	std::vector<float> z;
+	size_t count;
+
+	template<typename F>
+	static PositionStream Create(size_t count, F position)
+	{
+		PositionStream stream;
+		stream.count = count;
+		size_t padded = (count + 3) & ~static_cast<size_t>(3);
+		stream.x.resize(padded);
+		stream.y.resize(padded);
+		stream.z.resize(padded);
+		for (size_t i = 0; i < padded; i++)
+		{
+			glm::vec3 p = count == 0 ? glm::vec3(0.f) : position(i < count ? i : count - 1);
+			stream.x[i] = p.x;
+			stream.y[i] = p.y;
+			stream.z[i] = p.z;
+		}
+		return stream;
+	}
+
+	glm::vec3 operator[](size_t i) const
+	{
+		return glm::vec3(x[i], y[i], z[i]);
+	}
+
+	size_t paddedCount() const
+	{
+		return x.size();
+	}
+};
+
+class Bounds
+{
+public:
+	static void Aabb(const PositionStream& points, glm::vec3& boundsMin, glm::vec3& boundsMax)
+	{
+		boundsMin = boundsMax = glm::vec3(0.f);
+		if (points.count == 0)
+		{
+			return;
+		}
+#ifdef VPP_SSE2
+		__m128 minX = _mm_set1_ps(FLT_MAX), minY = minX, minZ = minX;
+		__m128 maxX = _mm_set1_ps(-FLT_MAX), maxY = maxX, maxZ = maxX;
+		for (size_t i = 0; i < points.paddedCount(); i += 4)
+		{
+			__m128 x = _mm_loadu_ps(&points.x[i]);
+			__m128 y = _mm_loadu_ps(&points.y[i]);
+			__m128 z = _mm_loadu_ps(&points.z[i]);
+			minX = _mm_min_ps(minX, x);
+			minY = _mm_min_ps(minY, y);
+			minZ = _mm_min_ps(minZ, z);
+			maxX = _mm_max_ps(maxX, x);
+			maxY = _mm_max_ps(maxY, y);
+			maxZ = _mm_max_ps(maxZ, z);
+		}
+		boundsMin = glm::vec3(horizontalMin(minX), horizontalMin(minY), horizontalMin(minZ));
+		boundsMax = glm::vec3(horizontalMax(maxX), horizontalMax(maxY), horizontalMax(maxZ));
+#else
+		boundsMin = boundsMax = points[0];
+		for (size_t i = 1; i < points.count; i++)
+		{
+			boundsMin = glm::min(boundsMin, points[i]);
+			boundsMax = glm::max(boundsMax, points[i]);
+		}
+#endif
+	}
+
+	// Ritter's sphere refined by shrinking and regrowing it a few times
+	// (Ericson, "Real-Time Collision Detection", 4.3.4). Every grow pass
+	// checks four points at a time and only leaves SIMD for the few points
+	// that are still outside, so the result always encloses every point.
+	static void Sphere(const PositionStream& points, glm::vec3& center, float& radius)
+	{
+		center = glm::vec3(0.f);
+		radius = 0.f;
+		if (points.count == 0)
+		{
+			return;
+		}
+		glm::vec3 a = points[farthest(points, points[0])];
+		glm::vec3 b = points[farthest(points, a)];
+		center = (a + b) * 0.5f;
+		radius = glm::length(b - a) * 0.5f;
+		grow(points, center, radius);
+
+		glm::vec3 tryCenter = center;
+		float tryRadius = radius;
+		for (int iteration = 0; iteration < refineIterations; iteration++)
+		{
+			tryRadius *= 0.95f;
+			grow(points, tryCenter, tryRadius);
+			if (tryRadius < radius)
+			{
+				center = tryCenter;
+				radius = tryRadius;
+			}
+		}
+	}
+
+private:
+	static const int refineIterations = 8;
+
+#ifdef VPP_SSE2
+	static float horizontalMin(__m128 v)
+	{
+		v = _mm_min_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 0, 3, 2)));
+		v = _mm_min_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1)));
+		return _mm_cvtss_f32(v);
+	}
+
+	static float horizontalMax(__m128 v)
+	{
+		v = _mm_max_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 0, 3, 2)));
+		v = _mm_max_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1)));
+		return _mm_cvtss_f32(v);
+	}
+
+	static __m128 distanceSquared(const PositionStream& points, size_t i, __m128 cx, __m128 cy, __m128 cz)
+	{
+		__m128 dx = _mm_sub_ps(_mm_loadu_ps(&points.x[i]), cx);
+		__m128 dy = _mm_sub_ps(_mm_loadu_ps(&points.y[i]), cy);
+		__m128 dz = _mm_sub_ps(_mm_loadu_ps(&points.z[i]), cz);
+		return _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+	}
+#endif
+
+	static size_t farthest(const PositionStream& points, const glm::vec3& from)
+	{
+		size_t best = 0;
+		float bestDistance = -1.f;
+#ifdef VPP_SSE2
+		__m128 cx = _mm_set1_ps(from.x), cy = _mm_set1_ps(from.y), cz = _mm_set1_ps(from.z);
+		for (size_t i = 0; i < points.paddedCount(); i += 4)
+		{
+			__m128 d = distanceSquared(points, i, cx, cy, cz);
+			if (_mm_movemask_ps(_mm_cmpgt_ps(d, _mm_set1_ps(bestDistance))) == 0)
+			{
+				continue;
+			}
+			float lanes[4];
+			_mm_storeu_ps(lanes, d);
+			for (size_t k = 0; k < 4; k++)
+			{
+				if (lanes[k] > bestDistance)
+				{
+					bestDistance = lanes[k];
+					best = std::min(i + k, points.count - 1);
+				}
+			}
+		}
+#else
+		for (size_t i = 0; i < points.count; i++)
+		{
+			glm::vec3 d = points[i] - from;
+			float distance = glm::dot(d, d);
+			if (distance > bestDistance)
+			{
+				bestDistance = distance;
+				best = i;
+			}
+		}
+#endif
+		return best;
+	}
+
+	static void growTo(const glm::vec3& p, glm::vec3& center, float& radius)
+	{
+		float distance = glm::length(p - center);
+		if (distance > radius)
+		{
+			float grown = (radius + distance) * 0.5f;
+			center = center + (p - center) * ((grown - radius) / distance);
+			radius = grown;
+		}
+	}
+
+	static void grow(const PositionStream& points, glm::vec3& center, float& radius)
+	{
+#ifdef VPP_SSE2
+		__m128 cx = _mm_set1_ps(center.x), cy = _mm_set1_ps(center.y), cz = _mm_set1_ps(center.z);
+		__m128 r2 = _mm_set1_ps(radius * radius);
+		for (size_t i = 0; i < points.paddedCount(); i += 4)
+		{
+			int outside = _mm_movemask_ps(_mm_cmpgt_ps(distanceSquared(points, i, cx, cy, cz), r2));
+			if (outside == 0)
+			{
+				continue;
+			}
+			for (size_t k = 0; k < 4; k++)
+			{
+				if (outside & (1 << k))
+				{
+					growTo(points[i + k], center, radius);
+				}
+			}
+			cx = _mm_set1_ps(center.x);
+			cy = _mm_set1_ps(center.y);
+			cz = _mm_set1_ps(center.z);
+			r2 = _mm_set1_ps(radius * radius);
+		}
+#else
+		for (size_t i = 0; i < points.count; i++)
+		{
+			growTo(points[i], center, radius);
+		}
+#endif
+	}
+};
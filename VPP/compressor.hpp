@@ -0,0 +1,614 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include "simd.hpp"
+
+// Block formats a texture can be stored in. BC1 keeps RGB in 4 bits per
+// texel, BC3 adds an interpolated alpha block, BC7 is stored as mode 6
+// (RGBA endpoints with 16 interpolation steps) for higher quality at BC3's
+// size. Auto picks BC1 for opaque images and BC3 otherwise.
+enum class TextureCompression : uint32_t
+{
+	None,
+	BC1,
+	BC3,
+	BC7,
+	Auto,
+};
+
+// Encoders and decoders for one 4x4 block. Blocks are 16 RGBA8 texels in
+// row order; encoders write 8 (BC1) or 16 (BC3, BC7) bytes.
+class BlockCompressor
+{
+public:
+	static uint32_t BlockSize(TextureCompression compression)
+	{
+		return compression == TextureCompression::BC1 ? 8 : 16;
+	}
+
+	static void Encode(TextureCompression compression, const uint8_t* texels, uint8_t* out)
+	{
+		switch (compression)
+		{
+		case TextureCompression::BC1:
+			EncodeBC1(texels, out);
+			break;
+		case TextureCompression::BC3:
+			EncodeBC3(texels, out);
+			break;
+		default:
+			EncodeBC7(texels, out);
+			break;
+		}
+	}
+
+	static void Decode(TextureCompression compression, const uint8_t* block, uint8_t* texels)
+	{
+		switch (compression)
+		{
+		case TextureCompression::BC1:
+			DecodeBC1(block, texels);
+			break;
+		case TextureCompression::BC3:
+			DecodeBC3(block, texels);
+			break;
+		default:
+			DecodeBC7(block, texels);
+			break;
+		}
+	}
+
+	// Bounding box endpoints inset by 1/16 of the range (van Waveren,
+	// "Real-Time DXT Compression"), then one least-squares refit of the
+	// endpoints to the chosen indices; whichever fits better is kept.
+	static void EncodeBC1(const uint8_t* texels, uint8_t* out)
+	{
+		uint8_t low[4], high[4];
+		boundingBox(texels, low, high);
+		for (int c = 0; c < 3; c++)
+		{
+			int inset = (high[c] - low[c]) >> 4;
+			low[c] = static_cast<uint8_t>(low[c] + inset);
+			high[c] = static_cast<uint8_t>(high[c] - inset);
+		}
+		uint16_t c0 = pack565(high);
+		uint16_t c1 = pack565(low);
+		uint32_t indices = 0;
+		uint32_t error = fitColors(texels, c0, c1, indices);
+
+		uint16_t refit0, refit1;
+		if (refitColors(texels, indices, refit0, refit1))
+		{
+			uint32_t refitIndices = 0;
+			uint32_t refitError = fitColors(texels, refit0, refit1, refitIndices);
+			if (refitError < error)
+			{
+				c0 = refit0;
+				c1 = refit1;
+				indices = refitIndices;
+			}
+		}
+		writeColorBlock(c0, c1, indices, out);
+	}
+
+	static void EncodeBC3(const uint8_t* texels, uint8_t* out)
+	{
+		encodeAlpha(texels, out);
+		EncodeBC1(texels, out + 8);
+	}
+
+	// Mode 6: endpoints along the principal axis of the block's RGBA,
+	// 7 bits per channel plus a shared low bit per endpoint, 4-bit indices
+	static void EncodeBC7(const uint8_t* texels, uint8_t* out)
+	{
+		float mean[4] = {};
+		for (int i = 0; i < 16; i++)
+		{
+			for (int c = 0; c < 4; c++)
+			{
+				mean[c] += texels[i * 4 + c] / 16.f;
+			}
+		}
+		float covariance[4][4] = {};
+		for (int i = 0; i < 16; i++)
+		{
+			float d[4];
+			for (int c = 0; c < 4; c++)
+			{
+				d[c] = texels[i * 4 + c] - mean[c];
+			}
+			for (int a = 0; a < 4; a++)
+			{
+				for (int b = 0; b < 4; b++)
+				{
+					covariance[a][b] += d[a] * d[b];
+				}
+			}
+		}
+		// Power iteration from the largest diagonal direction
+		float axis[4] = {};
+		int largest = 0;
+		for (int c = 1; c < 4; c++)
+		{
+			largest = covariance[c][c] > covariance[largest][largest] ? c : largest;
+		}
+		axis[largest] = 1.f;
+		for (int iteration = 0; iteration < 8; iteration++)
+		{
+			float next[4] = {};
+			float length = 0.f;
+			for (int a = 0; a < 4; a++)
+			{
+				for (int b = 0; b < 4; b++)
+				{
+					next[a] += covariance[a][b] * axis[b];
+				}
+				length = std::max(length, std::fabs(next[a]));
+			}
+			if (length == 0.f)
+			{
+				break;
+			}
+			for (int c = 0; c < 4; c++)
+			{
+				axis[c] = next[c] / length;
+			}
+		}
+		float minT = 0.f, maxT = 0.f;
+		float axisLength = 0.f;
+		for (int c = 0; c < 4; c++)
+		{
+			axisLength += axis[c] * axis[c];
+		}
+		for (int i = 0; i < 16 && axisLength > 0.f; i++)
+		{
+			float t = 0.f;
+			for (int c = 0; c < 4; c++)
+			{
+				t += (texels[i * 4 + c] - mean[c]) * axis[c];
+			}
+			t /= axisLength;
+			minT = std::min(minT, t);
+			maxT = std::max(maxT, t);
+		}
+
+		uint8_t endpoints[2][4];
+		uint32_t pbits[2];
+		for (int e = 0; e < 2; e++)
+		{
+			float t = e == 0 ? minT : maxT;
+			float value[4];
+			for (int c = 0; c < 4; c++)
+			{
+				value[c] = std::min(255.f, std::max(0.f, mean[c] + t * axis[c]));
+			}
+			quantizeEndpoint(value, endpoints[e], pbits[e]);
+		}
+
+		uint8_t palette[16][4];
+		uint8_t expanded[2][4];
+		for (int e = 0; e < 2; e++)
+		{
+			for (int c = 0; c < 4; c++)
+			{
+				expanded[e][c] = static_cast<uint8_t>((endpoints[e][c] << 1) | pbits[e]);
+			}
+		}
+		for (int i = 0; i < 16; i++)
+		{
+			for (int c = 0; c < 4; c++)
+			{
+				palette[i][c] = interpolate(expanded[0][c], expanded[1][c], bc7Weight(i));
+			}
+		}
+		uint8_t indices[16];
+		for (int i = 0; i < 16; i++)
+		{
+			uint32_t best = UINT32_MAX;
+			for (int p = 0; p < 16; p++)
+			{
+				uint32_t error = distance(&texels[i * 4], palette[p], 4);
+				if (error < best)
+				{
+					best = error;
+					indices[i] = static_cast<uint8_t>(p);
+				}
+			}
+		}
+		// The first index is stored without its top bit
+		if (indices[0] & 8)
+		{
+			std::swap(endpoints[0], endpoints[1]);
+			std::swap(pbits[0], pbits[1]);
+			for (auto& index : indices)
+			{
+				index = static_cast<uint8_t>(15 - index);
+			}
+		}
+
+		BitWriter writer(out);
+		writer.write(1u << 6, 7);
+		for (int c = 0; c < 4; c++)
+		{
+			writer.write(endpoints[0][c], 7);
+			writer.write(endpoints[1][c], 7);
+		}
+		writer.write(pbits[0], 1);
+		writer.write(pbits[1], 1);
+		writer.write(indices[0], 3);
+		for (int i = 1; i < 16; i++)
+		{
+			writer.write(indices[i], 4);
+		}
+	}
+
+	static void DecodeBC1(const uint8_t* block, uint8_t* texels)
+	{
+		decodeColorBlock(block, texels, true);
+	}
+
+	static void DecodeBC3(const uint8_t* block, uint8_t* texels)
+	{
+		decodeColorBlock(block + 8, texels, false);
+		uint8_t alphas[8];
+		alphaPalette(block[0], block[1], alphas);
+		uint64_t bits = 0;
+		for (int i = 0; i < 6; i++)
+		{
+			bits |= static_cast<uint64_t>(block[2 + i]) << (8 * i);
+		}
+		for (int i = 0; i < 16; i++)
+		{
+			texels[i * 4 + 3] = alphas[(bits >> (3 * i)) & 7];
+		}
+	}
+
+	// Only mode 6, which is all EncodeBC7 writes; other modes decode to zero
+	static void DecodeBC7(const uint8_t* block, uint8_t* texels)
+	{
+		memset(texels, 0, 64);
+		if ((block[0] & 0x7f) != (1u << 6))
+		{
+			return;
+		}
+		BitReader reader(block);
+		reader.read(7);
+		uint8_t expanded[2][4];
+		for (int c = 0; c < 4; c++)
+		{
+			expanded[0][c] = static_cast<uint8_t>(reader.read(7) << 1);
+			expanded[1][c] = static_cast<uint8_t>(reader.read(7) << 1);
+		}
+		for (int e = 0; e < 2; e++)
+		{
+			uint32_t pbit = reader.read(1);
+			for (int c = 0; c < 4; c++)
+			{
+				expanded[e][c] |= pbit;
+			}
+		}
+		for (int i = 0; i < 16; i++)
+		{
+			uint32_t index = reader.read(i == 0 ? 3 : 4);
+			for (int c = 0; c < 4; c++)
+			{
+				texels[i * 4 + c] = interpolate(expanded[0][c], expanded[1][c], bc7Weight(index));
+			}
+		}
+	}
+
+private:
+	static uint32_t bc7Weight(uint32_t index)
+	{
+		static const uint8_t weights[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+		return weights[index];
+	}
+
+	struct BitWriter
+	{
+		uint8_t* out;
+		uint32_t position;
+
+		explicit BitWriter(uint8_t* out) : out(out), position(0)
+		{
+			memset(out, 0, 16);
+		}
+
+		void write(uint32_t value, uint32_t bits)
+		{
+			for (uint32_t i = 0; i < bits; i++, position++)
+			{
+				out[position >> 3] |= static_cast<uint8_t>(((value >> i) & 1) << (position & 7));
+			}
+		}
+	};
+
+	struct BitReader
+	{
+		const uint8_t* in;
+		uint32_t position;
+
+		explicit BitReader(const uint8_t* in) : in(in), position(0) {}
+
+		uint32_t read(uint32_t bits)
+		{
+			uint32_t value = 0;
+			for (uint32_t i = 0; i < bits; i++, position++)
+			{
+				value |= ((in[position >> 3] >> (position & 7)) & 1u) << i;
+			}
+			return value;
+		}
+	};
+
+	static uint8_t interpolate(uint8_t e0, uint8_t e1, uint32_t weight)
+	{
+		return static_cast<uint8_t>(((64 - weight) * e0 + weight * e1 + 32) >> 6);
+	}
+
+	static uint32_t distance(const uint8_t* a, const uint8_t* b, int channels)
+	{
+		uint32_t sum = 0;
+		for (int c = 0; c < channels; c++)
+		{
+			int d = a[c] - b[c];
+			sum += d * d;
+		}
+		return sum;
+	}
+
+	static void boundingBox(const uint8_t* texels, uint8_t* low, uint8_t* high)
+	{
+#ifdef VPP_SSE2
+		__m128i minimum = _mm_loadu_si128(reinterpret_cast<const __m128i*>(texels));
+		__m128i maximum = minimum;
+		for (int i = 1; i < 4; i++)
+		{
+			__m128i row = _mm_loadu_si128(reinterpret_cast<const __m128i*>(texels + 16 * i));
+			minimum = _mm_min_epu8(minimum, row);
+			maximum = _mm_max_epu8(maximum, row);
+		}
+		minimum = _mm_min_epu8(minimum, _mm_shuffle_epi32(minimum, _MM_SHUFFLE(1, 0, 3, 2)));
+		minimum = _mm_min_epu8(minimum, _mm_shuffle_epi32(minimum, _MM_SHUFFLE(2, 3, 0, 1)));
+		maximum = _mm_max_epu8(maximum, _mm_shuffle_epi32(maximum, _MM_SHUFFLE(1, 0, 3, 2)));
+		maximum = _mm_max_epu8(maximum, _mm_shuffle_epi32(maximum, _MM_SHUFFLE(2, 3, 0, 1)));
+		uint32_t packedLow = static_cast<uint32_t>(_mm_cvtsi128_si32(minimum));
+		uint32_t packedHigh = static_cast<uint32_t>(_mm_cvtsi128_si32(maximum));
+		memcpy(low, &packedLow, 4);
+		memcpy(high, &packedHigh, 4);
+#else
+		memcpy(low, texels, 4);
+		memcpy(high, texels, 4);
+		for (int i = 1; i < 16; i++)
+		{
+			for (int c = 0; c < 4; c++)
+			{
+				low[c] = std::min(low[c], texels[i * 4 + c]);
+				high[c] = std::max(high[c], texels[i * 4 + c]);
+			}
+		}
+#endif
+	}
+
+	static uint16_t pack565(const uint8_t* color)
+	{
+		return static_cast<uint16_t>(((color[0] * 31 + 127) / 255) << 11 | ((color[1] * 63 + 127) / 255) << 5 | ((color[2] * 31 + 127) / 255));
+	}
+
+	static void unpack565(uint16_t packed, uint8_t* color)
+	{
+		uint32_t r = (packed >> 11) & 31, g = (packed >> 5) & 63, b = packed & 31;
+		color[0] = static_cast<uint8_t>((r << 3) | (r >> 2));
+		color[1] = static_cast<uint8_t>((g << 2) | (g >> 4));
+		color[2] = static_cast<uint8_t>((b << 3) | (b >> 2));
+		color[3] = 255;
+	}
+
+	// Four-color palette in BC1 index order: c0, c1, 2/3 c0 + 1/3 c1, 1/3 c0 + 2/3 c1
+	static void colorPalette(uint16_t c0, uint16_t c1, uint8_t palette[4][4], bool allowTransparent)
+	{
+		unpack565(c0, palette[0]);
+		unpack565(c1, palette[1]);
+		bool fourColors = !allowTransparent || c0 > c1;
+		for (int c = 0; c < 3; c++)
+		{
+			if (fourColors)
+			{
+				palette[2][c] = static_cast<uint8_t>((2 * palette[0][c] + palette[1][c]) / 3);
+				palette[3][c] = static_cast<uint8_t>((palette[0][c] + 2 * palette[1][c]) / 3);
+			}
+			else
+			{
+				palette[2][c] = static_cast<uint8_t>((palette[0][c] + palette[1][c]) / 2);
+				palette[3][c] = 0;
+			}
+		}
+		palette[2][3] = 255;
+		palette[3][3] = fourColors ? 255 : 0;
+	}
+
+	// Orders the endpoints for four-color mode, picks the nearest palette
+	// entry per texel and returns the total squared error
+	static uint32_t fitColors(const uint8_t* texels, uint16_t& c0, uint16_t& c1, uint32_t& indices)
+	{
+		if (c0 < c1)
+		{
+			std::swap(c0, c1);
+		}
+		uint8_t palette[4][4];
+		colorPalette(c0, c1, palette, false);
+		uint32_t total = 0;
+		indices = 0;
+		for (int i = 0; i < 16; i++)
+		{
+			uint32_t best = UINT32_MAX;
+			uint32_t index = 0;
+			for (uint32_t p = 0; p < (c0 == c1 ? 1u : 4u); p++)
+			{
+				uint32_t error = distance(&texels[i * 4], palette[p], 3);
+				if (error < best)
+				{
+					best = error;
+					index = p;
+				}
+			}
+			indices |= index << (2 * i);
+			total += best;
+		}
+		return total;
+	}
+
+	// Least-squares endpoints for fixed indices: every texel is
+	// alpha * c0 + beta * c1 with (alpha, beta) given by its index
+	static bool refitColors(const uint8_t* texels, uint32_t indices, uint16_t& c0, uint16_t& c1)
+	{
+		static const float alphas[4] = { 1.f, 0.f, 2.f / 3.f, 1.f / 3.f };
+		float aa = 0.f, bb = 0.f, ab = 0.f;
+		float ax[3] = {}, bx[3] = {};
+		for (int i = 0; i < 16; i++)
+		{
+			float alpha = alphas[(indices >> (2 * i)) & 3];
+			float beta = 1.f - alpha;
+			aa += alpha * alpha;
+			bb += beta * beta;
+			ab += alpha * beta;
+			for (int c = 0; c < 3; c++)
+			{
+				ax[c] += alpha * texels[i * 4 + c];
+				bx[c] += beta * texels[i * 4 + c];
+			}
+		}
+		float determinant = aa * bb - ab * ab;
+		if (std::fabs(determinant) < 1e-6f)
+		{
+			return false;
+		}
+		uint8_t e0[4] = {}, e1[4] = {};
+		for (int c = 0; c < 3; c++)
+		{
+			float v0 = (ax[c] * bb - bx[c] * ab) / determinant;
+			float v1 = (bx[c] * aa - ax[c] * ab) / determinant;
+			e0[c] = static_cast<uint8_t>(std::min(255.f, std::max(0.f, v0 + 0.5f)));
+			e1[c] = static_cast<uint8_t>(std::min(255.f, std::max(0.f, v1 + 0.5f)));
+		}
+		c0 = pack565(e0);
+		c1 = pack565(e1);
+		return true;
+	}
+
+	static void writeColorBlock(uint16_t c0, uint16_t c1, uint32_t indices, uint8_t* out)
+	{
+		out[0] = static_cast<uint8_t>(c0);
+		out[1] = static_cast<uint8_t>(c0 >> 8);
+		out[2] = static_cast<uint8_t>(c1);
+		out[3] = static_cast<uint8_t>(c1 >> 8);
+		for (int i = 0; i < 4; i++)
+		{
+			out[4 + i] = static_cast<uint8_t>(indices >> (8 * i));
+		}
+	}
+
+	static uint32_t readIndices(const uint8_t* block)
+	{
+		return block[4] | (block[5] << 8) | (block[6] << 16) | (static_cast<uint32_t>(block[7]) << 24);
+	}
+
+	static void decodeColorBlock(const uint8_t* block, uint8_t* texels, bool allowTransparent)
+	{
+		uint16_t c0 = static_cast<uint16_t>(block[0] | (block[1] << 8));
+		uint16_t c1 = static_cast<uint16_t>(block[2] | (block[3] << 8));
+		uint8_t palette[4][4];
+		colorPalette(c0, c1, palette, allowTransparent);
+		uint32_t indices = readIndices(block);
+		for (int i = 0; i < 16; i++)
+		{
+			memcpy(&texels[i * 4], palette[(indices >> (2 * i)) & 3], 4);
+		}
+	}
+
+	// Eight-value palette with a0 > a1, or six values plus 0 and 255 otherwise
+	static void alphaPalette(uint8_t a0, uint8_t a1, uint8_t* alphas)
+	{
+		alphas[0] = a0;
+		alphas[1] = a1;
+		if (a0 > a1)
+		{
+			for (int i = 1; i < 7; i++)
+			{
+				alphas[i + 1] = static_cast<uint8_t>(((7 - i) * a0 + i * a1) / 7);
+			}
+		}
+		else
+		{
+			for (int i = 1; i < 5; i++)
+			{
+				alphas[i + 1] = static_cast<uint8_t>(((5 - i) * a0 + i * a1) / 5);
+			}
+			alphas[6] = 0;
+			alphas[7] = 255;
+		}
+	}
+
+	static void encodeAlpha(const uint8_t* texels, uint8_t* out)
+	{
+		uint8_t a0 = 0, a1 = 255;
+		for (int i = 0; i < 16; i++)
+		{
+			a0 = std::max(a0, texels[i * 4 + 3]);
+			a1 = std::min(a1, texels[i * 4 + 3]);
+		}
+		uint8_t alphas[8];
+		alphaPalette(a0, a1, alphas);
+		uint64_t bits = 0;
+		for (int i = 0; i < 16; i++)
+		{
+			uint32_t best = UINT32_MAX;
+			uint64_t index = 0;
+			for (uint32_t p = 0; p < (a0 == a1 ? 1u : 8u); p++)
+			{
+				uint32_t error = static_cast<uint32_t>(std::abs(texels[i * 4 + 3] - alphas[p]));
+				if (error < best)
+				{
+					best = error;
+					index = p;
+				}
+			}
+			bits |= index << (3 * i);
+		}
+		out[0] = a0;
+		out[1] = a1;
+		for (int i = 0; i < 6; i++)
+		{
+			out[2 + i] = static_cast<uint8_t>(bits >> (8 * i));
+		}
+	}
+
+	// Picks the shared low bit that reconstructs the endpoint best
+	static void quantizeEndpoint(const float* value, uint8_t* endpoint, uint32_t& pbit)
+	{
+		float bestError = -1.f;
+		for (uint32_t p = 0; p < 2; p++)
+		{
+			uint8_t candidate[4];
+			float error = 0.f;
+			for (int c = 0; c < 4; c++)
+			{
+				float q = std::floor((value[c] - p) / 2.f + 0.5f);
+				candidate[c] = static_cast<uint8_t>(std::min(127.f, std::max(0.f, q)));
+				float d = static_cast<float>((candidate[c] << 1) | p) - value[c];
+				error += d * d;
+			}
+			if (bestError < 0.f || error < bestError)
+			{
+				bestError = error;
+				pbit = p;
+				memcpy(endpoint, candidate, 4);
+			}
+		}
+	}
+};
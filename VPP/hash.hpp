@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// 64-bit FNV-1a style hashing used to key caches on content. Bytes() folds
+// eight bytes per multiply so it keeps up with large asset files. A multiply
+// only carries bits upward, so each step also folds the high half back down
+// and the result goes through a finalizer; otherwise edits to the last byte
+// of a word would only reach the top bits of the hash. Keys are still only
+// keys: caches confirm a hit against the data it stands for.
+class Hash
+{
+public:
+	static const uint64_t seed = 14695981039346656037ull;
+	static const uint64_t prime = 1099511628211ull;
+
+	static uint64_t Bytes(const void* data, size_t size, uint64_t hash = seed)
+	{
+		const uint8_t* bytes = static_cast<const uint8_t*>(data);
+		size_t words = size / sizeof(uint64_t);
+		for (size_t i = 0; i < words; i++)
+		{
+			uint64_t word;
+			memcpy(&word, bytes + i * sizeof(uint64_t), sizeof(uint64_t));
+			hash = (hash ^ word) * prime;
+			hash ^= hash >> 32;
+		}
+		for (size_t i = words * sizeof(uint64_t); i < size; i++)
+		{
+			hash = (hash ^ bytes[i]) * prime;
+		}
+		return Mix(hash);
+	}
+
+	// MurmurHash3's 64-bit finalizer: every input bit affects every output bit
+	static uint64_t Mix(uint64_t hash)
+	{
+		hash ^= hash >> 33;
+		hash *= 0xFF51AFD7ED558CCDull;
+		hash ^= hash >> 33;
+		hash *= 0xC4CEB9FE1A85EC53ull;
+		return hash ^ (hash >> 33);
+	}
+
+	template<typename T>
+	static uint64_t Value(const T& value, uint64_t hash = seed)
+	{
+		return Bytes(&value, sizeof(T), hash);
+	}
+
+	static uint64_t Combine(uint64_t hash, uint64_t value)
+	{
+		return Mix(hash ^ (value + 0x9E3779B97F4A7C15ull + (hash << 6) + (hash >> 2)));
+	}
+};
@@ -6,6 +6,12 @@
 #include <vector>
 #include <memory>
 #include <cstdarg>
+#include <cstring>
+#include <algorithm>
+#include <map>
+#include <string>
+#include "allocator.hpp"
+#include "texture.hpp"
 #include "utility.hpp"
 
 class Instance
@@ -174,19 +180,65 @@ public:
 		queueCI[0].setQueueFamilyIndex(queueFamilyIndex);
 		queueCI[0].setQueueCount(1);
 
+		// Anisotropic filtering and BC textures are optional; samplers clamp to
+		// what is enabled here and textures fall back to RGBA8
+		vk::PhysicalDeviceFeatures supported = gpu.getFeatures();
+		vk::PhysicalDeviceFeatures enabledFeatures = vk::PhysicalDeviceFeatures();
+		enabledFeatures.setSamplerAnisotropy(supported.samplerAnisotropy);
+		enabledFeatures.setTextureCompressionBC(supported.textureCompressionBC);
+		maxSamplerAnisotropy = supported.samplerAnisotropy ? gpu.getProperties().limits.maxSamplerAnisotropy : 1.f;
+
+		// Bindless textures need a runtime sized, partially bound sampler array
+		// that shaders index with the push constant
+		auto indexingEnabled = vk::PhysicalDeviceDescriptorIndexingFeaturesEXT();
+		if (supportsDeviceExtension("VK_EXT_descriptor_indexing"))
+		{
+			auto indexing = vk::PhysicalDeviceDescriptorIndexingFeaturesEXT();
+			auto features2 = vk::PhysicalDeviceFeatures2().setPNext(&indexing);
+			gpu.getFeatures2(&features2);
+			descriptorIndexing = indexing.runtimeDescriptorArray && indexing.descriptorBindingPartiallyBound
+				&& supported.shaderSampledImageArrayDynamicIndexing;
+			if (descriptorIndexing)
+			{
+				enabledExtensions.push_back("VK_EXT_descriptor_indexing");
+				enabledFeatures.setShaderSampledImageArrayDynamicIndexing(VK_TRUE);
+				indexingEnabled.setRuntimeDescriptorArray(VK_TRUE);
+				indexingEnabled.setDescriptorBindingPartiallyBound(VK_TRUE);
+			}
+		}
+
 		vk::DeviceCreateInfo deviceCI = vk::DeviceCreateInfo()
+			.setPNext(descriptorIndexing ? &indexingEnabled : nullptr)
 			.setQueueCreateInfoCount(1)
 			.setPQueueCreateInfos(queueCI)
 			.setEnabledExtensionCount(enabledExtensions.size())
 			.setPpEnabledExtensionNames(enabledExtensions.data())
 			.setEnabledLayerCount(0)
 			.setPpEnabledLayerNames(nullptr)
-			.setPEnabledFeatures(nullptr);
+			.setPEnabledFeatures(&enabledFeatures);
 		
 		result = gpu.createDevice(&deviceCI, nullptr, &device);
 		assert(result == vk::Result::eSuccess);
 	}
 
+	bool supportsDeviceExtension(const char* name)
+	{
+		uint32_t count = 0;
+		auto result = gpu.enumerateDeviceExtensionProperties(nullptr, &count, static_cast<vk::ExtensionProperties*>(nullptr));
+		assert(result == vk::Result::eSuccess);
+		std::vector<vk::ExtensionProperties> extensions(count);
+		result = gpu.enumerateDeviceExtensionProperties(nullptr, &count, extensions.data());
+		assert(result == vk::Result::eSuccess);
+		for (const auto& extension : extensions)
+		{
+			if (strcmp(extension.extensionName, name) == 0)
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+
 	void createCommmandPool()
 	{
 		assert(device);
@@ -276,6 +328,7 @@ public:
 		vk::ColorSpaceKHR colorspace;
 		format = surfaceFormats[0].format;
 		colorspace = surfaceFormats[0].colorSpace;
+		swapchainFormat = format;
 
 		vk::Extent2D swapchainExtent;
 		if (surfaceCapabilities.currentExtent.width == (uint32_t)-1)
@@ -387,7 +440,7 @@ public:
 	}
 
 	void setImageLayout(vk::Image image, vk::ImageAspectFlags aspectMask, vk::ImageLayout oldLayout, vk::ImageLayout newLayout,
-		vk::AccessFlags srcAccessMask, vk::PipelineStageFlags src_stages, vk::PipelineStageFlags dest_stages) {
+		vk::AccessFlags srcAccessMask, vk::PipelineStageFlags src_stages, vk::PipelineStageFlags dest_stages, uint32_t levelCount = 1) {
 		assert(commandBuffers.base);
 
 		auto DstAccessMask = [](vk::ImageLayout const &layout) {
@@ -430,18 +483,103 @@ public:
 			.setSrcQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED)
 			.setDstQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED)
 			.setImage(image)
-			.setSubresourceRange(vk::ImageSubresourceRange(aspectMask, 0, 1, 0, 1));
+			.setSubresourceRange(vk::ImageSubresourceRange(aspectMask, 0, levelCount, 0, 1));
 
 		commandBuffers.base.pipelineBarrier(src_stages, dest_stages, vk::DependencyFlagBits(), 0, nullptr, 0, nullptr, 1, &barrier);
 	}
 
-	void createSampledImage(vk::Device& device, ImageMemory& imageMemory, 
-		vk::Format format, uint32_t width, uint32_t height, void* pData, uint32_t size)
-	{	
+	// Creates an optimally tiled, DEVICE_LOCAL image with one mip per entry of
+	// levels and records the copies from the staging ring on the setup
+	// command buffer. The image is left in SHADER_READ_ONLY_OPTIMAL.
+	void createSampledImage(vk::Device& device, ImageMemory& imageMemory, vk::Format format,
+		const void* pData, const std::vector<MipLevel>& levels)
+	{
+		assert(commandBuffers.base);
+		assert(!levels.empty());
+		uint32_t levelCount = static_cast<uint32_t>(levels.size());
+
+		auto imageCI = vk::ImageCreateInfo()
+			.setImageType(vk::ImageType::e2D)
+			.setFormat(format)
+			.setExtent({ levels[0].width, levels[0].height, 1 })
+			.setMipLevels(levelCount)
+			.setArrayLayers(1)
+			.setSamples(vk::SampleCountFlagBits::e1)
+			.setTiling(vk::ImageTiling::eOptimal)
+			.setUsage(vk::ImageUsageFlagBits::eSampled | vk::ImageUsageFlagBits::eTransferDst)
+			.setSharingMode(vk::SharingMode::eExclusive)
+			.setQueueFamilyIndexCount(0)
+			.setPQueueFamilyIndices(nullptr)
+			.setInitialLayout(vk::ImageLayout::eUndefined);
+
+		auto result = device.createImage(&imageCI, nullptr, &imageMemory.image);
+		assert(result == vk::Result::eSuccess);
+
+		vk::MemoryRequirements req;
+		device.getImageMemoryRequirements(imageMemory.image, &req);
+
+		vk::MemoryAllocateInfo memoryAI = vk::MemoryAllocateInfo();
+		memoryAI.setAllocationSize(req.size);
+		memoryAI.setMemoryTypeIndex(0);
+		auto pass = GetPhysicalMemoryType(gpu, req, vk::MemoryPropertyFlagBits::eDeviceLocal, memoryAI.memoryTypeIndex);
+		assert(pass == true);
+		result = device.allocateMemory(&memoryAI, nullptr, &imageMemory.memory);
+		assert(result == vk::Result::eSuccess);
+
+		device.bindImageMemory(imageMemory.image, imageMemory.memory, 0);
+
+		// The levels are tightly packed in pData, so the row length is the
+		// level width. Offsets stay multiples of the texel block size.
+		const MipLevel& last = levels.back();
+		vk::DeviceSize size = last.offset + last.size;
+		vk::Buffer stagingBuffer;
+		vk::DeviceSize stagingOffset = 0;
+		char* dst = stage(size, staging.copyAlignment, stagingBuffer, stagingOffset);
+		memcpy(dst, pData, static_cast<size_t>(size));
+
+		// Row length is in texels and has to cover whole 4x4 blocks
+		uint32_t blockMask = format >= vk::Format::eBc1RgbUnormBlock && format <= vk::Format::eBc7SrgbBlock ? 3 : 0;
+		std::vector<vk::BufferImageCopy> regions(levelCount);
+		for (uint32_t i = 0; i < levelCount; i++)
+		{
+			regions[i] = vk::BufferImageCopy()
+				.setBufferOffset(stagingOffset + levels[i].offset)
+				.setBufferRowLength((levels[i].width + blockMask) & ~blockMask)
+				.setBufferImageHeight((levels[i].height + blockMask) & ~blockMask)
+				.setImageSubresource(vk::ImageSubresourceLayers(vk::ImageAspectFlagBits::eColor, i, 0, 1))
+				.setImageOffset({ 0, 0, 0 })
+				.setImageExtent({ levels[i].width, levels[i].height, 1 });
+		}
+		setImageLayout(imageMemory.image, vk::ImageAspectFlagBits::eColor, vk::ImageLayout::eUndefined,
+			vk::ImageLayout::eTransferDstOptimal, vk::AccessFlags(), vk::PipelineStageFlagBits::eTopOfPipe,
+			vk::PipelineStageFlagBits::eTransfer, levelCount);
+		commandBuffers.base.copyBufferToImage(stagingBuffer, imageMemory.image, vk::ImageLayout::eTransferDstOptimal,
+			levelCount, regions.data());
+		setImageLayout(imageMemory.image, vk::ImageAspectFlagBits::eColor, vk::ImageLayout::eTransferDstOptimal,
+			vk::ImageLayout::eShaderReadOnlyOptimal, vk::AccessFlagBits::eTransferWrite, vk::PipelineStageFlagBits::eTransfer,
+			vk::PipelineStageFlagBits::eFragmentShader, levelCount);
+
+		auto const imageViewCI = vk::ImageViewCreateInfo()
+			.setImage(imageMemory.image)
+			.setViewType(vk::ImageViewType::e2D)
+			.setFormat(format)
+			.setSubresourceRange(vk::ImageSubresourceRange(vk::ImageAspectFlagBits::eColor, 0, levelCount, 0, 1));
+
+		result = device.createImageView(&imageViewCI, nullptr, &imageMemory.view);
+		assert(result == vk::Result::eSuccess);
+	}
+
+	// The old path, kept to compare sampling cost: a linearly tiled image in
+	// HOST_VISIBLE memory written in place. Linear images only get the top
+	// level and uncompressed formats.
+	void createLinearImage(vk::Device& device, ImageMemory& imageMemory, vk::Format format, const void* pData, const MipLevel& level)
+	{
+		assert(commandBuffers.base);
+
 		auto imageCI = vk::ImageCreateInfo()
 			.setImageType(vk::ImageType::e2D)
-			.setFormat(vk::Format::eR32G32B32A32Sfloat)
-			.setExtent({ width, height, 1 })
+			.setFormat(format)
+			.setExtent({ level.width, level.height, 1 })
 			.setMipLevels(1)
 			.setArrayLayers(1)
 			.setSamples(vk::SampleCountFlagBits::e1)
@@ -461,31 +599,39 @@ public:
 		vk::MemoryAllocateInfo memoryAI = vk::MemoryAllocateInfo();
 		memoryAI.setAllocationSize(req.size);
 		memoryAI.setMemoryTypeIndex(0);
-		auto memType = vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent;
-		auto pass = GetPhysicalMemoryType(gpu, req, memType, memoryAI.memoryTypeIndex);
+		auto pass = GetPhysicalMemoryType(gpu, req, vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent,
+			memoryAI.memoryTypeIndex);
 		assert(pass == true);
 		result = device.allocateMemory(&memoryAI, nullptr, &imageMemory.memory);
 		assert(result == vk::Result::eSuccess);
 
 		device.bindImageMemory(imageMemory.image, imageMemory.memory, 0);
 
-		if (memType & vk::MemoryPropertyFlagBits::eHostVisible) {
-			auto subres = vk::ImageSubresource()
-				.setAspectMask(vk::ImageAspectFlagBits::eColor)
-				.setMipLevel(0)
-				.setArrayLayer(0);
-			vk::SubresourceLayout layout;
-			device.getImageSubresourceLayout(imageMemory.image, &subres, &layout);
-
-			auto ptr = device.mapMemory(imageMemory.memory, 0, req.size);
-			assert(ptr != nullptr);
-			memcpy(ptr, pData, size);
-			device.unmapMemory(imageMemory.memory);
+		auto subres = vk::ImageSubresource()
+			.setAspectMask(vk::ImageAspectFlagBits::eColor)
+			.setMipLevel(0)
+			.setArrayLayer(0);
+		vk::SubresourceLayout layout;
+		device.getImageSubresourceLayout(imageMemory.image, &subres, &layout);
+
+		auto ptr = static_cast<char*>(device.mapMemory(imageMemory.memory, 0, req.size));
+		assert(ptr != nullptr);
+		// Linear images pad their rows to the driver's pitch, pData is tightly packed
+		size_t rowSize = static_cast<size_t>(level.size / level.height);
+		for (uint32_t row = 0; row < level.height; row++)
+		{
+			memcpy(ptr + layout.offset + row * layout.rowPitch, static_cast<const char*>(pData) + level.offset + row * rowSize, rowSize);
 		}
+		device.unmapMemory(imageMemory.memory);
+
+		setImageLayout(imageMemory.image, vk::ImageAspectFlagBits::eColor, vk::ImageLayout::ePreinitialized,
+			vk::ImageLayout::eShaderReadOnlyOptimal, vk::AccessFlagBits::eHostWrite, vk::PipelineStageFlagBits::eHost,
+			vk::PipelineStageFlagBits::eFragmentShader);
+
 		auto const imageViewCI = vk::ImageViewCreateInfo()
 			.setImage(imageMemory.image)
 			.setViewType(vk::ImageViewType::e2D)
-			.setFormat(vk::Format::eR32G32B32A32Sfloat)
+			.setFormat(format)
 			.setSubresourceRange(vk::ImageSubresourceRange(vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1));
 
 		result = device.createImageView(&imageViewCI, nullptr, &imageMemory.view);
@@ -664,6 +810,25 @@ public:
 	}
 
 	void Prepared()
+	{
+		submitUploads();
+		device.freeCommandBuffers(commandPool, commandBuffers.base);
+		commandBuffers.base = vk::CommandBuffer();
+		prepared = true;
+	}
+
+	// Runs everything recorded on the setup command buffer so far and
+	// starts recording again, which frees the whole staging ring
+	void flushUploads()
+	{
+		submitUploads();
+		auto cmdBI = vk::CommandBufferBeginInfo()
+			.setPInheritanceInfo(nullptr);
+		auto result = commandBuffers.base.begin(&cmdBI);
+		assert(result == vk::Result::eSuccess);
+	}
+
+	void submitUploads()
 	{
 		commandBuffers.base.end();
 		auto fenceInfo = vk::FenceCreateInfo();
@@ -683,9 +848,12 @@ public:
 		assert(result == vk::Result::eSuccess);
 
 		device.destroyFence(fence, nullptr);
-		device.freeCommandBuffers(commandPool, commandBuffers.base);
-		commandBuffers.base = vk::CommandBuffer();
-		prepared = true;
+		for (auto& oversized : stagingBuffers)
+		{
+			destroyBuffer(device, oversized);
+		}
+		stagingBuffers.clear();
+		staging.head = 0;
 	}
 
 	std::vector<vk::DescriptorSet> createDescriptorSets(vk::Device& device, 
@@ -788,29 +956,204 @@ public:
 
 		return  descriptorSets;
 	}
-	vk::Sampler createSampler(vk::Device& device)
+
+	// One set per layout, each holding a single descriptor of type
+	std::vector<vk::DescriptorSet> allocateDescriptorSets(vk::Device& device, const std::vector<vk::DescriptorSetLayout>& layouts,
+		vk::DescriptorType type)
+	{
+		vk::DescriptorPool descriptorPool;
+		auto poolSize = vk::DescriptorPoolSize()
+			.setType(type)
+			.setDescriptorCount(static_cast<uint32_t>(layouts.size()));
+		auto descriptorPoolCI = vk::DescriptorPoolCreateInfo()
+			.setMaxSets(static_cast<uint32_t>(layouts.size()))
+			.setPoolSizeCount(1)
+			.setPPoolSizes(&poolSize);
+		auto result = device.createDescriptorPool(&descriptorPoolCI, nullptr, &descriptorPool);
+		assert(result == vk::Result::eSuccess);
+
+		std::vector<vk::DescriptorSet> descriptorSets(layouts.size());
+		auto descriptorSetAI = vk::DescriptorSetAllocateInfo()
+			.setDescriptorPool(descriptorPool)
+			.setDescriptorSetCount(static_cast<uint32_t>(layouts.size()))
+			.setPSetLayouts(layouts.data());
+		result = device.allocateDescriptorSets(&descriptorSetAI, descriptorSets.data());
+		assert(result == vk::Result::eSuccess);
+		return descriptorSets;
+	}
+
+	// Bindless textures: a single set whose binding 0 is a partially bound
+	// array of combined image samplers. Textures are registered once and
+	// draws select theirs with a push constant, so set 1 never changes
+	// between draws. Returns false when descriptor indexing is missing.
+	bool initBindless(uint32_t capacity)
+	{
+		if (!descriptorIndexing)
+		{
+			return false;
+		}
+		auto limits = gpu.getProperties().limits;
+		capacity = std::min(capacity, std::min(limits.maxPerStageDescriptorSampledImages, limits.maxPerStageDescriptorSamplers));
+		// Devices that only allow a handful of samplers per stage keep one
+		// set per object
+		if (capacity < minBindlessCapacity)
+		{
+			return false;
+		}
+
+		vk::DescriptorBindingFlagsEXT bindingFlags = vk::DescriptorBindingFlagBitsEXT::ePartiallyBound;
+		auto bindingFlagsCI = vk::DescriptorSetLayoutBindingFlagsCreateInfoEXT()
+			.setBindingCount(1)
+			.setPBindingFlags(&bindingFlags);
+		auto binding = vk::DescriptorSetLayoutBinding()
+			.setBinding(0)
+			.setDescriptorType(vk::DescriptorType::eCombinedImageSampler)
+			.setDescriptorCount(capacity)
+			.setStageFlags(vk::ShaderStageFlagBits::eFragment)
+			.setPImmutableSamplers(nullptr);
+		auto descriptorLayoutCI = vk::DescriptorSetLayoutCreateInfo()
+			.setPNext(&bindingFlagsCI)
+			.setBindingCount(1)
+			.setPBindings(&binding);
+		auto result = device.createDescriptorSetLayout(&descriptorLayoutCI, nullptr, &bindless.layout);
+		assert(result == vk::Result::eSuccess);
+
+		bindless.capacity = capacity;
+		bindless.set = createBindlessSet(bindless.pool);
+		return true;
+	}
+
+	// A set of the bindless layout from a pool of its own, for objects whose
+	// texture did not fit in the shared array. Only element 0 gets written.
+	vk::DescriptorSet allocateBindlessSet()
+	{
+		vk::DescriptorPool pool;
+		vk::DescriptorSet set = createBindlessSet(pool);
+		bindless.fallbackPools.push_back(pool);
+		return set;
+	}
+
+	// Partially bound arrays still take their full size from the pool
+	vk::DescriptorSet createBindlessSet(vk::DescriptorPool& pool)
+	{
+		auto poolSize = vk::DescriptorPoolSize()
+			.setType(vk::DescriptorType::eCombinedImageSampler)
+			.setDescriptorCount(bindless.capacity);
+		auto descriptorPoolCI = vk::DescriptorPoolCreateInfo()
+			.setMaxSets(1)
+			.setPoolSizeCount(1)
+			.setPPoolSizes(&poolSize);
+		auto result = device.createDescriptorPool(&descriptorPoolCI, nullptr, &pool);
+		assert(result == vk::Result::eSuccess);
+
+		vk::DescriptorSet set;
+		auto descriptorSetAI = vk::DescriptorSetAllocateInfo()
+			.setDescriptorPool(pool)
+			.setDescriptorSetCount(1)
+			.setPSetLayouts(&bindless.layout);
+		result = device.allocateDescriptorSets(&descriptorSetAI, &set);
+		assert(result == vk::Result::eSuccess);
+		return set;
+	}
+
+	// Replaces set 1 of a layout made by createDescriptorSets with the
+	// bindless array and adds the per-draw texture index push constant
+	void createBindlessPipelineLayout(vk::Device& device, vk::PipelineLayout& pipelineLayout,
+		std::vector<vk::DescriptorSetLayout>& descriptorSetLayouts)
+	{
+		assert(bindless.layout);
+		device.destroyPipelineLayout(pipelineLayout);
+		descriptorSetLayouts[1] = bindless.layout;
+
+		auto pushConstantRange = vk::PushConstantRange()
+			.setStageFlags(vk::ShaderStageFlagBits::eFragment)
+			.setOffset(0)
+			.setSize(sizeof(uint32_t));
+		auto pipelineLayoutCI = vk::PipelineLayoutCreateInfo()
+			.setSetLayoutCount(static_cast<uint32_t>(descriptorSetLayouts.size()))
+			.setPSetLayouts(descriptorSetLayouts.data())
+			.setPushConstantRangeCount(1)
+			.setPPushConstantRanges(&pushConstantRange);
+		auto result = device.createPipelineLayout(&pipelineLayoutCI, nullptr, &pipelineLayout);
+		assert(result == vk::Result::eSuccess);
+	}
+
+	// Sets slot to the array slot of the image, assigning a new one the
+	// first time it is seen. The caller writes bindless.images[slot] into
+	// the slot. Returns false once the array is full; the caller then needs
+	// a set of its own from allocateBindlessSet.
+	bool registerBindless(const ImageMemory& imageMemory, uint32_t& slot)
+	{
+		auto key = std::make_pair(imageMemory.view, imageMemory.sampler);
+		auto found = bindless.slots.find(key);
+		if (found != bindless.slots.end())
+		{
+			slot = found->second;
+			return true;
+		}
+		if (bindless.images.size() >= bindless.capacity)
+		{
+			return false;
+		}
+		slot = static_cast<uint32_t>(bindless.images.size());
+		bindless.slots.insert(std::make_pair(key, slot));
+		bindless.images.push_back(imageMemory);
+		return true;
+	}
+
+	void destroyBindless()
+	{
+		for (auto& pool : bindless.fallbackPools)
+		{
+			device.destroyDescriptorPool(pool);
+		}
+		device.destroyDescriptorPool(bindless.pool);
+		device.destroyDescriptorSetLayout(bindless.layout);
+		bindless = Bindless();
+	}
+	// True when an image of format can be sampled with linear filtering
+	bool supportsSampledImage(vk::Format format, vk::ImageTiling tiling = vk::ImageTiling::eOptimal)
+	{
+		auto properties = gpu.getFormatProperties(format);
+		auto features = tiling == vk::ImageTiling::eOptimal ? properties.optimalTilingFeatures : properties.linearTilingFeatures;
+		return (features & vk::FormatFeatureFlagBits::eSampledImage)
+			&& (features & vk::FormatFeatureFlagBits::eSampledImageFilterLinear);
+	}
+
+	// Trilinear over mipLevels levels; maxAnisotropy > 1 adds anisotropic
+	// filtering when the device has it enabled
+	vk::Sampler createSampler(vk::Device& device, uint32_t mipLevels = 1, float maxAnisotropy = 1.f)
+	{
+		return createSampler(device, samplerInfo(mipLevels, maxAnisotropy));
+	}
+
+	vk::Sampler createSampler(vk::Device& device, const vk::SamplerCreateInfo& samplerInfo)
 	{
 		vk::Sampler sampler;
+		auto result = device.createSampler(&samplerInfo, nullptr, &sampler);
+		assert(result == vk::Result::eSuccess);
+		return sampler;
+	}
 
-		vk::SamplerCreateInfo samplerInfo = vk::SamplerCreateInfo()
-			.setMagFilter(vk::Filter::eNearest)
-			.setMinFilter(vk::Filter::eNearest)
-			.setMipmapMode(vk::SamplerMipmapMode::eNearest)
+	vk::SamplerCreateInfo samplerInfo(uint32_t mipLevels = 1, float maxAnisotropy = 1.f)
+	{
+		maxAnisotropy = std::min(maxAnisotropy, maxSamplerAnisotropy);
+		return vk::SamplerCreateInfo()
+			.setMagFilter(vk::Filter::eLinear)
+			.setMinFilter(vk::Filter::eLinear)
+			.setMipmapMode(vk::SamplerMipmapMode::eLinear)
 			.setAddressModeU(vk::SamplerAddressMode::eClampToEdge)
 			.setAddressModeV(vk::SamplerAddressMode::eClampToEdge)
 			.setAddressModeW(vk::SamplerAddressMode::eClampToEdge)
 			.setMipLodBias(0.0f)
-			.setAnisotropyEnable(VK_FALSE)
-			.setMaxAnisotropy(1)
+			.setAnisotropyEnable(maxAnisotropy > 1.f ? VK_TRUE : VK_FALSE)
+			.setMaxAnisotropy(std::max(maxAnisotropy, 1.f))
 			.setCompareEnable(VK_FALSE)
 			.setCompareOp(vk::CompareOp::eNever)
 			.setMinLod(0.0f)
-			.setMaxLod(0.0f)
+			.setMaxLod(static_cast<float>(mipLevels - 1))
 			.setBorderColor(vk::BorderColor::eFloatOpaqueWhite)
 			.setUnnormalizedCoordinates(VK_FALSE);
-		auto result = device.createSampler(&samplerInfo, nullptr, &sampler);
-		assert(result == vk::Result::eSuccess);
-		return sampler;
 	}
 
 	void pushDescriptor(vk::Device& device, std::vector<vk::WriteDescriptorSet>& writes, uint32_t index, vk::DescriptorSet& descSet,vk::Buffer& buffer, uint32_t size)
@@ -827,7 +1170,8 @@ public:
 		write.setDstSet(descSet);
 		writes[index] = (write);
 	}
-	void pushDescriptor(vk::Device& device, std::vector<vk::WriteDescriptorSet>& writes, uint32_t index, vk::DescriptorSet& descSet, vk::Sampler& sampler, vk::ImageView& view)
+	void pushDescriptor(vk::Device& device, std::vector<vk::WriteDescriptorSet>& writes, uint32_t index, vk::DescriptorSet& descSet, vk::Sampler& sampler, vk::ImageView& view,
+		uint32_t arrayElement = 0)
 	{
 		auto descriptorII = new vk::DescriptorImageInfo();
 		descriptorII->setSampler(sampler);
@@ -836,6 +1180,7 @@ public:
 		vk::WriteDescriptorSet write;
 		write.setDstBinding(0);
 		write.setDescriptorCount(1);
+		write.setDstArrayElement(arrayElement);
 		write.setDescriptorType(vk::DescriptorType::eCombinedImageSampler);
 		write.setPImageInfo(descriptorII);
 		write.setDstSet(descSet);
@@ -883,14 +1228,13 @@ public:
 		return commandBuffers.swapchain[currentBuffer];
 	}
 
-	vk::Pipeline createPipeline(vk::Device& device, vk::ShaderModule& vertex, vk::ShaderModule& fragment, vk::PipelineLayout& pipelineLayout)
+	// cache defaults to pipelineCache; threads other than the one that owns
+	// pipelineCache pass a cache from createWorkerPipelineCache
+	vk::Pipeline createPipeline(vk::Device& device, vk::ShaderModule& vertex, vk::ShaderModule& fragment, vk::PipelineLayout& pipelineLayout,
+		uint32_t vertexStride, const std::vector<vk::VertexInputAttributeDescription>& attributeDesc,
+		const PipelineState& state = PipelineState(), vk::PipelineCache cache = vk::PipelineCache())
 	{
 		vk::Pipeline pipeline;
-		vk::PipelineCache cache;
-
-		vk::PipelineCacheCreateInfo pipelineCacheInfo;
-		auto result = device.createPipelineCache(&pipelineCacheInfo, nullptr, &cache);
-		assert(result == vk::Result::eSuccess);
 
 		vk::PipelineShaderStageCreateInfo shaderStageInfo[2] = {
 		vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eVertex).setModule(vertex).setPName("main"),
@@ -900,33 +1244,16 @@ public:
 		vk::VertexInputBindingDescription()
 		.setBinding(0)
 		.setInputRate(vk::VertexInputRate::eVertex)
-		.setStride(sizeof(float) * (3 + 3 + 2)),
-		};
-		vk::VertexInputAttributeDescription attributeDesc[3] = {
-			vk::VertexInputAttributeDescription()
-			.setBinding(0)
-			.setLocation(0)
-			.setFormat(vk::Format::eR32G32B32Sfloat)
-			.setOffset(0),
-			vk::VertexInputAttributeDescription()
-			.setBinding(0)
-			.setLocation(1)
-			.setFormat(vk::Format::eR32G32B32Sfloat)
-			.setOffset(3 * sizeof(float)),
-			vk::VertexInputAttributeDescription()
-			.setBinding(0)
-			.setLocation(2)
-			.setFormat(vk::Format::eR32G32Sfloat)
-			.setOffset((3 + 3) * sizeof(float))
+		.setStride(vertexStride),
 		};
 		auto vertexInputInfo = vk::PipelineVertexInputStateCreateInfo()
-			.setVertexAttributeDescriptionCount(3)
-			.setPVertexAttributeDescriptions(attributeDesc)
+			.setVertexAttributeDescriptionCount(static_cast<uint32_t>(attributeDesc.size()))
+			.setPVertexAttributeDescriptions(attributeDesc.data())
 			.setVertexBindingDescriptionCount(1)
 			.setPVertexBindingDescriptions(bindingDesc);
 
 		auto inputAssemblyInfo = vk::PipelineInputAssemblyStateCreateInfo()
-			.setTopology(vk::PrimitiveTopology::eTriangleList);
+			.setTopology(state.topology);
 
 		auto viewportInfo = vk::PipelineViewportStateCreateInfo()
 			.setViewportCount(1).setScissorCount(1);
@@ -934,9 +1261,9 @@ public:
 		auto rasterizationInfo = vk::PipelineRasterizationStateCreateInfo()
 			.setDepthClampEnable(VK_FALSE)
 			.setRasterizerDiscardEnable(VK_FALSE)
-			.setPolygonMode(vk::PolygonMode::eFill)
-			.setCullMode(vk::CullModeFlagBits::eBack)
-			.setFrontFace(vk::FrontFace::eCounterClockwise)
+			.setPolygonMode(state.polygonMode)
+			.setCullMode(state.cullMode)
+			.setFrontFace(state.frontFace)
 			.setDepthBiasEnable(VK_FALSE)
 			.setLineWidth(1.f);
 		auto multisampleInfo = vk::PipelineMultisampleStateCreateInfo();
@@ -945,9 +1272,9 @@ public:
 			vk::StencilOpState().setFailOp(vk::StencilOp::eKeep).setPassOp(vk::StencilOp::eKeep).setCompareOp(vk::CompareOp::eAlways);
 
 		auto depthStencilInfo = vk::PipelineDepthStencilStateCreateInfo()
-			.setDepthTestEnable(VK_TRUE)
-			.setDepthWriteEnable(VK_TRUE)
-			.setDepthCompareOp(vk::CompareOp::eLessOrEqual)
+			.setDepthTestEnable(state.depthTest ? VK_TRUE : VK_FALSE)
+			.setDepthWriteEnable(state.depthWrite ? VK_TRUE : VK_FALSE)
+			.setDepthCompareOp(state.depthCompare)
 			.setDepthBoundsTestEnable(VK_FALSE)
 			.setStencilTestEnable(VK_FALSE)
 			.setFront(stencilOp)
@@ -955,7 +1282,14 @@ public:
 
 		vk::PipelineColorBlendAttachmentState const colorBlendAttachments[1] = {
 			vk::PipelineColorBlendAttachmentState().setColorWriteMask(vk::ColorComponentFlagBits::eR | vk::ColorComponentFlagBits::eG |
-																	  vk::ColorComponentFlagBits::eB | vk::ColorComponentFlagBits::eA) };
+																	  vk::ColorComponentFlagBits::eB | vk::ColorComponentFlagBits::eA)
+			.setBlendEnable(state.alphaBlend ? VK_TRUE : VK_FALSE)
+			.setSrcColorBlendFactor(vk::BlendFactor::eSrcAlpha)
+			.setDstColorBlendFactor(vk::BlendFactor::eOneMinusSrcAlpha)
+			.setColorBlendOp(vk::BlendOp::eAdd)
+			.setSrcAlphaBlendFactor(vk::BlendFactor::eOne)
+			.setDstAlphaBlendFactor(vk::BlendFactor::eOneMinusSrcAlpha)
+			.setAlphaBlendOp(vk::BlendOp::eAdd) };
 
 		auto colorBlendInfo =
 			vk::PipelineColorBlendStateCreateInfo().setAttachmentCount(1).setPAttachments(colorBlendAttachments);
@@ -977,44 +1311,330 @@ public:
 			.setPDynamicState(&dynamicStateInfo)
 			.setLayout(pipelineLayout)
 			.setRenderPass(renderPass);
-		result = device.createGraphicsPipelines(cache, 1, &pipelineCI, nullptr, &pipeline);
+		auto result = device.createGraphicsPipelines(cache ? cache : pipelineCache, 1, &pipelineCI, nullptr, &pipeline);
 		assert(result == vk::Result::eSuccess);
 
 		return pipeline;
 	}
 
-	std::pair<uint32_t, vk::Buffer> createVertexBuffer(vk::Device& device, std::vector<float>& mesh)
+	// Every pipeline is created against one cache that persists in filename
+	// between runs. The file starts with a header naming the GPU and driver
+	// it came from; a mismatch, or a blob whose own Vulkan header disagrees,
+	// starts an empty cache instead.
+	void initPipelineCache(const char* filename)
 	{
-		vk::Buffer vertexBuffer;
-		vk::DeviceMemory memory;
-		uint32_t vertexCount;
+		assert(device);
+
+		pipelineCacheFile = filename;
+		std::vector<char> initialData;
+		MappedFile file;
+		if (file.open(filename))
+		{
+			if (validPipelineCache(file))
+			{
+				initialData.assign(file.data + sizeof(PipelineCacheHeader), file.end());
+			}
+			else
+			{
+				Log::Info("pipeline cache", "stale or foreign, starting cold");
+			}
+		}
+
+		auto pipelineCacheInfo = vk::PipelineCacheCreateInfo()
+			.setInitialDataSize(initialData.size())
+			.setPInitialData(initialData.empty() ? nullptr : initialData.data());
+		auto result = device.createPipelineCache(&pipelineCacheInfo, nullptr, &pipelineCache);
+		if (result != vk::Result::eSuccess && !initialData.empty())
+		{
+			// The driver may still refuse data that passed our checks
+			initialData.clear();
+			pipelineCacheInfo.setInitialDataSize(0).setPInitialData(nullptr);
+			result = device.createPipelineCache(&pipelineCacheInfo, nullptr, &pipelineCache);
+		}
+		assert(result == vk::Result::eSuccess);
+		pipelineCacheWarm = !initialData.empty();
+		Log::Info("pipeline cache", pipelineCacheWarm ? std::to_string(initialData.size() >> 10) + " KB loaded" : std::string("cold"));
+	}
+
+	// Writes the cache back; can be called whenever new pipelines were created
+	bool savePipelineCache()
+	{
+		if (!pipelineCache || pipelineCacheFile.empty())
+		{
+			return false;
+		}
+		std::vector<char> data = pipelineCacheData();
+
+		vk::PhysicalDeviceProperties properties = gpu.getProperties();
+		PipelineCacheHeader header = {};
+		memcpy(header.magic, "VPLC", 4);
+		header.version = pipelineCacheVersion;
+		header.vendorID = properties.vendorID;
+		header.deviceID = properties.deviceID;
+		header.driverVersion = properties.driverVersion;
+		header.dataSize = static_cast<uint32_t>(data.size());
+		header.checksum = Hash::Bytes(data.data(), data.size());
+		memcpy(header.uuid, properties.pipelineCacheUUID, VK_UUID_SIZE);
+
+		std::string temporary = MappedFile::TemporaryName(pipelineCacheFile.c_str());
+		FILE* output = fopen(temporary.c_str(), "wb");
+		if (output == nullptr)
+		{
+			return false;
+		}
+		bool written = fwrite(&header, sizeof(header), 1, output) == 1
+			&& fwrite(data.data(), 1, data.size(), output) == data.size();
+		written = fclose(output) == 0 && written;
+		if (!written)
+		{
+			remove(temporary.c_str());
+			return false;
+		}
+		return MappedFile::Publish(temporary, pipelineCacheFile.c_str());
+	}
+
+	// pipelineCache must only be used by one thread at a time, so background
+	// pipeline creation gets a cache of its own, seeded with everything
+	// pipelineCache knows. Call from the thread that owns pipelineCache.
+	vk::PipelineCache createWorkerPipelineCache()
+	{
+		std::vector<char> data = pipelineCacheData();
+		auto pipelineCacheInfo = vk::PipelineCacheCreateInfo()
+			.setInitialDataSize(data.size())
+			.setPInitialData(data.empty() ? nullptr : data.data());
+		vk::PipelineCache cache;
+		auto result = device.createPipelineCache(&pipelineCacheInfo, nullptr, &cache);
+		assert(result == vk::Result::eSuccess);
+		return cache;
+	}
+
+	// Folds a worker cache back into pipelineCache and destroys it
+	void mergePipelineCache(vk::PipelineCache cache)
+	{
+		auto result = device.mergePipelineCaches(pipelineCache, 1, &cache);
+		assert(result == vk::Result::eSuccess);
+		device.destroyPipelineCache(cache);
+	}
+
+	std::vector<char> pipelineCacheData()
+	{
+		if (!pipelineCache)
+		{
+			return std::vector<char>();
+		}
+		size_t size = 0;
+		auto result = device.getPipelineCacheData(pipelineCache, &size, nullptr);
+		assert(result == vk::Result::eSuccess);
+		std::vector<char> data(size);
+		result = device.getPipelineCacheData(pipelineCache, &size, data.data());
+		assert(result == vk::Result::eSuccess || result == vk::Result::eIncomplete);
+		data.resize(size);
+		return data;
+	}
+
+	// Saves and destroys the cache, before the device goes away
+	void destroyPipelineCache()
+	{
+		if (!savePipelineCache())
+		{
+			Log::Info("pipeline cache", "could not save " + pipelineCacheFile);
+		}
+		device.destroyPipelineCache(pipelineCache);
+		pipelineCache = vk::PipelineCache();
+	}
+
+	BufferMemory createBuffer(vk::Device& device, vk::BufferUsageFlags usage, vk::DeviceSize size, vk::MemoryPropertyFlags memFlags)
+	{
+		BufferMemory bufferMemory;
 
 		auto bufferCI = vk::BufferCreateInfo()
-			.setUsage(vk::BufferUsageFlagBits::eVertexBuffer)
+			.setUsage(usage)
 			.setQueueFamilyIndexCount(0)
 			.setPQueueFamilyIndices(nullptr)
 			.setSharingMode(vk::SharingMode::eExclusive)
-			.setSize(mesh.size() * sizeof(float));
-		auto result = device.createBuffer(&bufferCI, nullptr, &vertexBuffer);
+			.setSize(size);
+		auto result = device.createBuffer(&bufferCI, nullptr, &bufferMemory.buffer);
 		assert(result == vk::Result::eSuccess);
 		vk::MemoryRequirements req;
-		req = device.getBufferMemoryRequirements(vertexBuffer);
+		req = device.getBufferMemoryRequirements(bufferMemory.buffer);
 		auto allocateInfo = vk::MemoryAllocateInfo()
 			.setAllocationSize(req.size);
-
-		vk::MemoryPropertyFlags memFlags = vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent;
 		auto ret = GetPhysicalMemoryType(gpu, req, memFlags, allocateInfo.memoryTypeIndex);
 		assert(ret);
-		result = device.allocateMemory(&allocateInfo, nullptr, &memory);
+		result = device.allocateMemory(&allocateInfo, nullptr, &bufferMemory.memory);
 		assert(result == vk::Result::eSuccess);
+		device.bindBufferMemory(bufferMemory.buffer, bufferMemory.memory, 0);
+		return bufferMemory;
+	}
+
+	// Creates a host-visible buffer and hands its mapping to write(void*), so
+	// callers produce their data directly in GPU memory instead of staging
+	// it in a heap vector first.
+	template<typename Writer>
+	BufferMemory createMappedBuffer(vk::Device& device, vk::BufferUsageFlags usage, vk::DeviceSize size, Writer write)
+	{
+		BufferMemory bufferMemory = createBuffer(device, usage, size,
+			vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent);
 		void* pdata = nullptr;
-		result = device.mapMemory(memory, 0, req.size, vk::MemoryMapFlags(), &pdata);
+		auto result = device.mapMemory(bufferMemory.memory, 0, size, vk::MemoryMapFlags(), &pdata);
 		assert(result == vk::Result::eSuccess);
-		memcpy(pdata, mesh.data(), mesh.size() * sizeof(float));
-		device.unmapMemory(memory);
-		device.bindBufferMemory(vertexBuffer, memory, 0);
-		vertexCount = mesh.size() / (3 + 3 + 2);
-		return std::pair<uint32_t, vk::Buffer>(vertexCount, vertexBuffer);
+		write(pdata);
+		device.unmapMemory(bufferMemory.memory);
+		return bufferMemory;
+	}
+
+	void destroyBuffer(vk::Device& device, BufferMemory& bufferMemory)
+	{
+		device.destroyBuffer(bufferMemory.buffer);
+		device.freeMemory(bufferMemory.memory);
+		bufferMemory = BufferMemory();
+	}
+
+	static vk::IndexType chooseIndexType(size_t vertexCount)
+	{
+		return vertexCount <= 65536 ? vk::IndexType::eUint16 : vk::IndexType::eUint32;
+	}
+
+	// One DEVICE_LOCAL vertex buffer and one index buffer that every mesh is
+	// sub-allocated from, so a frame binds geometry once.
+	void initGeometryPool(vk::DeviceSize vertexCapacity, vk::DeviceSize indexCapacity)
+	{
+		assert(device);
+
+		geometry.vertex = createBuffer(device, vk::BufferUsageFlagBits::eVertexBuffer | vk::BufferUsageFlagBits::eTransferDst,
+			vertexCapacity, vk::MemoryPropertyFlagBits::eDeviceLocal);
+		geometry.index = createBuffer(device, vk::BufferUsageFlagBits::eIndexBuffer | vk::BufferUsageFlagBits::eTransferDst,
+			indexCapacity, vk::MemoryPropertyFlagBits::eDeviceLocal);
+		geometry.vertexRanges.reset(vertexCapacity);
+		geometry.indexRanges.reset(indexCapacity);
+	}
+
+	void destroyGeometryPool()
+	{
+		destroyBuffer(device, geometry.vertex);
+		destroyBuffer(device, geometry.index);
+		geometry.vertexRanges.reset(0);
+		geometry.indexRanges.reset(0);
+	}
+
+	// Reserves room for the mesh in the geometry pool, fills staging memory
+	// through the writers and records the copies on the setup command buffer.
+	template<typename VertexWriter, typename IndexWriter>
+	bool allocateMesh(vk::Device& device, uint32_t vertexCount, uint32_t stride, uint32_t indexCount,
+		VertexWriter writeVertices, IndexWriter writeIndices, MeshRange& range)
+	{
+		assert(commandBuffers.base);
+
+		range.indexType = chooseIndexType(vertexCount);
+		range.indexCount = indexCount;
+		vk::DeviceSize indexSize = range.indexType == vk::IndexType::eUint16 ? sizeof(uint16_t) : sizeof(uint32_t);
+		range.vertexSize = static_cast<vk::DeviceSize>(vertexCount) * stride;
+		range.indexSize = indexCount * indexSize;
+
+		// Index ranges are 4-byte aligned so either index type can start there
+		if (!geometry.vertexRanges.allocate(range.vertexSize, stride, range.vertexOffset))
+		{
+			Log::Error("geometry pool is out of vertex memory");
+			return false;
+		}
+		if (!geometry.indexRanges.allocate(range.indexSize, sizeof(uint32_t), range.indexOffset))
+		{
+			geometry.vertexRanges.free(range.vertexOffset, range.vertexSize);
+			Log::Error("geometry pool is out of index memory");
+			return false;
+		}
+		range.baseVertex = static_cast<int32_t>(range.vertexOffset / stride);
+		range.firstIndex = static_cast<uint32_t>(range.indexOffset / indexSize);
+
+		vk::DeviceSize indexStart = (range.vertexSize + 3) & ~static_cast<vk::DeviceSize>(3);
+		vk::Buffer stagingBuffer;
+		vk::DeviceSize stagingOffset = 0;
+		char* dst = stage(std::max<vk::DeviceSize>(indexStart + range.indexSize, 1), sizeof(uint32_t), stagingBuffer, stagingOffset);
+		writeVertices(dst);
+		writeIndices(dst + indexStart);
+
+		if (range.vertexSize > 0)
+		{
+			auto vertexRegion = vk::BufferCopy().setSrcOffset(stagingOffset).setDstOffset(range.vertexOffset).setSize(range.vertexSize);
+			commandBuffers.base.copyBuffer(stagingBuffer, geometry.vertex.buffer, 1, &vertexRegion);
+		}
+		if (range.indexSize > 0)
+		{
+			auto indexRegion = vk::BufferCopy().setSrcOffset(stagingOffset + indexStart).setDstOffset(range.indexOffset).setSize(range.indexSize);
+			commandBuffers.base.copyBuffer(stagingBuffer, geometry.index.buffer, 1, &indexRegion);
+		}
+
+		// Make the copies visible to vertex input before the first draw
+		auto barrier = vk::MemoryBarrier()
+			.setSrcAccessMask(vk::AccessFlagBits::eTransferWrite)
+			.setDstAccessMask(vk::AccessFlagBits::eVertexAttributeRead | vk::AccessFlagBits::eIndexRead);
+		commandBuffers.base.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eVertexInput,
+			vk::DependencyFlagBits(), 1, &barrier, 0, nullptr, 0, nullptr);
+		return true;
+	}
+
+	// One persistently mapped HOST_VISIBLE buffer that every upload is
+	// staged through instead of a fresh buffer per mesh or texture. Space is
+	// handed out front to back; when it runs out the setup command buffer is
+	// flushed and the ring starts over. Uploads bigger than the whole ring
+	// get a one-off buffer that is released at the next flush.
+	void initStagingRing(vk::DeviceSize capacity)
+	{
+		assert(device);
+
+		staging.buffer = createBuffer(device, vk::BufferUsageFlagBits::eTransferSrc, capacity,
+			vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent);
+		void* mapped = nullptr;
+		auto result = device.mapMemory(staging.buffer.memory, 0, capacity, vk::MemoryMapFlags(), &mapped);
+		assert(result == vk::Result::eSuccess);
+		staging.mapped = static_cast<char*>(mapped);
+		staging.capacity = capacity;
+		staging.head = 0;
+		// Also a multiple of every texel block size (at most 16 bytes)
+		staging.copyAlignment = std::max<vk::DeviceSize>(gpu.getProperties().limits.optimalBufferCopyOffsetAlignment, 16);
+	}
+
+	void destroyStagingRing()
+	{
+		device.unmapMemory(staging.buffer.memory);
+		destroyBuffer(device, staging.buffer);
+		staging = StagingRing();
+	}
+
+	// Returns where to write size bytes and the buffer and offset to copy
+	// them from. alignment must be a power of two.
+	char* stage(vk::DeviceSize size, vk::DeviceSize alignment, vk::Buffer& buffer, vk::DeviceSize& offset)
+	{
+		assert(commandBuffers.base);
+		if (size > staging.capacity)
+		{
+			BufferMemory oversized = createBuffer(device, vk::BufferUsageFlagBits::eTransferSrc, size,
+				vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent);
+			void* mapped = nullptr;
+			auto result = device.mapMemory(oversized.memory, 0, size, vk::MemoryMapFlags(), &mapped);
+			assert(result == vk::Result::eSuccess);
+			stagingBuffers.push_back(oversized);
+			buffer = oversized.buffer;
+			offset = 0;
+			return static_cast<char*>(mapped);
+		}
+		vk::DeviceSize aligned = (staging.head + alignment - 1) & ~(alignment - 1);
+		if (aligned + size > staging.capacity)
+		{
+			flushUploads();
+			aligned = 0;
+		}
+		staging.head = aligned + size;
+		buffer = staging.buffer.buffer;
+		offset = aligned;
+		return staging.mapped + aligned;
+	}
+
+	void freeMesh(MeshRange& range)
+	{
+		geometry.vertexRanges.free(range.vertexOffset, range.vertexSize);
+		geometry.indexRanges.free(range.indexOffset, range.indexSize);
+		range = MeshRange();
 	}
 
 	void BeginCommandBuffer(vk::CommandBuffer& commandBuffer)
@@ -1028,9 +1648,13 @@ public:
 		commandBuffer.end();
 	}
 
+	// Records every draw into one secondary command buffer. The pool's vertex
+	// buffer is bound once; pipelines and index types are only rebound when
+	// they change, so callers should sort items by them. With bindless
+	// textures set 1 is bound once and draws only push their texture index,
+	// except for objects that had to fall back to a set of their own.
 	vk::CommandBuffer DrawCommandBuffer(vk::Device& device, vk::CommandBuffer cmd,
-		vk::Pipeline pipeline, vk::PipelineLayout pipelineLayout, 
-		std::vector<vk::DescriptorSet> descriptorSets, vk::Buffer vertexBuffer, uint32_t vertexCount)
+		vk::PipelineLayout pipelineLayout, const std::vector<DrawItem>& items, bool bindlessTextures = false)
 	{
 		vk::CommandBuffer secondary;
 		vk::CommandBufferAllocateInfo commandBufferAI = vk::CommandBufferAllocateInfo()
@@ -1044,14 +1668,11 @@ public:
 			.setOcclusionQueryEnable(VK_FALSE)
 			.setSubpass(0);
 		vk::CommandBufferBeginInfo beginInfo = vk::CommandBufferBeginInfo()
-			.setFlags(vk::CommandBufferUsageFlagBits::eOneTimeSubmit | vk::CommandBufferUsageFlagBits::eRenderPassContinue)
+			.setFlags(vk::CommandBufferUsageFlagBits::eRenderPassContinue)
 			.setPInheritanceInfo(&inheritanceInfo);
 		secondary.begin(beginInfo);
-		secondary.bindPipeline(vk::PipelineBindPoint::eGraphics, pipeline);
-		secondary.bindDescriptorSets(vk::PipelineBindPoint::eGraphics, pipelineLayout, 0, descriptorSets.size(),
-			descriptorSets.data(), 0, nullptr);
 		const vk::DeviceSize offset[1] = { 0 };
-		secondary.bindVertexBuffers(0, 1, &vertexBuffer, offset);
+		secondary.bindVertexBuffers(0, 1, &geometry.vertex.buffer, offset);
 		auto viewport = vk::Viewport()
 			.setWidth((float)windowSize.width)
 			.setHeight((float)windowSize.height)
@@ -1061,7 +1682,61 @@ public:
 
 		vk::Rect2D const scissor(vk::Offset2D(0, 0), vk::Extent2D(windowSize.width, windowSize.height));
 		secondary.setScissor(0, 1, &scissor);
-		secondary.draw(vertexCount, 1, 0, 0);
+
+		if (bindlessTextures)
+		{
+			secondary.bindDescriptorSets(vk::PipelineBindPoint::eGraphics, pipelineLayout, 1, 1, &bindless.set, 0, nullptr);
+		}
+
+		vk::Pipeline boundPipeline;
+		const std::vector<vk::DescriptorSet>* boundSets = nullptr;
+		vk::DescriptorSet boundTextures = bindless.set;
+		bool indexBound = false;
+		bool texturePushed = false;
+		uint32_t pushedTexture = 0;
+		vk::IndexType boundIndexType = vk::IndexType::eUint16;
+		for (const auto& item : items)
+		{
+			if (item.pipeline != boundPipeline)
+			{
+				secondary.bindPipeline(vk::PipelineBindPoint::eGraphics, item.pipeline);
+				boundPipeline = item.pipeline;
+			}
+			if (!indexBound || item.mesh.indexType != boundIndexType)
+			{
+				secondary.bindIndexBuffer(geometry.index.buffer, 0, item.mesh.indexType);
+				boundIndexType = item.mesh.indexType;
+				indexBound = true;
+			}
+			// Every pipeline shares pipelineLayout, so sets stay bound across
+			// pipeline switches and only change with the object
+			if (item.descriptorSets != boundSets && bindlessTextures)
+			{
+				const auto& sets = *item.descriptorSets;
+				secondary.bindDescriptorSets(vk::PipelineBindPoint::eGraphics, pipelineLayout, 0, 1, &sets[0], 0, nullptr);
+				if (sets[1] != boundTextures)
+				{
+					secondary.bindDescriptorSets(vk::PipelineBindPoint::eGraphics, pipelineLayout, 1, 1, &sets[1], 0, nullptr);
+					boundTextures = sets[1];
+				}
+				secondary.bindDescriptorSets(vk::PipelineBindPoint::eGraphics, pipelineLayout, 2,
+					static_cast<uint32_t>(sets.size() - 2), &sets[2], 0, nullptr);
+				boundSets = item.descriptorSets;
+			}
+			else if (item.descriptorSets != boundSets)
+			{
+				secondary.bindDescriptorSets(vk::PipelineBindPoint::eGraphics, pipelineLayout, 0,
+					static_cast<uint32_t>(item.descriptorSets->size()), item.descriptorSets->data(), 0, nullptr);
+				boundSets = item.descriptorSets;
+			}
+			if (bindlessTextures && (!texturePushed || item.textureIndex != pushedTexture))
+			{
+				secondary.pushConstants(pipelineLayout, vk::ShaderStageFlagBits::eFragment, 0, sizeof(uint32_t), &item.textureIndex);
+				pushedTexture = item.textureIndex;
+				texturePushed = true;
+			}
+			secondary.drawIndexed(item.mesh.indexCount, 1, item.mesh.firstIndex, item.mesh.baseVertex, 0);
+		}
 		secondary.end();
 		return secondary;
 	}
@@ -1086,9 +1761,16 @@ public:
 	}
 
 	void Present(vk::Device& device)
+	{
+		AcquireFrame(device);
+		SubmitFrame(device);
+	}
+
+	// Sets currentBuffer to the next swapchain image. On return the image's
+	// command buffer is no longer executing and may be recorded again.
+	void AcquireFrame(vk::Device& device)
 	{
 		device.waitForFences(1, &fences[frameIndex], VK_TRUE, UINT64_MAX);
-		device.resetFences(1, &fences[frameIndex]);
 
 		vk::Result result;
 		do {
@@ -1105,6 +1787,21 @@ public:
 			}
 		} while (result != vk::Result::eSuccess);
 
+		// The image may last have been submitted by the other frame in flight
+		imageFences.resize(swapchainImageCount);
+		vk::Fence& imageFence = imageFences[currentBuffer];
+		if (imageFence && imageFence != fences[frameIndex])
+		{
+			device.waitForFences(1, &imageFence, VK_TRUE, UINT64_MAX);
+		}
+		imageFence = fences[frameIndex];
+	}
+
+	void SubmitFrame(vk::Device& device)
+	{
+		device.resetFences(1, &fences[frameIndex]);
+
+		vk::Result result;
 		//UpdateDataBuffer(obj);
 
 		vk::PipelineStageFlags pipeStageFlags = vk::PipelineStageFlagBits::eColorAttachmentOutput;
@@ -1162,6 +1859,27 @@ public:
 	} commandBuffers;
 	vk::SwapchainKHR swapchain;
 	uint32_t swapchainImageCount;
+	vk::Format swapchainFormat;
+	float maxSamplerAnisotropy = 1.f;
+	// Shared by every createPipeline, see initPipelineCache
+	vk::PipelineCache pipelineCache;
+	std::string pipelineCacheFile;
+	// Whether pipelineCache started from data saved by an earlier run
+	bool pipelineCacheWarm = false;
+	// VK_EXT_descriptor_indexing with runtime arrays and partial binding,
+	// plus dynamic indexing of sampled image arrays
+	bool descriptorIndexing = false;
+	static const uint32_t minBindlessCapacity = 256;
+	struct Bindless
+	{
+		vk::DescriptorSetLayout layout;
+		vk::DescriptorPool pool;
+		vk::DescriptorSet set;
+		uint32_t capacity = 0;
+		std::map<std::pair<vk::ImageView, vk::Sampler>, uint32_t> slots;
+		std::vector<ImageMemory> images;
+		std::vector<vk::DescriptorPool> fallbackPools;
+	} bindless;
 	vk::Extent2D windowSize;
 	vk::RenderPass renderPass;
 	vk::Buffer depthBuffer;
@@ -1181,7 +1899,73 @@ public:
 	uint32_t frameIndex;
 	uint32_t currentBuffer;
 
+	// Bump when PipelineCacheHeader changes
+	static const uint32_t pipelineCacheVersion = 1;
+	struct PipelineCacheHeader
+	{
+		char magic[4];
+		uint32_t version;
+		uint32_t vendorID;
+		uint32_t deviceID;
+		uint32_t driverVersion;
+		uint32_t dataSize;
+		uint64_t checksum;
+		uint8_t uuid[VK_UUID_SIZE];
+	};
+
+	bool validPipelineCache(const MappedFile& file)
+	{
+		PipelineCacheHeader header;
+		if (file.size < sizeof(header))
+		{
+			return false;
+		}
+		memcpy(&header, file.data, sizeof(header));
+		const char* data = file.data + sizeof(header);
+		vk::PhysicalDeviceProperties properties = gpu.getProperties();
+		if (memcmp(header.magic, "VPLC", 4) != 0 || header.version != pipelineCacheVersion
+			|| header.vendorID != properties.vendorID || header.deviceID != properties.deviceID
+			|| header.driverVersion != properties.driverVersion
+			|| memcmp(header.uuid, properties.pipelineCacheUUID, VK_UUID_SIZE) != 0
+			|| sizeof(header) + static_cast<uint64_t>(header.dataSize) != file.size
+			|| Hash::Bytes(data, header.dataSize) != header.checksum)
+		{
+			return false;
+		}
+
+		// VkPipelineCacheHeaderVersionOne at the start of the blob itself
+		uint32_t blob[4];
+		if (header.dataSize < sizeof(blob) + VK_UUID_SIZE)
+		{
+			return false;
+		}
+		memcpy(blob, data, sizeof(blob));
+		return blob[0] >= sizeof(blob) + VK_UUID_SIZE && blob[1] == VK_PIPELINE_CACHE_HEADER_VERSION_ONE
+			&& blob[2] == properties.vendorID && blob[3] == properties.deviceID
+			&& memcmp(data + sizeof(blob), properties.pipelineCacheUUID, VK_UUID_SIZE) == 0;
+	}
+
+	// One-off buffers for uploads that do not fit the staging ring
+	std::vector<BufferMemory> stagingBuffers;
+	struct StagingRing
+	{
+		BufferMemory buffer;
+		char* mapped = nullptr;
+		vk::DeviceSize capacity = 0;
+		vk::DeviceSize head = 0;
+		vk::DeviceSize copyAlignment = 16;
+	} staging;
+	struct GeometryPool
+	{
+		BufferMemory vertex;
+		BufferMemory index;
+		RangeAllocator vertexRanges;
+		RangeAllocator indexRanges;
+	} geometry;
+
 	vk::Fence fences[FRAME_LAG];
+	// The fence of the frame each swapchain image was last submitted with
+	std::vector<vk::Fence> imageFences;
 	vk::Semaphore imageAcquiredSemaphores[FRAME_LAG];
 	vk::Semaphore drawCompleteSemaphores[FRAME_LAG];
 };
\ No newline at end of file
@@ -0,0 +1,155 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// Fixed set of worker threads shared by the loaders. Work is either handed
+// out as individual tasks (submit) or as an index range (parallelFor).
+class ThreadPool
+{
+public:
+	explicit ThreadPool(unsigned threadCount) : stopping(false)
+	{
+		for (unsigned i = 0; i < threadCount; i++)
+		{
+			workers.emplace_back([this]() { run(); });
+		}
+	}
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wakeup.notify_all();
+		for (auto& worker : workers)
+		{
+			worker.join();
+		}
+	}
+
+	// One worker per core besides the calling thread, which helps out in
+	// parallelFor.
+	static ThreadPool& Shared()
+	{
+		static ThreadPool pool(std::max(1u, std::thread::hardware_concurrency()) - 1u);
+		return pool;
+	}
+
+	size_t size() const
+	{
+		return workers.size();
+	}
+
+	template<typename F>
+	std::future<typename std::result_of<F()>::type> submit(F&& task)
+	{
+		using Result = typename std::result_of<F()>::type;
+		auto packaged = std::make_shared<std::packaged_task<Result()>>(std::forward<F>(task));
+		auto future = packaged->get_future();
+		if (workers.empty())
+		{
+			(*packaged)();
+			return future;
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			queue.emplace_back([packaged]() { (*packaged)(); });
+		}
+		wakeup.notify_one();
+		return future;
+	}
+
+	// Calls body(i) for every i in [0, count). The caller takes part and only
+	// waits for indices to finish, never for helpers to be scheduled, so this
+	// is safe to use from inside a pool task.
+	template<typename F>
+	void parallelFor(size_t count, F&& body)
+	{
+		if (count == 0)
+		{
+			return;
+		}
+		struct Range
+		{
+			std::atomic<size_t> next;
+			std::atomic<size_t> done;
+			std::mutex mutex;
+			std::condition_variable finished;
+		};
+		auto range = std::make_shared<Range>();
+		range->next = 0;
+		range->done = 0;
+
+		auto* work = &body;
+		auto drain = [range, count, work]()
+		{
+			size_t index;
+			while ((index = range->next.fetch_add(1)) < count)
+			{
+				(*work)(index);
+				if (range->done.fetch_add(1) + 1 == count)
+				{
+					std::lock_guard<std::mutex> lock(range->mutex);
+					range->finished.notify_all();
+				}
+			}
+		};
+
+		size_t helpers = std::min(workers.size(), count - 1);
+		if (helpers > 0)
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				for (size_t i = 0; i < helpers; i++)
+				{
+					queue.emplace_back(drain);
+				}
+			}
+			wakeup.notify_all();
+		}
+		drain();
+
+		std::unique_lock<std::mutex> lock(range->mutex);
+		range->finished.wait(lock, [&range, count]() { return range->done.load() == count; });
+	}
+
+private:
+	void run()
+	{
+		for (;;)
+		{
+			std::function<void()> task;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wakeup.wait(lock, [this]() { return stopping || !queue.empty(); });
+				if (queue.empty())
+				{
+					return;
+				}
+				task = std::move(queue.front());
+				queue.pop_front();
+			}
+			task();
+		}
+	}
+
+	std::vector<std::thread> workers;
+	std::deque<std::function<void()>> queue;
+	std::mutex mutex;
+	std::condition_variable wakeup;
+	bool stopping;
+};
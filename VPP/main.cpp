@@ -1,3 +1,5 @@
+#include <cstring>
+
 #include "scene.hpp"
 
 #define GLM_LEFT_HANDED 
@@ -36,9 +38,48 @@ void draw_sample_3(Scene& scene)
 	scene.AddObject(&longSword);
 }
 
+// Same as sample 2 with the ball packed into the 16-byte quantized layout
+void draw_sample_4(Scene& scene)
+{
+	scene.AddShader("light");
+	scene.UseShader("light");
+	ball.vertexFormat = VertexFormat::Quantized;
+	scene.AddObject(&ball);
+}
+
+// LOD benchmark: a 20 x 20 field of swords running away from the camera.
+// Every re-record logs the triangles drawn against the full-detail count.
+// The scene owns the swords and deletes them.
+void draw_sample_5(Scene& scene)
+{
+	scene.AddShader("light");
+	scene.UseShader("light");
+	const int rows = 20;
+	const int columns = 20;
+	for (int row = 0; row < rows; row++)
+	{
+		for (int column = 0; column < columns; column++)
+		{
+			Drawable* sword = new Drawable((row + column) % 2 == 0 ? "broadSword" : "longSword");
+			sword->name = "sword" + std::to_string(row * columns + column);
+			sword->transform.position = glm::vec3(-2.f - 3.f * row, -0.5f, -2.f - 3.f * column);
+			sword->transform.scale = glm::vec3(0.3f, 0.3f, 0.3f);
+			scene.AddObject(sword);
+		}
+	}
+}
+
 int main(int argc, char** argv)
 {
-	Scene scene = Scene();
+#ifndef VPP_EMBEDDED_SHADERS
+	// VPP --embed-shaders <header> compiles every shader variant into a header
+	// for builds that define VPP_EMBEDDED_SHADERS
+	if (argc == 3 && strcmp(argv[1], "--embed-shaders") == 0)
+	{
+		return ShaderUtil::EmbedShaders(argv[2], { "default", "light", "texture", "skybox" }, Scene::ShaderVariants()) ? 0 : 1;
+	}
+#endif
+	Scene scene;
 	draw_sample_1(scene);
 	scene.Loop();
 	return 0;
@@ -0,0 +1,237 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+// minwindef.h defines these away, which breaks Scene::Camera
+#undef near
+#undef far
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// Read-only view of a whole file, mapped into the address space so that
+// loaders can parse it in place without copying it through stdio buffers.
+class MappedFile
+{
+public:
+	struct Info
+	{
+		uint64_t size;
+		// Last write time in the finest unit the platform keeps (100 ns on
+		// Windows, 1 ns elsewhere); only meaningful compared to other Infos
+		int64_t modified;
+	};
+
+	static bool Stat(const char* filename, Info& info)
+	{
+#ifdef _WIN32
+		WIN32_FILE_ATTRIBUTE_DATA attributes;
+		if (!GetFileAttributesExA(filename, GetFileExInfoStandard, &attributes))
+		{
+			return false;
+		}
+		info.size = static_cast<uint64_t>(attributes.nFileSizeHigh) << 32 | attributes.nFileSizeLow;
+		info.modified = static_cast<int64_t>(static_cast<uint64_t>(attributes.ftLastWriteTime.dwHighDateTime) << 32
+			| attributes.ftLastWriteTime.dwLowDateTime);
+#else
+		struct stat status;
+		if (stat(filename, &status) != 0)
+		{
+			return false;
+		}
+		info.size = static_cast<uint64_t>(status.st_size);
+#ifdef __APPLE__
+		info.modified = static_cast<int64_t>(status.st_mtimespec.tv_sec) * 1000000000 + status.st_mtimespec.tv_nsec;
+#else
+		info.modified = static_cast<int64_t>(status.st_mtim.tv_sec) * 1000000000 + status.st_mtim.tv_nsec;
+#endif
+#endif
+		return true;
+	}
+
+	// Whether a cache file can be trusted on the source's size and write
+	// time alone. recorded is the source's Info saved in the cache. Even a
+	// matching stamp proves nothing unless the cache was written strictly
+	// later, since an edit within one clock tick keeps the old time. Callers
+	// compare a stored content hash whenever this returns false.
+	static bool Unchanged(const Info& source, const Info& recorded, const Info& cache)
+	{
+		return source.size == recorded.size && source.modified == recorded.modified && cache.modified > source.modified;
+	}
+
+	// Cache files are written to TemporaryName(filename) and then put in
+	// place with Publish, which replaces filename in one step. Readers,
+	// including ones that still have the old file mapped, never see a
+	// partial file, and concurrent writers of one path do not interleave.
+	static std::string TemporaryName(const char* filename)
+	{
+		static std::atomic<uint32_t> counter(0);
+#ifdef _WIN32
+		unsigned long process = GetCurrentProcessId();
+#else
+		unsigned long process = static_cast<unsigned long>(getpid());
+#endif
+		return std::string(filename) + ".tmp" + std::to_string(process) + "." + std::to_string(counter.fetch_add(1));
+	}
+
+	// Moves temporary over filename, or removes it when that fails (on
+	// Windows, while another process has filename mapped)
+	static bool Publish(const std::string& temporary, const char* filename)
+	{
+#ifdef _WIN32
+		bool moved = MoveFileExA(temporary.c_str(), filename, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+		bool moved = rename(temporary.c_str(), filename) == 0;
+#endif
+		if (!moved)
+		{
+			remove(temporary.c_str());
+		}
+		return moved;
+	}
+
+	// Overwrites size bytes at offset of an existing file in place. Only for
+	// fields readers do not depend on, such as the source stamp of a cache.
+	static bool Patch(const char* filename, uint64_t offset, const void* bytes, size_t size)
+	{
+		FILE* output = fopen(filename, "r+b");
+		if (output == nullptr)
+		{
+			return false;
+		}
+		bool written = fseek(output, static_cast<long>(offset), SEEK_SET) == 0 && fwrite(bytes, 1, size, output) == size;
+		return fclose(output) == 0 && written;
+	}
+
+	MappedFile() : data(nullptr), size(0) {}
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+	~MappedFile()
+	{
+		close();
+	}
+
+	bool open(const char* filename)
+	{
+		close();
+#ifdef _WIN32
+		file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+			FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+		if (file == INVALID_HANDLE_VALUE)
+		{
+			return false;
+		}
+		LARGE_INTEGER fileSize;
+		if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0)
+		{
+			close();
+			return false;
+		}
+		mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (mapping == nullptr)
+		{
+			close();
+			return false;
+		}
+		data = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+		if (data == nullptr)
+		{
+			close();
+			return false;
+		}
+		size = static_cast<size_t>(fileSize.QuadPart);
+#else
+		fd = ::open(filename, O_RDONLY);
+		if (fd < 0)
+		{
+			return false;
+		}
+		struct stat info;
+		if (fstat(fd, &info) != 0 || info.st_size == 0)
+		{
+			close();
+			return false;
+		}
+		void* view = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+		if (view == MAP_FAILED)
+		{
+			close();
+			return false;
+		}
+		madvise(view, static_cast<size_t>(info.st_size), MADV_SEQUENTIAL);
+		data = static_cast<const char*>(view);
+		size = static_cast<size_t>(info.st_size);
+#endif
+		return true;
+	}
+
+	void close()
+	{
+#ifdef _WIN32
+		if (data != nullptr)
+		{
+			UnmapViewOfFile(data);
+		}
+		if (mapping != nullptr)
+		{
+			CloseHandle(mapping);
+		}
+		if (file != INVALID_HANDLE_VALUE)
+		{
+			CloseHandle(file);
+		}
+		mapping = nullptr;
+		file = INVALID_HANDLE_VALUE;
+#else
+		if (data != nullptr)
+		{
+			munmap(const_cast<char*>(data), size);
+		}
+		if (fd >= 0)
+		{
+			::close(fd);
+		}
+		fd = -1;
+#endif
+		data = nullptr;
+		size = 0;
+	}
+
+	const char* begin() const
+	{
+		return data;
+	}
+
+	const char* end() const
+	{
+		return data + size;
+	}
+
+public:
+	const char* data;
+	size_t size;
+
+private:
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = nullptr;
+#else
+	int fd = -1;
+#endif
+};
@@ -2,141 +2,1082 @@
 
 #include <glm/glm.hpp>
 #include <glm/ext.hpp>
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cmath>
+#include <cstdint>
 #include <cstdio>
+#include <cstring>
+#include <memory>
 #include <string>
 #include <vector>
 
+#include "bounds.hpp"
+#include "hash.hpp"
+#include "jobs.hpp"
+#include "mapping.hpp"
+#include "optimizer.hpp"
+#include "vertex.hpp"
+
 class Mesh
 {
 public:
 	std::string name;
+	// Path the mesh was loaded from, without extension; identifies it for sharing
+	std::string source;
+
+	// Layout of the streams stored in .vmesh files
+	static const uint32_t vertexStride = StandardVertex::stride;
 
-	std::vector<float> wrapData()
+	// Shader-side constants that turn a quantized vertex back into object
+	// space: position = offset + scale * unorm, uv = xy + zw * unorm. They are
+	// the identity for the float format so one uniform layout serves both.
+	struct Dequantization
 	{
-		std::vector<float> data = std::vector<float>(triangles.size() * 3 * (3 + 3 + 2));
-		size_t index = 0;
-		for (size_t i = 0; i < triangles.size(); i++)
+		glm::vec4 positionOffset;
+		glm::vec4 positionScale;
+		glm::vec4 uvTransform;
+	};
+
+	Dequantization dequantization(VertexFormat format) const
+	{
+		Dequantization result;
+		if (format == VertexFormat::Quantized)
+		{
+			result.positionOffset = glm::vec4(boundsMin, 0.f);
+			result.positionScale = glm::vec4(boundsMax - boundsMin, 0.f);
+			result.uvTransform = glm::vec4(uvMin, uvMax - uvMin);
+		}
+		else
+		{
+			result.positionOffset = glm::vec4(0.f);
+			result.positionScale = glm::vec4(1.f, 1.f, 1.f, 0.f);
+			result.uvTransform = glm::vec4(0.f, 0.f, 1.f, 1.f);
+		}
+		return result;
+	}
+
+	// Writes vertexCount() vertices of VertexFormats::Stride(format) bytes to
+	// dst, which is usually mapped GPU memory. Every byte is written once and
+	// in order so write-combined mappings are filled at full speed.
+	void writeVertices(void* dst, VertexFormat format = VertexFormat::Standard) const
+	{
+		if (format == VertexFormat::Standard && cache)
 		{
-			data[index++] = vertices[triangles[i][0][0]].x;
-			data[index++] = vertices[triangles[i][0][0]].y;
-			data[index++] = vertices[triangles[i][0][0]].z;
+			memcpy(dst, cache->data + cacheHeader.vertexOffset, cacheHeader.vertexCount * static_cast<size_t>(vertexStride));
+			return;
+		}
+		VertexFormats::Visit(format, [this, dst](auto layout) { packVertices<decltype(layout)>(static_cast<char*>(dst)); });
+	}
+
+	// Packs the quantized stream, decodes it the way the shaders do and
+	// reports the worst error per attribute.
+	std::string quantizationReport() const
+	{
+		size_t count = vertexCount();
+		std::vector<char> packed(count * QuantizedVertex::stride);
+		packVertices<QuantizedVertex>(packed.data());
+		VertexEncoding encoding = vertexEncoding();
 
-			data[index++] = normals[triangles[i][1][0]].x;
-			data[index++] = normals[triangles[i][1][0]].y;
-			data[index++] = normals[triangles[i][1][0]].z;
+		float positionError = 0.f, normalError = 0.f, uvError = 0.f;
+		for (size_t i = 0; i < count; i++)
+		{
+			VertexData original = readVertex(i);
+			VertexData decoded;
+			QuantizedVertex::Unpack(&packed[i * QuantizedVertex::stride], encoding, decoded);
 
-			data[index++] = uvs[triangles[i][2][0]].x;
-			data[index++] = uvs[triangles[i][2][0]].y;
+			positionError = std::max(positionError, glm::length(decoded.position - original.position));
+			uvError = std::max(uvError, std::max(std::fabs(decoded.uv.x - original.uv.x), std::fabs(decoded.uv.y - original.uv.y)));
+			float length = glm::length(original.normal);
+			if (length > 0.f)
+			{
+				float cosine = std::min(1.f, std::max(-1.f, glm::dot(decoded.normal, original.normal / length)));
+				normalError = std::max(normalError, std::acos(cosine));
+			}
+		}
+		float diagonal = glm::length(boundsMax - boundsMin);
+		char text[256];
+		snprintf(text, sizeof(text), "quantized %u -> %u bytes/vertex, max error: position %g (%.4f%% of diagonal), normal %.3f deg, uv %g",
+			StandardVertex::stride, QuantizedVertex::stride, positionError, diagonal > 0.f ? 100.f * positionError / diagonal : 0.f,
+			glm::degrees(normalError), uvError);
+		return text;
+	}
 
-			data[index++] = vertices[triangles[i][0][1]].x;
-			data[index++] = vertices[triangles[i][0][1]].y;
-			data[index++] = vertices[triangles[i][0][1]].z;
+	// Writes indexCount() indices of indexSize() bytes each to dst
+	void writeIndices(void* dst) const
+	{
+		if (cache)
+		{
+			memcpy(dst, cache->data + cacheHeader.indexOffset, cacheHeader.indexCount * static_cast<size_t>(cacheHeader.indexSize));
+			return;
+		}
+		if (indexSize() == sizeof(uint16_t))
+		{
+			uint16_t* out = static_cast<uint16_t*>(dst);
+			for (size_t i = 0; i < indices.size(); i++)
+			{
+				out[i] = static_cast<uint16_t>(indices[i]);
+			}
+		}
+		else
+		{
+			memcpy(dst, indices.data(), indices.size() * sizeof(uint32_t));
+		}
+	}
 
-			data[index++] = normals[triangles[i][1][1]].x;
-			data[index++] = normals[triangles[i][1][1]].y;
-			data[index++] = normals[triangles[i][1][1]].z;
+	size_t vertexCount() const
+	{
+		return cache ? cacheHeader.vertexCount : corners.size();
+	}
 
-			data[index++] = uvs[triangles[i][2][1]].x;
-			data[index++] = uvs[triangles[i][2][1]].y;
+	size_t indexCount() const
+	{
+		return cache ? cacheHeader.indexCount : indices.size();
+	}
 
-			data[index++] = vertices[triangles[i][0][2]].x;
-			data[index++] = vertices[triangles[i][0][2]].y;
-			data[index++] = vertices[triangles[i][0][2]].z;
+	size_t indexSize() const
+	{
+		return vertexCount() <= 65536 ? sizeof(uint16_t) : sizeof(uint32_t);
+	}
 
-			data[index++] = normals[triangles[i][1][2]].x;
-			data[index++] = normals[triangles[i][1][2]].y;
-			data[index++] = normals[triangles[i][1][2]].z;
+	bool fromCache() const
+	{
+		return static_cast<bool>(cache);
+	}
 
-			data[index++] = uvs[triangles[i][2][2]].x;
-			data[index++] = uvs[triangles[i][2][2]].y;
+	// Vertex count and GPU bytes of the indexed mesh against the expanded
+	// triangle soup it replaces, followed by the triangle count of every LOD.
+	std::string statistics()
+	{
+		size_t stride = sizeof(float) * (3 + 3 + 2);
+		std::vector<uint32_t> lod0(indices.begin(), indices.begin() + (lods.empty() ? indices.size() : lods[0].indexCount));
+		size_t soupBytes = lod0.size() * stride;
+		size_t indexedBytes = corners.size() * stride + lod0.size() * indexSize();
+		char text[256];
+		int length = snprintf(text, sizeof(text), "%zu -> %zu vertices, %zu -> %zu bytes (%.1f%%), ACMR 3.00 -> %.2f, %zu meshlets, LOD triangles",
+			lod0.size(), corners.size(), soupBytes, indexedBytes,
+			soupBytes == 0 ? 0.0 : 100.0 * indexedBytes / soupBytes,
+			MeshOptimizer::AverageCacheMissRatio(lod0, corners.size()), meshlets.size());
+		for (size_t i = 0; i < lods.size() && length > 0 && static_cast<size_t>(length) < sizeof(text); i++)
+		{
+			length += snprintf(text + length, sizeof(text) - length, " %u", lods[i].indexCount / 3);
 		}
-		return data;
+		return text;
 	}
-	Mesh() : name(), vertices(), normals(), uvs(), triangles() {}
+
+	// Collapses identical (position, normal, uv) corners into one vertex and
+	// orders the resulting triangle list for the post-transform cache.
+	void build()
+	{
+		corners.clear();
+		indices.resize(triangles.size() * 3);
+
+		size_t capacity = 64;
+		while (capacity < indices.size() * 2)
+		{
+			capacity <<= 1;
+		}
+		std::vector<uint32_t> table(capacity, UINT32_MAX);
+		corners.reserve(indices.size() / 2);
+		for (size_t i = 0; i < triangles.size(); i++)
+		{
+			for (int c = 0; c < 3; c++)
+			{
+				glm::ivec3 corner(triangles[i][0][c], triangles[i][1][c], triangles[i][2][c]);
+				size_t slot = hashCorner(corner) & (capacity - 1);
+				while (table[slot] != UINT32_MAX && !(corners[table[slot]] == corner))
+				{
+					slot = (slot + 1) & (capacity - 1);
+				}
+				if (table[slot] == UINT32_MAX)
+				{
+					table[slot] = static_cast<uint32_t>(corners.size());
+					corners.push_back(corner);
+				}
+				indices[i * 3 + c] = table[slot];
+			}
+		}
+		MeshOptimizer::OptimizeVertexCache(indices, corners.size());
+
+		PositionStream positions = PositionStream::Create(corners.size(), [this](size_t i) { return vertices[corners[i][0]]; });
+		Bounds::Aabb(positions, boundsMin, boundsMax);
+		Bounds::Sphere(positions, sphereCenter, sphereRadius);
+
+		uvMin = glm::vec2(0.f);
+		uvMax = glm::vec2(0.f);
+		if (!corners.empty())
+		{
+			uvMin = uvMax = uvs[corners[0][2]];
+		}
+		for (const auto& corner : corners)
+		{
+			uvMin = glm::min(uvMin, uvs[corner[2]]);
+			uvMax = glm::max(uvMax, uvs[corner[2]]);
+		}
+
+		std::vector<VertexData> data(corners.size());
+		for (size_t i = 0; i < corners.size(); i++)
+		{
+			data[i].position = vertices[corners[i][0]];
+			data[i].normal = normals[corners[i][1]];
+			data[i].uv = uvs[corners[i][2]];
+		}
+		buildLods(data);
+		meshlets = MeshOptimizer::BuildMeshlets(indices, lods[0].indexCount, data);
+	}
+
+	// Appends up to maxLods - 1 simplified index lists after the full one, each
+	// with about half the triangles of the previous level. They all share the
+	// vertex stream, so a LOD switch only changes firstIndex/indexCount.
+	void buildLods(const std::vector<VertexData>& data)
+	{
+		lods.clear();
+		Lod full = { 0, static_cast<uint32_t>(indices.size()), 0.f };
+		lods.push_back(full);
+
+		// Every level is simplified from the full mesh, so they build in parallel
+		std::vector<uint32_t> source(indices);
+		float maxError = glm::length(boundsMax - boundsMin) * maxLodError;
+		std::vector<std::vector<uint32_t>> levels(maxLods - 1);
+		std::vector<float> errors(maxLods - 1, 0.f);
+		ThreadPool::Shared().parallelFor(levels.size(), [&](size_t i)
+		{
+			size_t target = source.size() / 3 >> (i + 1);
+			levels[i] = MeshOptimizer::Simplify(source, data, target * 3, maxError, errors[i]);
+			MeshOptimizer::OptimizeVertexCache(levels[i], corners.size());
+		});
+		for (size_t i = 0; i < levels.size(); i++)
+		{
+			const std::vector<uint32_t>& lod = levels[i];
+			// Stop once a level no longer saves enough to be worth a switch
+			if (lod.empty() || lod.size() * 5 > lods.back().indexCount * 4)
+			{
+				break;
+			}
+			Lod next = { static_cast<uint32_t>(indices.size()), static_cast<uint32_t>(lod.size()), errors[i] };
+			lods.push_back(next);
+			indices.insert(indices.end(), lod.begin(), lod.end());
+		}
+	}
+
+	// Loads <name>.vmesh when it was built from the current <name>.obj,
+	// otherwise parses and builds the OBJ and writes the cache for the next
+	// run.
+	static Mesh* Load(const std::string& name)
+	{
+		std::string sourcePath = name + ".obj";
+		std::string cachePath = name + ".vmesh";
+		MappedFile::Info sourceInfo = {};
+		MappedFile::Info cacheInfo = {};
+		bool hasSource = MappedFile::Stat(sourcePath.c_str(), sourceInfo);
+		if (MappedFile::Stat(cachePath.c_str(), cacheInfo))
+		{
+			Mesh* mesh = new Mesh();
+			if (mesh->loadCache(cachePath.c_str(), cacheInfo, hasSource ? sourcePath.c_str() : nullptr, hasSource ? &sourceInfo : nullptr))
+			{
+				mesh->source = name;
+				return mesh;
+			}
+			delete mesh;
+		}
+
+		Mesh* mesh = Create(sourcePath.c_str());
+		if (mesh == nullptr)
+		{
+			return nullptr;
+		}
+		mesh->sourceModified = sourceInfo.modified;
+		mesh->build();
+		mesh->saveCache(cachePath.c_str());
+		mesh->source = name;
+		return mesh;
+	}
+
+	Mesh() : name(), source(), boundsMin(), boundsMax(), sphereCenter(), sphereRadius(0.f), uvMin(), uvMax(), lods(), meshlets(), vertices(), normals(), uvs(), triangles(), corners(), indices(),
+		sourceSize(0), sourceHash(0), sourceModified(0), cache(), cacheHeader() {}
 	~Mesh()
 	{
 		vertices.clear();
 		normals.clear();
 		uvs.clear();
 		triangles.clear();
+		corners.clear();
+		indices.clear();
+		lods.clear();
+		meshlets.clear();
 	}
-	static Mesh* Create(const char* filename)
+	// threadCount == 0 picks the shared pool's width; small files are always
+	// parsed on the calling thread since splitting them costs more than it saves.
+	static Mesh* Create(const char* filename, unsigned threadCount = 0)
 	{
-		FILE* input = fopen(filename, "r");
-		if (input == nullptr)
+		MappedFile file;
+		if (!file.open(filename))
 		{
 			return nullptr;
 		}
 		Mesh* mesh = new Mesh();
-		while (!feof(input))
+		if (!mesh->parse(file.begin(), file.end(), threadCount))
+		{
+			delete mesh;
+			return nullptr;
+		}
+		mesh->sourceSize = file.size;
+		mesh->sourceHash = hashSource(file.begin(), file.end());
+		return mesh;
+	}
+
+public:
+	glm::vec3 boundsMin;
+	glm::vec3 boundsMax;
+	// Object-space bounding sphere, tighter than the AABB's circumsphere
+	glm::vec3 sphereCenter;
+	float sphereRadius;
+	glm::vec2 uvMin;
+	glm::vec2 uvMax;
+
+	// Index range of one level of detail. error is an upper bound of how far
+	// (in object space) the simplified surface is from the full mesh.
+	struct Lod
+	{
+		uint32_t firstIndex;
+		uint32_t indexCount;
+		float error;
+	};
+	// lods[0] is the full mesh; indexCount() covers all of them
+	std::vector<Lod> lods;
+
+	static const uint32_t maxLods = 5;
+	// Simplification stops before the surface moves this fraction of the
+	// bounding box diagonal
+	static constexpr float maxLodError = 0.05f;
+
+	// Clusters of lods[0], in index order
+	std::vector<Meshlet> meshlets;
+
+protected:
+	// Layout of a .vmesh file: this header, the object name, the vertex and
+	// index streams exactly as they are uploaded, the Lod table and the
+	// Meshlet table, each 16-byte aligned.
+	struct CacheHeader
+	{
+		char magic[4];
+		uint32_t version;
+		uint64_t sourceSize;
+		uint64_t sourceHash;
+		int64_t sourceModified;
+		uint32_t vertexCount;
+		uint32_t vertexStride;
+		uint32_t indexCount;
+		uint32_t indexSize;
+		float boundsMin[3];
+		float boundsMax[3];
+		float uvMin[2];
+		float uvMax[2];
+		float sphereCenter[3];
+		float sphereRadius;
+		uint32_t nameLength;
+		uint32_t lodCount;
+		uint64_t vertexOffset;
+		uint64_t indexOffset;
+		uint64_t lodOffset;
+		uint32_t meshletCount;
+		uint32_t reserved;
+		uint64_t meshletOffset;
+	};
+	static const uint32_t cacheVersion = 6;
+
+	// Hashed in fixed 1 MB blocks so the result does not depend on how many
+	// threads did the work.
+	static uint64_t hashSource(const char* begin, const char* end)
+	{
+		size_t size = static_cast<size_t>(end - begin);
+		size_t blockCount = (size + minChunkSize - 1) / minChunkSize;
+		std::vector<uint64_t> blocks(blockCount);
+		ThreadPool::Shared().parallelFor(blockCount, [begin, size, &blocks](size_t i)
+		{
+			size_t offset = i * minChunkSize;
+			size_t length = size - offset < minChunkSize ? size - offset : minChunkSize;
+			blocks[i] = Hash::Bytes(begin + offset, length);
+		});
+		uint64_t hash = Hash::Value(size);
+		for (uint64_t block : blocks)
+		{
+			hash = Hash::Combine(hash, block);
+		}
+		return hash;
+	}
+
+	static uint64_t alignOffset(uint64_t offset)
+	{
+		return (offset + 15) & ~static_cast<uint64_t>(15);
+	}
+
+	// info is the cache file's own; sourcePath and source describe the OBJ,
+	// both nullptr when it is gone
+	bool loadCache(const char* filename, const MappedFile::Info& info, const char* sourcePath, const MappedFile::Info* source)
+	{
+		auto file = std::make_shared<MappedFile>();
+		if (!file->open(filename) || file->size < sizeof(CacheHeader))
+		{
+			return false;
+		}
+		CacheHeader header;
+		memcpy(&header, file->data, sizeof(header));
+		if (memcmp(header.magic, "VMSH", 4) != 0 || header.version != cacheVersion || header.vertexStride != vertexStride)
+		{
+			return false;
+		}
+		if (source != nullptr && header.sourceSize != source->size)
+		{
+			return false;
+		}
+		// Only when the stamp cannot vouch for the OBJ (an edit in the tick the
+		// cache was written, an older file restored with cp -p, a checkout)
+		// are contents compared. Hashing is one parallel read of the file,
+		// far less than a parse, but far more than mapping the cache.
+		MappedFile::Info recorded = { header.sourceSize, header.sourceModified };
+		if (source != nullptr && !MappedFile::Unchanged(*source, recorded, info))
+		{
+			MappedFile sourceFile;
+			if (!sourceFile.open(sourcePath) || hashSource(sourceFile.begin(), sourceFile.end()) != header.sourceHash)
+			{
+				return false;
+			}
+		}
+		size_t indexSize = header.vertexCount <= 65536 ? sizeof(uint16_t) : sizeof(uint32_t);
+		if (header.indexSize != indexSize || header.indexCount % 3 != 0
+			|| sizeof(header) + header.nameLength > file->size
+			|| header.vertexOffset + static_cast<uint64_t>(header.vertexCount) * vertexStride > file->size
+			|| header.indexOffset + static_cast<uint64_t>(header.indexCount) * indexSize > file->size
+			|| header.lodCount == 0 || header.lodCount > maxLods
+			|| header.lodOffset + static_cast<uint64_t>(header.lodCount) * sizeof(Lod) > file->size
+			|| header.meshletOffset + static_cast<uint64_t>(header.meshletCount) * sizeof(Meshlet) > file->size)
+		{
+			return false;
+		}
+		std::vector<Lod> table(header.lodCount);
+		memcpy(table.data(), file->data + header.lodOffset, table.size() * sizeof(Lod));
+		for (const auto& lod : table)
+		{
+			if (lod.indexCount == 0 || lod.firstIndex % 3 != 0 || lod.indexCount % 3 != 0
+				|| static_cast<uint64_t>(lod.firstIndex) + lod.indexCount > header.indexCount)
+			{
+				return false;
+			}
+		}
+		std::vector<Meshlet> clusters(header.meshletCount);
+		memcpy(clusters.data(), file->data + header.meshletOffset, clusters.size() * sizeof(Meshlet));
+		for (const auto& meshlet : clusters)
+		{
+			if (static_cast<uint64_t>(meshlet.firstIndex) + meshlet.indexCount > table[0].indexCount)
+			{
+				return false;
+			}
+		}
+
+		// The OBJ was only touched, so stamp the cache with its new time and let
+		// the next run skip the hash
+		if (source != nullptr && !MappedFile::Unchanged(*source, recorded, info))
+		{
+			header.sourceModified = source->modified;
+			MappedFile::Patch(filename, 0, &header, sizeof(header));
+		}
+
+		name.assign(file->data + sizeof(header), header.nameLength);
+		boundsMin = glm::vec3(header.boundsMin[0], header.boundsMin[1], header.boundsMin[2]);
+		boundsMax = glm::vec3(header.boundsMax[0], header.boundsMax[1], header.boundsMax[2]);
+		sphereCenter = glm::vec3(header.sphereCenter[0], header.sphereCenter[1], header.sphereCenter[2]);
+		sphereRadius = header.sphereRadius;
+		uvMin = glm::vec2(header.uvMin[0], header.uvMin[1]);
+		uvMax = glm::vec2(header.uvMax[0], header.uvMax[1]);
+		sourceSize = header.sourceSize;
+		sourceHash = header.sourceHash;
+		sourceModified = header.sourceModified;
+		lods.swap(table);
+		meshlets.swap(clusters);
+		cacheHeader = header;
+		cache = file;
+		return true;
+	}
+
+	bool saveCache(const char* filename)
+	{
+		CacheHeader header = {};
+		memcpy(header.magic, "VMSH", 4);
+		header.version = cacheVersion;
+		header.sourceSize = sourceSize;
+		header.sourceHash = sourceHash;
+		header.sourceModified = sourceModified;
+		header.vertexCount = static_cast<uint32_t>(vertexCount());
+		header.vertexStride = vertexStride;
+		header.indexCount = static_cast<uint32_t>(indexCount());
+		header.indexSize = static_cast<uint32_t>(indexSize());
+		for (int i = 0; i < 3; i++)
+		{
+			header.boundsMin[i] = boundsMin[i];
+			header.boundsMax[i] = boundsMax[i];
+			header.sphereCenter[i] = sphereCenter[i];
+		}
+		header.sphereRadius = sphereRadius;
+		for (int i = 0; i < 2; i++)
+		{
+			header.uvMin[i] = uvMin[i];
+			header.uvMax[i] = uvMax[i];
+		}
+		header.nameLength = static_cast<uint32_t>(name.size());
+		header.vertexOffset = alignOffset(sizeof(header) + name.size());
+		header.indexOffset = alignOffset(header.vertexOffset + static_cast<uint64_t>(header.vertexCount) * vertexStride);
+		header.lodCount = static_cast<uint32_t>(lods.size());
+		header.lodOffset = alignOffset(header.indexOffset + static_cast<uint64_t>(header.indexCount) * header.indexSize);
+		header.meshletCount = static_cast<uint32_t>(meshlets.size());
+		header.meshletOffset = alignOffset(header.lodOffset + lods.size() * sizeof(Lod));
+
+		std::vector<char> vertexData(static_cast<size_t>(header.vertexCount) * vertexStride);
+		std::vector<char> indexData(static_cast<size_t>(header.indexCount) * header.indexSize);
+		writeVertices(vertexData.data());
+		writeIndices(indexData.data());
+
+		std::string temporary = MappedFile::TemporaryName(filename);
+		FILE* output = fopen(temporary.c_str(), "wb");
+		if (output == nullptr)
+		{
+			return false;
+		}
+		static const char padding[16] = {};
+		uint64_t vertexBytes = static_cast<uint64_t>(header.vertexCount) * vertexStride;
+		size_t namePadding = static_cast<size_t>(header.vertexOffset - sizeof(header) - name.size());
+		size_t vertexPadding = static_cast<size_t>(header.indexOffset - header.vertexOffset - vertexBytes);
+		size_t indexPadding = static_cast<size_t>(header.lodOffset - header.indexOffset - indexData.size());
+		size_t lodPadding = static_cast<size_t>(header.meshletOffset - header.lodOffset - lods.size() * sizeof(Lod));
+		bool written = fwrite(&header, sizeof(header), 1, output) == 1
+			&& fwrite(name.data(), 1, name.size(), output) == name.size()
+			&& fwrite(padding, 1, namePadding, output) == namePadding
+			&& fwrite(vertexData.data(), vertexStride, header.vertexCount, output) == header.vertexCount
+			&& fwrite(padding, 1, vertexPadding, output) == vertexPadding
+			&& fwrite(indexData.data(), header.indexSize, header.indexCount, output) == header.indexCount
+			&& fwrite(padding, 1, indexPadding, output) == indexPadding
+			&& fwrite(lods.data(), sizeof(Lod), lods.size(), output) == lods.size()
+			&& fwrite(padding, 1, lodPadding, output) == lodPadding
+			&& fwrite(meshlets.data(), sizeof(Meshlet), meshlets.size(), output) == meshlets.size();
+		written = fclose(output) == 0 && written;
+		if (!written)
+		{
+			remove(temporary.c_str());
+			return false;
+		}
+		return MappedFile::Publish(temporary, filename);
+	}
+
+	VertexEncoding vertexEncoding() const
+	{
+		return VertexEncoding::Create(boundsMin, boundsMax, uvMin, uvMax);
+	}
+
+	// Vertex i in float form, from the built corners or the cached stream
+	VertexData readVertex(size_t i) const
+	{
+		VertexData vertex;
+		if (cache)
+		{
+			StandardVertex::Unpack(cache->data + cacheHeader.vertexOffset + i * vertexStride, VertexEncoding(), vertex);
+			return vertex;
+		}
+		vertex.position = vertices[corners[i][0]];
+		vertex.normal = normals[corners[i][1]];
+		vertex.uv = uvs[corners[i][2]];
+		return vertex;
+	}
+
+	template<typename Layout>
+	void packVertices(char* out) const
+	{
+		VertexEncoding encoding = vertexEncoding();
+		VertexData vertex;
+		if (cache)
+		{
+			const char* in = cache->data + cacheHeader.vertexOffset;
+			for (size_t i = 0; i < cacheHeader.vertexCount; i++, in += vertexStride, out += Layout::stride)
+			{
+				StandardVertex::Unpack(in, encoding, vertex);
+				Layout::Pack(vertex, encoding, out);
+			}
+			return;
+		}
+		for (size_t i = 0; i < corners.size(); i++, out += Layout::stride)
 		{
-			char line[1024u];
-			fgets(line, 1024u, input);
+			vertex.position = vertices[corners[i][0]];
+			vertex.normal = normals[corners[i][1]];
+			vertex.uv = uvs[corners[i][2]];
+			Layout::Pack(vertex, encoding, out);
+		}
+	}
 
-			auto size = strlen(line);
-			if (line[size - 1] != '\n')
+	static const size_t minChunkSize = 1u << 20;
+
+	struct Counts
+	{
+		size_t vertices;
+		size_t normals;
+		size_t uvs;
+		size_t triangles;
+	};
+
+	struct Chunk
+	{
+		const char* begin;
+		const char* end;
+		const char* objectName;
+		Counts counts;
+		bool parsed;
+	};
+
+	// Cheap first pass: only looks at the first two bytes of every line so the
+	// attribute arrays can be sized exactly before anything is parsed.
+	static void count(Chunk& chunk)
+	{
+		Counts counts = {};
+		const char* cursor = chunk.begin;
+		const char* end = chunk.end;
+		chunk.objectName = nullptr;
+		while (cursor < end)
+		{
+			if (cursor[0] == 'v' && cursor + 1 < end)
+			{
+				switch (cursor[1])
+				{
+				case ' ':
+				case '\t':
+					counts.vertices++;
+					break;
+				case 'n':
+					counts.normals++;
+					break;
+				case 't':
+					counts.uvs++;
+					break;
+				default:
+					break;
+				}
+			}
+			else if (cursor[0] == 'f')
+			{
+				counts.triangles++;
+			}
+			else if (cursor[0] == 'o' && chunk.objectName == nullptr)
 			{
-				delete mesh;
-				return nullptr;
+				chunk.objectName = cursor;
 			}
+			cursor = nextLine(cursor, end);
+		}
+		chunk.counts = counts;
+	}
+
+	// Chunks end just after a newline, so every line lands in exactly one
+	// chunk and each worker can count and parse its chunk independently.
+	static std::vector<Chunk> split(const char* begin, const char* end, unsigned threadCount)
+	{
+		size_t size = static_cast<size_t>(end - begin);
+		size_t chunkCount = std::min<size_t>(threadCount, size / minChunkSize);
+		chunkCount = std::max<size_t>(chunkCount, 1);
+
+		std::vector<Chunk> chunks;
+		chunks.reserve(chunkCount);
+		const char* cursor = begin;
+		for (size_t i = 1; i <= chunkCount && cursor < end; i++)
+		{
+			const char* boundary = i == chunkCount ? end : nextLine(std::max(cursor, begin + size * i / chunkCount), end);
+			Chunk chunk = {};
+			chunk.begin = cursor;
+			chunk.end = boundary;
+			chunks.push_back(chunk);
+			cursor = boundary;
+		}
+		return chunks;
+	}
+
+	bool parse(const char* begin, const char* end, unsigned threadCount)
+	{
+		ThreadPool& pool = ThreadPool::Shared();
+		if (threadCount == 0)
+		{
+			threadCount = static_cast<unsigned>(pool.size() + 1);
+		}
+		std::vector<Chunk> chunks = split(begin, end, threadCount);
+		pool.parallelFor(chunks.size(), [&chunks](size_t i) { count(chunks[i]); });
+
+		// Every chunk writes straight into its own slice of the final arrays,
+		// so there is no merge step and the layout matches a serial parse.
+		Counts total = {};
+		std::vector<Counts> offsets(chunks.size());
+		for (size_t i = 0; i < chunks.size(); i++)
+		{
+			offsets[i] = total;
+			total.vertices += chunks[i].counts.vertices;
+			total.normals += chunks[i].counts.normals;
+			total.uvs += chunks[i].counts.uvs;
+			total.triangles += chunks[i].counts.triangles;
+			if (name.empty() && chunks[i].objectName != nullptr)
+			{
+				name = parseName(chunks[i].objectName, chunks[i].end);
+			}
+		}
+		vertices.resize(total.vertices);
+		normals.resize(total.normals);
+		uvs.resize(total.uvs);
+		triangles.resize(total.triangles);
+
+		pool.parallelFor(chunks.size(), [this, &chunks, &offsets](size_t i)
+		{
+			chunks[i].parsed = parseRange(chunks[i].begin, chunks[i].end, offsets[i]);
+		});
+		for (const auto& chunk : chunks)
+		{
+			if (!chunk.parsed)
+			{
+				return false;
+			}
+		}
+
+		// Every corner must reference an element that exists. Corners without
+		// a normal get their face's flat normal, stored after the file's own
+		// at one slot per triangle; corners without a uv share a zero uv
+		// appended after the file's.
+		size_t normalCount = normals.size();
+		size_t uvCount = uvs.size();
+		std::atomic<bool> valid(true);
+		std::atomic<bool> missingNormals(false);
+		std::atomic<bool> missingUvs(false);
+		pool.parallelFor(chunks.size(), [&](size_t i)
+		{
+			// parseRange has advanced offsets[i] to the end of the chunk
+			size_t first = offsets[i].triangles - chunks[i].counts.triangles;
+			for (size_t t = first; t < first + chunks[i].counts.triangles; t++)
+			{
+				const glm::imat3& face = triangles[t];
+				for (int corner = 0; corner < 3; corner++)
+				{
+					if (!inRange(face[0][corner], vertices.size())
+						|| (face[1][corner] != missingIndex && !inRange(face[1][corner], normalCount))
+						|| (face[2][corner] != missingIndex && !inRange(face[2][corner], uvCount)))
+					{
+						valid = false;
+						return;
+					}
+					if (face[1][corner] == missingIndex)
+					{
+						missingNormals = true;
+					}
+					if (face[2][corner] == missingIndex)
+					{
+						missingUvs = true;
+					}
+				}
+			}
+		});
+		if (!valid)
+		{
+			return false;
+		}
+		if (missingNormals)
+		{
+			normals.resize(normalCount + triangles.size());
+		}
+		if (missingUvs)
+		{
+			uvs.push_back(glm::vec2(0.f));
+		}
+		if (missingNormals || missingUvs)
+		{
+			pool.parallelFor(chunks.size(), [&](size_t i)
+			{
+				size_t first = offsets[i].triangles - chunks[i].counts.triangles;
+				for (size_t t = first; t < first + chunks[i].counts.triangles; t++)
+				{
+					glm::imat3& face = triangles[t];
+					if (face[1][0] == missingIndex || face[1][1] == missingIndex || face[1][2] == missingIndex)
+					{
+						glm::vec3 normal = glm::cross(vertices[face[0][1]] - vertices[face[0][0]], vertices[face[0][2]] - vertices[face[0][0]]);
+						float length = glm::length(normal);
+						normals[normalCount + t] = length > 0.f ? normal / length : glm::vec3(0.f, 1.f, 0.f);
+					}
+					for (int corner = 0; corner < 3; corner++)
+					{
+						if (face[1][corner] == missingIndex)
+						{
+							face[1][corner] = static_cast<int>(normalCount + t);
+						}
+						if (face[2][corner] == missingIndex)
+						{
+							face[2][corner] = static_cast<int>(uvCount);
+						}
+					}
+				}
+			});
+		}
+		return true;
+	}
+
+	// Face indices of attributes a corner leaves out (f v, f v/vt, f v//vn)
+	static const int missingIndex = -1;
+	// Relative indices reaching before the first element
+	static const int invalidIndex = INT_MIN;
+
+	static bool inRange(int index, size_t count)
+	{
+		return index >= 0 && static_cast<size_t>(index) < count;
+	}
+
+	static size_t hashCorner(const glm::ivec3& corner)
+	{
+		uint64_t hash = static_cast<uint32_t>(corner.x) * 0x9E3779B97F4A7C15ull;
+		hash ^= static_cast<uint32_t>(corner.y) * 0xC2B2AE3D27D4EB4Full + (hash << 6) + (hash >> 2);
+		hash ^= static_cast<uint32_t>(corner.z) * 0x165667B19E3779F9ull + (hash << 6) + (hash >> 2);
+		return static_cast<size_t>(hash ^ (hash >> 32));
+	}
+
+	static std::string parseName(const char* line, const char* end)
+	{
+		const char* p = skipSpaces(line + 1, end);
+		const char* q = p;
+		while (q < end && *q != '\r' && *q != '\n')
+		{
+			q++;
+		}
+		return std::string(p, q);
+	}
+
+	// Parses [cursor, end) writing each element at the slot given by `at` and
+	// advancing it. Relative (negative) face indices resolve against `at` too.
+	bool parseRange(const char* cursor, const char* end, Counts& at)
+	{
+		while (cursor < end)
+		{
+			const char* line = cursor;
+			cursor = nextLine(cursor, end);
 			switch (line[0])
 			{
-			case 'o':
-				sscanf(line, "o %s", mesh->name);
-				break;
 			case 'v':
-
+				if (line + 1 >= cursor)
+				{
+					break;
+				}
 				switch (line[1])
 				{
 				case 't':
 				{
-					glm::vec2 uv;
-					sscanf(line, "vt %f %f", &uv.x, &uv.y);
-					mesh->uvs.push_back(uv);
+					glm::vec2& uv = uvs[at.uvs++];
+					const char* p = line + 2;
+					p = parseFloat(p, cursor, uv.x);
+					p = parseFloat(p, cursor, uv.y);
 					break;
 				}
 				case 'n':
 				{
-					glm::vec3 normal;
-					sscanf(line, "vn %f %f %f", &normal.x, &normal.y, &normal.z);
-					mesh->normals.push_back(normal);
+					glm::vec3& normal = normals[at.normals++];
+					const char* p = line + 2;
+					p = parseFloat(p, cursor, normal.x);
+					p = parseFloat(p, cursor, normal.y);
+					p = parseFloat(p, cursor, normal.z);
 					break;
 				}
-				default:
+				case ' ':
+				case '\t':
 				{
-					glm::vec3 vertex;
-					sscanf(line, "v %f %f %f", &vertex.x, &vertex.y, &vertex.z);
-					mesh->vertices.push_back(vertex);
+					glm::vec3& vertex = vertices[at.vertices++];
+					const char* p = line + 1;
+					p = parseFloat(p, cursor, vertex.x);
+					p = parseFloat(p, cursor, vertex.y);
+					p = parseFloat(p, cursor, vertex.z);
 					break;
 				}
+				default:
+					break;
 				}
-
 				break;
 			case 'f':
 			{
-				glm::imat3 face;
-				face[0][0];
-				sscanf(line, "f %u/%u/%u %u/%u/%u %u/%u/%u",
-					&face[0][0], &face[1][0], &face[2][0],
-					&face[0][1], &face[1][1], &face[2][1],
-					&face[0][2], &face[1][2], &face[2][2]);
-				for (size_t i = 0; i < 9u; i++)
+				// OBJ corners are v/vt/vn; we keep [0] = position, [1] = normal,
+				// [2] = uv which is the order writeVertices reads them in.
+				glm::imat3& face = triangles[at.triangles++];
+				const char* p = line + 1;
+				for (int corner = 0; corner < 3; corner++)
 				{
-					face[i/3][i%3]--;
+					int v = 0, vt = 0, vn = 0;
+					p = parseIndex(skipSpaces(p, cursor), cursor, v);
+					if (v == 0)
+					{
+						return false;
+					}
+					if (p < cursor && *p == '/')
+					{
+						p = parseIndex(p + 1, cursor, vt);
+						if (p < cursor && *p == '/')
+						{
+							p = parseIndex(p + 1, cursor, vn);
+						}
+					}
+					face[0][corner] = resolveIndex(v, at.vertices);
+					face[1][corner] = resolveIndex(vn, at.normals);
+					face[2][corner] = resolveIndex(vt, at.uvs);
 				}
-				mesh->triangles.push_back(face);
 				break;
 			}
 			default:
 				break;
 			}
 		}
-		fclose(input);
-		return mesh;
+		return true;
 	}
-protected:
+
+	static int resolveIndex(int index, size_t count)
+	{
+		if (index > 0)
+		{
+			return index - 1;
+		}
+		if (index < 0)
+		{
+			int64_t resolved = static_cast<int64_t>(count) + index;
+			return resolved < 0 ? invalidIndex : static_cast<int>(resolved);
+		}
+		return missingIndex;
+	}
+
+	static const char* nextLine(const char* cursor, const char* end)
+	{
+		while (cursor < end && *cursor != '\n')
+		{
+			cursor++;
+		}
+		return cursor < end ? cursor + 1 : end;
+	}
+
+	static const char* skipSpaces(const char* cursor, const char* end)
+	{
+		while (cursor < end && (*cursor == ' ' || *cursor == '\t'))
+		{
+			cursor++;
+		}
+		return cursor;
+	}
+
+	static const char* parseIndex(const char* cursor, const char* end, int& value)
+	{
+		bool negative = false;
+		if (cursor < end && *cursor == '-')
+		{
+			negative = true;
+			cursor++;
+		}
+		// Saturates instead of overflowing; no array is that large, so such
+		// indices fail the range check after parsing
+		int64_t result = 0;
+		while (cursor < end && *cursor >= '0' && *cursor <= '9')
+		{
+			result = std::min<int64_t>(result * 10 + (*cursor - '0'), INT_MAX);
+			cursor++;
+		}
+		value = static_cast<int>(negative ? -result : result);
+		return cursor;
+	}
+
+	// Decimal to float without locale or format-string handling. Digits beyond
+	// the 19th cannot change a float and are only used for the exponent.
+	static const char* parseFloat(const char* cursor, const char* end, float& value)
+	{
+		static const double powers[] = {
+			1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+			1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+		};
+
+		cursor = skipSpaces(cursor, end);
+		bool negative = false;
+		if (cursor < end && (*cursor == '-' || *cursor == '+'))
+		{
+			negative = *cursor == '-';
+			cursor++;
+		}
+
+		uint64_t mantissa = 0;
+		int digits = 0;
+		int exponent = 0;
+		while (cursor < end && *cursor >= '0' && *cursor <= '9')
+		{
+			if (digits < 19)
+			{
+				mantissa = mantissa * 10 + (*cursor - '0');
+				digits += mantissa != 0;
+			}
+			else
+			{
+				exponent++;
+			}
+			cursor++;
+		}
+		if (cursor < end && *cursor == '.')
+		{
+			cursor++;
+			while (cursor < end && *cursor >= '0' && *cursor <= '9')
+			{
+				if (digits < 19)
+				{
+					mantissa = mantissa * 10 + (*cursor - '0');
+					digits += mantissa != 0;
+					exponent--;
+				}
+				cursor++;
+			}
+		}
+		if (cursor < end && (*cursor == 'e' || *cursor == 'E'))
+		{
+			int sign = 1;
+			int power = 0;
+			cursor++;
+			if (cursor < end && (*cursor == '-' || *cursor == '+'))
+			{
+				sign = *cursor == '-' ? -1 : 1;
+				cursor++;
+			}
+			while (cursor < end && *cursor >= '0' && *cursor <= '9')
+			{
+				if (power < 10000)
+				{
+					power = power * 10 + (*cursor - '0');
+				}
+				cursor++;
+			}
+			exponent += sign * power;
+		}
+
+		double result = static_cast<double>(mantissa);
+		if (mantissa != 0)
+		{
+			if (exponent < 0)
+			{
+				result = -exponent <= 22 ? result / powers[-exponent] : result * std::pow(10.0, exponent);
+			}
+			else if (exponent > 0)
+			{
+				result = exponent <= 22 ? result * powers[exponent] : result * std::pow(10.0, exponent);
+			}
+		}
+		value = static_cast<float>(negative ? -result : result);
+		return cursor;
+	}
+
 	std::vector<glm::vec3> vertices;
 	std::vector<glm::vec3> normals;
 	std::vector<glm::vec2> uvs;
 	std::vector<glm::imat3> triangles;
+	// Unique (position, normal, uv) index tuples and the triangles over them
+	std::vector<glm::ivec3> corners;
+	std::vector<uint32_t> indices;
+
+	uint64_t sourceSize;
+	uint64_t sourceHash;
+	int64_t sourceModified;
+	// Set when the GPU-ready streams come straight from a mapped .vmesh
+	std::shared_ptr<MappedFile> cache;
+	CacheHeader cacheHeader;
 };
\ No newline at end of file
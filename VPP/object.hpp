@@ -1,19 +1,45 @@
 #pragma once
 
+#include <future>
 #include <iostream>
+#include <memory>
 #include <vulkan/vulkan.hpp>
 
 #include "mesh.hpp"
 #include "transform.hpp"
 #include "texture.hpp"
+#include "utility.hpp"
 
 class Drawable
 {
 public:
-	Drawable(std::string name) : name(name), transform(), mvpMemoryBuffer(), lightMemoryBuffer(), cameraMemoryBuffer()
+	Drawable(std::string name) : name(name), transform(), vertexFormat(VertexFormat::Standard), lod(0), atlasPage(UINT32_MAX), uvTransform(0.f, 0.f, 1.f, 1.f), mvpMemoryBuffer(), lightMemoryBuffer(), cameraMemoryBuffer(), textureIndex(0)
 	{
-		mesh = *Mesh::Create((name + ".obj").c_str());
-		texture = Texture((name + ".bmp").c_str());
+		std::unique_ptr<Mesh> loaded(Mesh::Load(name));
+		if (loaded)
+		{
+			mesh = *loaded;
+			Log::Info(name.c_str(), mesh.fromCache() ? std::string("loaded from ") + name + ".vmesh" : mesh.statistics());
+		}
+		// Decoded on the pool while the rest of the scene is set up, once
+		// for all Drawables of the same name
+		pendingTexture = Texture::LoadAsync(name);
+	}
+
+	// Waits for the texture started by the constructor. Called by
+	// Scene::InitObjects before anything needs the texels.
+	void finishLoading()
+	{
+		if (!pendingTexture.valid())
+		{
+			return;
+		}
+		texture = pendingTexture.get();
+		pendingTexture = std::shared_future<Texture>();
+		if (!texture.empty())
+		{
+			Log::Info(name.c_str(), texture.statistics());
+		}
 	}
 
 public:
@@ -21,11 +47,29 @@ public:
 	Mesh mesh;
 	Transform transform;
 	Texture texture;
+	std::shared_future<Texture> pendingTexture;
+	// Set before the first Scene::Draw; Quantized switches the shader to its
+	// QUANTIZED_VERTEX variant
+	VertexFormat vertexFormat;
+	std::string shader;
 	vk::Pipeline pipeline;
+	MeshRange meshRange;
+	// Index into mesh.lods, chosen by Scene::UpdateLods
+	uint32_t lod;
+	// One flag per mesh.meshlets entry while lod is 0 and clusters are
+	// culled, empty when the whole LOD is drawn. Set by Scene::UpdateClusters.
+	std::vector<bool> visibleMeshlets;
+	// Page of Scene's texture atlas holding the texture, UINT32_MAX when it
+	// has its own image. uvTransform (offset.xy, scale.zw) maps the mesh's
+	// uvs into the page and is the identity otherwise.
+	uint32_t atlasPage;
+	glm::vec4 uvTransform;
 
 	BufferMemory mvpMemoryBuffer;
 	BufferMemory lightMemoryBuffer;
 	BufferMemory cameraMemoryBuffer;
 	ImageMemory sampledImage;
+	// Slot of sampledImage in the bindless texture array
+	uint32_t textureIndex;
 	std::vector<vk::DescriptorSet> descriptorSets;
 };
\ No newline at end of file
@@ -0,0 +1,650 @@
+#pragma once
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "vertex.hpp"
+
+// A cluster of triangles that is contiguous in the index buffer, with the
+// bounds used to cull it: a bounding sphere and a cone containing the
+// normals of all its triangles.
+struct Meshlet
+{
+	uint32_t firstIndex;
+	uint32_t indexCount;
+	float center[3];
+	float radius;
+	float coneAxis[3];
+	// sin of the cone's half angle, 1 when the cone is too wide to ever cull
+	float coneCutoff;
+};
+
+// Index-buffer level algorithms that run once at import time. They output
+// triangle lists of vertex indices; the vertex buffer itself is never changed.
+class MeshOptimizer
+{
+public:
+	static const uint32_t cacheSize = 32;
+
+	// Reorders triangles for post-transform vertex cache reuse using Tom
+	// Forsyth's "Linear-Speed Vertex Cache Optimisation".
+	static void OptimizeVertexCache(std::vector<uint32_t>& indices, size_t vertexCount)
+	{
+		size_t triangleCount = indices.size() / 3;
+		if (triangleCount == 0)
+		{
+			return;
+		}
+
+		// Triangles adjacent to every vertex, as a CSR list
+		std::vector<uint32_t> valence(vertexCount + 1, 0);
+		for (uint32_t index : indices)
+		{
+			valence[index]++;
+		}
+		std::vector<uint32_t> adjacencyOffset(vertexCount + 1, 0);
+		for (size_t v = 0; v < vertexCount; v++)
+		{
+			adjacencyOffset[v + 1] = adjacencyOffset[v] + valence[v];
+		}
+		std::vector<uint32_t> adjacency(indices.size());
+		{
+			std::vector<uint32_t> fill(adjacencyOffset.begin(), adjacencyOffset.end() - 1);
+			for (size_t i = 0; i < indices.size(); i++)
+			{
+				adjacency[fill[indices[i]]++] = static_cast<uint32_t>(i / 3);
+			}
+		}
+
+		std::vector<uint32_t> remaining(valence.begin(), valence.end() - 1);
+		std::vector<float> vertexScore(vertexCount);
+		for (size_t v = 0; v < vertexCount; v++)
+		{
+			vertexScore[v] = score(-1, remaining[v]);
+		}
+		std::vector<float> triangleScore(triangleCount);
+		for (size_t t = 0; t < triangleCount; t++)
+		{
+			triangleScore[t] = vertexScore[indices[t * 3]] + vertexScore[indices[t * 3 + 1]] + vertexScore[indices[t * 3 + 2]];
+		}
+		std::vector<bool> emitted(triangleCount, false);
+
+		std::vector<uint32_t> result;
+		result.reserve(indices.size());
+		uint32_t cache[cacheSize + 3];
+		uint32_t cacheCount = 0;
+		size_t scanCursor = 0;
+
+		int best = -1;
+		for (size_t emittedCount = 0; emittedCount < triangleCount; emittedCount++)
+		{
+			if (best < 0)
+			{
+				// Nothing useful in the cache, fall back to the best unseen triangle
+				float bestScore = -1.f;
+				for (size_t t = scanCursor; t < triangleCount; t++)
+				{
+					if (!emitted[t] && triangleScore[t] > bestScore)
+					{
+						bestScore = triangleScore[t];
+						best = static_cast<int>(t);
+					}
+				}
+				while (scanCursor < triangleCount && emitted[scanCursor])
+				{
+					scanCursor++;
+				}
+			}
+
+			const uint32_t* corners = &indices[best * 3];
+			result.insert(result.end(), corners, corners + 3);
+			emitted[best] = true;
+
+			// Push the corners to the front of the LRU cache
+			uint32_t next[cacheSize + 3];
+			uint32_t nextCount = 0;
+			for (int c = 0; c < 3; c++)
+			{
+				next[nextCount++] = corners[c];
+			}
+			for (uint32_t i = 0; i < cacheCount; i++)
+			{
+				uint32_t v = cache[i];
+				if (v != corners[0] && v != corners[1] && v != corners[2])
+				{
+					next[nextCount++] = v;
+				}
+			}
+			for (int c = 0; c < 3; c++)
+			{
+				uint32_t v = corners[c];
+				remaining[v]--;
+				uint32_t* begin = &adjacency[adjacencyOffset[v]];
+				uint32_t* end = begin + remaining[v] + 1;
+				*std::find(begin, end, static_cast<uint32_t>(best)) = *(end - 1);
+			}
+
+			// Rescore everything that was or still is in the cache
+			for (uint32_t i = 0; i < nextCount; i++)
+			{
+				uint32_t v = next[i];
+				int position = i < cacheSize ? static_cast<int>(i) : -1;
+				float updated = score(position, remaining[v]);
+				float delta = updated - vertexScore[v];
+				vertexScore[v] = updated;
+				for (uint32_t a = 0; a < remaining[v]; a++)
+				{
+					triangleScore[adjacency[adjacencyOffset[v] + a]] += delta;
+				}
+			}
+			cacheCount = nextCount < cacheSize ? nextCount : cacheSize;
+			std::copy(next, next + cacheCount, cache);
+
+			best = -1;
+			float bestScore = 0.f;
+			for (uint32_t i = 0; i < cacheCount; i++)
+			{
+				uint32_t v = cache[i];
+				for (uint32_t a = 0; a < remaining[v]; a++)
+				{
+					uint32_t t = adjacency[adjacencyOffset[v] + a];
+					if (triangleScore[t] > bestScore)
+					{
+						bestScore = triangleScore[t];
+						best = static_cast<int>(t);
+					}
+				}
+			}
+		}
+		indices.swap(result);
+	}
+
+	// Average cache miss ratio (transformed vertices per triangle) of a FIFO
+	// cache the size of a typical post-transform cache.
+	static float AverageCacheMissRatio(const std::vector<uint32_t>& indices, size_t vertexCount, uint32_t fifoSize = 16)
+	{
+		if (indices.empty())
+		{
+			return 0.f;
+		}
+		std::vector<size_t> stamp(vertexCount, 0);
+		size_t time = fifoSize + 1;
+		size_t misses = 0;
+		for (uint32_t index : indices)
+		{
+			if (time - stamp[index] > fifoSize)
+			{
+				stamp[index] = time++;
+				misses++;
+			}
+		}
+		return static_cast<float>(misses) / static_cast<float>(indices.size() / 3);
+	}
+
+	// Quadric error metric edge collapse (Garland and Heckbert, "Surface
+	// Simplification Using Quadric Error Metrics") down to targetIndexCount
+	// indices or until the next collapse would move the surface by more than
+	// maxError. Vertices only collapse onto other existing vertices, so the
+	// result indexes the same vertex buffer as the input. Vertices that
+	// share a position (uv and normal seams) move together, and each corner
+	// then takes the vertex at its new position whose normal and uv match
+	// best. Border and non-manifold vertices never move. error receives an
+	// upper bound of the object-space distance the surface moved.
+	static std::vector<uint32_t> Simplify(const std::vector<uint32_t>& indices, const std::vector<VertexData>& vertices,
+		size_t targetIndexCount, float maxError, float& error)
+	{
+		error = 0.f;
+
+		// Weld vertices by position, wedges lists the vertices of every position
+		std::vector<uint32_t> wedges(vertices.size());
+		for (size_t v = 0; v < vertices.size(); v++)
+		{
+			wedges[v] = static_cast<uint32_t>(v);
+		}
+		std::sort(wedges.begin(), wedges.end(), [&vertices](uint32_t a, uint32_t b)
+		{
+			const glm::vec3& p = vertices[a].position;
+			const glm::vec3& q = vertices[b].position;
+			return p.x != q.x ? p.x < q.x : (p.y != q.y ? p.y < q.y : p.z < q.z);
+		});
+		std::vector<uint32_t> positionOf(vertices.size());
+		std::vector<uint32_t> wedgeOffset;
+		std::vector<glm::vec3> positions;
+		for (size_t i = 0; i < wedges.size(); i++)
+		{
+			if (i == 0 || !(vertices[wedges[i]].position == vertices[wedges[i - 1]].position))
+			{
+				wedgeOffset.push_back(static_cast<uint32_t>(i));
+				positions.push_back(vertices[wedges[i]].position);
+			}
+			positionOf[wedges[i]] = static_cast<uint32_t>(positions.size() - 1);
+		}
+		wedgeOffset.push_back(static_cast<uint32_t>(wedges.size()));
+		size_t positionCount = positions.size();
+
+		// Every corner keeps its original vertex and tracks its current position
+		std::vector<uint32_t> corners(indices);
+		std::vector<uint32_t> triangles(indices.size());
+		for (size_t i = 0; i < indices.size(); i++)
+		{
+			triangles[i] = positionOf[indices[i]];
+		}
+
+		std::vector<Quadric> quadrics(positionCount);
+		for (size_t t = 0; t < triangles.size(); t += 3)
+		{
+			const glm::vec3& p0 = positions[triangles[t]];
+			glm::vec3 normal = glm::cross(positions[triangles[t + 1]] - p0, positions[triangles[t + 2]] - p0);
+			float length = glm::length(normal);
+			if (length > 0.f)
+			{
+				normal = normal / length;
+				Quadric plane(normal, -glm::dot(normal, p0));
+				for (int c = 0; c < 3; c++)
+				{
+					quadrics[triangles[t + c]].add(plane);
+				}
+			}
+		}
+
+		// Edges used by anything but exactly two triangles lock their ends
+		std::vector<bool> locked(positionCount, false);
+		{
+			std::vector<std::pair<uint32_t, uint32_t>> edges = collectEdges(triangles);
+			for (size_t i = 0; i < edges.size();)
+			{
+				size_t j = i;
+				while (j < edges.size() && edges[j] == edges[i])
+				{
+					j++;
+				}
+				if (j - i != 2)
+				{
+					locked[edges[i].first] = true;
+					locked[edges[i].second] = true;
+				}
+				i = j;
+			}
+		}
+
+		float maxCost = maxError * maxError;
+		struct Collapse
+		{
+			float cost;
+			uint32_t from;
+			uint32_t to;
+		};
+		while (triangles.size() > targetIndexCount)
+		{
+			std::vector<std::pair<uint32_t, uint32_t>> edges = collectEdges(triangles);
+			edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+			std::vector<Collapse> collapses;
+			collapses.reserve(edges.size());
+			for (const auto& edge : edges)
+			{
+				Quadric merged = quadrics[edge.first];
+				merged.add(quadrics[edge.second]);
+				Collapse collapse = { FLT_MAX, 0, 0 };
+				if (!locked[edge.first])
+				{
+					collapse.cost = merged.evaluate(positions[edge.second]);
+					collapse.from = edge.first;
+					collapse.to = edge.second;
+				}
+				if (!locked[edge.second] && merged.evaluate(positions[edge.first]) < collapse.cost)
+				{
+					collapse.cost = merged.evaluate(positions[edge.first]);
+					collapse.from = edge.second;
+					collapse.to = edge.first;
+				}
+				if (collapse.cost <= maxCost)
+				{
+					collapses.push_back(collapse);
+				}
+			}
+			std::sort(collapses.begin(), collapses.end(), [](const Collapse& a, const Collapse& b) { return a.cost < b.cost; });
+
+			// Triangles around every position, as a CSR list
+			std::vector<uint32_t> adjacencyOffset(positionCount + 1, 0);
+			for (uint32_t p : triangles)
+			{
+				adjacencyOffset[p + 1]++;
+			}
+			for (size_t p = 0; p < positionCount; p++)
+			{
+				adjacencyOffset[p + 1] += adjacencyOffset[p];
+			}
+			std::vector<uint32_t> adjacency(triangles.size());
+			{
+				std::vector<uint32_t> fill(adjacencyOffset.begin(), adjacencyOffset.end() - 1);
+				for (size_t i = 0; i < triangles.size(); i++)
+				{
+					adjacency[fill[triangles[i]]++] = static_cast<uint32_t>(i / 3);
+				}
+			}
+
+			// Collapses in one pass must not share triangles, so each one is
+			// checked against geometry that is still current
+			std::vector<uint32_t> remap(positionCount);
+			for (size_t p = 0; p < positionCount; p++)
+			{
+				remap[p] = static_cast<uint32_t>(p);
+			}
+			std::vector<bool> touched(positionCount, false);
+			size_t triangleCount = triangles.size() / 3;
+			size_t collapsed = 0;
+			for (const auto& collapse : collapses)
+			{
+				if (triangleCount * 3 <= targetIndexCount)
+				{
+					break;
+				}
+				if (touched[collapse.from] || touched[collapse.to] || flips(triangles, positions, adjacency,
+					adjacencyOffset[collapse.from], adjacencyOffset[collapse.from + 1], collapse.from, collapse.to))
+				{
+					continue;
+				}
+				for (uint32_t a = adjacencyOffset[collapse.from]; a < adjacencyOffset[collapse.from + 1]; a++)
+				{
+					const uint32_t* triangle = &triangles[adjacency[a] * 3];
+					if (triangle[0] == collapse.to || triangle[1] == collapse.to || triangle[2] == collapse.to)
+					{
+						triangleCount--;
+					}
+					for (int c = 0; c < 3; c++)
+					{
+						touched[triangle[c]] = true;
+					}
+				}
+				remap[collapse.from] = collapse.to;
+				quadrics[collapse.to].add(quadrics[collapse.from]);
+				error = std::max(error, std::sqrt(collapse.cost));
+				collapsed++;
+			}
+			if (collapsed == 0)
+			{
+				break;
+			}
+
+			size_t write = 0;
+			for (size_t t = 0; t < triangles.size(); t += 3)
+			{
+				uint32_t a = remap[triangles[t]], b = remap[triangles[t + 1]], c = remap[triangles[t + 2]];
+				if (a == b || b == c || a == c)
+				{
+					continue;
+				}
+				triangles[write] = a;
+				triangles[write + 1] = b;
+				triangles[write + 2] = c;
+				for (int k = 0; k < 3; k++)
+				{
+					corners[write + k] = corners[t + k];
+				}
+				write += 3;
+			}
+			triangles.resize(write);
+			corners.resize(write);
+		}
+
+		// Corners that moved take the closest matching vertex at their new position
+		std::vector<uint32_t> result(triangles.size());
+		for (size_t i = 0; i < triangles.size(); i++)
+		{
+			uint32_t original = corners[i];
+			uint32_t position = triangles[i];
+			if (positionOf[original] == position)
+			{
+				result[i] = original;
+				continue;
+			}
+			float bestDistance = FLT_MAX;
+			for (uint32_t w = wedgeOffset[position]; w < wedgeOffset[position + 1]; w++)
+			{
+				const VertexData& a = vertices[original];
+				const VertexData& b = vertices[wedges[w]];
+				glm::vec2 uv = glm::vec2(a.uv.x - b.uv.x, a.uv.y - b.uv.y);
+				float distance = 1.f - glm::dot(a.normal, b.normal) + uv.x * uv.x + uv.y * uv.y;
+				if (distance < bestDistance)
+				{
+					bestDistance = distance;
+					result[i] = wedges[w];
+				}
+			}
+		}
+		return result;
+	}
+
+	// Splits indices into meshlets of at most maxVertices unique vertices and
+	// maxTriangles triangles. Triangles are taken in order, so after
+	// OptimizeVertexCache the clusters are spatially compact and the index
+	// buffer does not have to be rewritten.
+	static std::vector<Meshlet> BuildMeshlets(const std::vector<uint32_t>& indices, size_t indexCount,
+		const std::vector<VertexData>& vertices, uint32_t maxVertices = 64, uint32_t maxTriangles = 124)
+	{
+		std::vector<Meshlet> meshlets;
+		std::vector<uint32_t> slot(vertices.size(), UINT32_MAX);
+		std::vector<uint32_t> unique;
+		uint32_t begin = 0;
+		for (uint32_t t = 0; t < indexCount; t += 3)
+		{
+			uint32_t added = 0;
+			for (int c = 0; c < 3; c++)
+			{
+				added += slot[indices[t + c]] == UINT32_MAX ? 1 : 0;
+			}
+			if (unique.size() + added > maxVertices || (t - begin) / 3 + 1 > maxTriangles)
+			{
+				meshlets.push_back(meshletBounds(indices, begin, t, vertices, unique));
+				for (uint32_t v : unique)
+				{
+					slot[v] = UINT32_MAX;
+				}
+				unique.clear();
+				begin = t;
+			}
+			for (int c = 0; c < 3; c++)
+			{
+				uint32_t v = indices[t + c];
+				if (slot[v] == UINT32_MAX)
+				{
+					slot[v] = static_cast<uint32_t>(unique.size());
+					unique.push_back(v);
+				}
+			}
+		}
+		if (begin < indexCount)
+		{
+			meshlets.push_back(meshletBounds(indices, begin, static_cast<uint32_t>(indexCount), vertices, unique));
+		}
+		return meshlets;
+	}
+
+private:
+	static Meshlet meshletBounds(const std::vector<uint32_t>& indices, uint32_t begin, uint32_t end,
+		const std::vector<VertexData>& vertices, const std::vector<uint32_t>& unique)
+	{
+		Meshlet meshlet = {};
+		meshlet.firstIndex = begin;
+		meshlet.indexCount = end - begin;
+
+		// Ritter's sphere: start from two far apart points, then grow
+		glm::vec3 first = vertices[unique[0]].position;
+		glm::vec3 a = first, b = first;
+		float farthest = -1.f;
+		for (uint32_t v : unique)
+		{
+			float distance = glm::length(vertices[v].position - first);
+			if (distance > farthest)
+			{
+				farthest = distance;
+				a = vertices[v].position;
+			}
+		}
+		farthest = -1.f;
+		for (uint32_t v : unique)
+		{
+			float distance = glm::length(vertices[v].position - a);
+			if (distance > farthest)
+			{
+				farthest = distance;
+				b = vertices[v].position;
+			}
+		}
+		glm::vec3 center = (a + b) * 0.5f;
+		float radius = glm::length(b - a) * 0.5f;
+		for (uint32_t v : unique)
+		{
+			float distance = glm::length(vertices[v].position - center);
+			if (distance > radius)
+			{
+				float grown = (radius + distance) * 0.5f;
+				center = center + (vertices[v].position - center) * ((grown - radius) / distance);
+				radius = grown;
+			}
+		}
+
+		// Normal cone around the average triangle normal
+		std::vector<glm::vec3> normals;
+		normals.reserve((end - begin) / 3);
+		glm::vec3 axis = glm::vec3(0.f);
+		for (uint32_t t = begin; t < end; t += 3)
+		{
+			const glm::vec3& p0 = vertices[indices[t]].position;
+			glm::vec3 normal = glm::cross(vertices[indices[t + 1]].position - p0, vertices[indices[t + 2]].position - p0);
+			float length = glm::length(normal);
+			if (length > 0.f)
+			{
+				normals.push_back(normal / length);
+				axis = axis + normals.back();
+			}
+		}
+		float axisLength = glm::length(axis);
+		float minDot = 1.f;
+		if (axisLength > 0.f)
+		{
+			axis = axis / axisLength;
+			for (const auto& normal : normals)
+			{
+				minDot = std::min(minDot, glm::dot(axis, normal));
+			}
+		}
+		else
+		{
+			minDot = -1.f;
+		}
+
+		for (int i = 0; i < 3; i++)
+		{
+			meshlet.center[i] = center[i];
+			meshlet.coneAxis[i] = axis[i];
+		}
+		meshlet.radius = radius;
+		meshlet.coneCutoff = minDot <= 0.f ? 1.f : std::sqrt(1.f - minDot * minDot);
+		return meshlet;
+	}
+
+	// Symmetric 4x4 matrix of a sum of squared plane distances
+	struct Quadric
+	{
+		double a2, ab, ac, ad, b2, bc, bd, c2, cd, d2;
+
+		Quadric() : a2(0), ab(0), ac(0), ad(0), b2(0), bc(0), bd(0), c2(0), cd(0), d2(0) {}
+
+		Quadric(const glm::vec3& normal, float distance)
+		{
+			double a = normal.x, b = normal.y, c = normal.z, d = distance;
+			a2 = a * a; ab = a * b; ac = a * c; ad = a * d;
+			b2 = b * b; bc = b * c; bd = b * d;
+			c2 = c * c; cd = c * d;
+			d2 = d * d;
+		}
+
+		void add(const Quadric& other)
+		{
+			a2 += other.a2; ab += other.ab; ac += other.ac; ad += other.ad;
+			b2 += other.b2; bc += other.bc; bd += other.bd;
+			c2 += other.c2; cd += other.cd;
+			d2 += other.d2;
+		}
+
+		float evaluate(const glm::vec3& p) const
+		{
+			double x = p.x, y = p.y, z = p.z;
+			double result = a2 * x * x + 2 * ab * x * y + 2 * ac * x * z + 2 * ad * x
+				+ b2 * y * y + 2 * bc * y * z + 2 * bd * y
+				+ c2 * z * z + 2 * cd * z + d2;
+			return static_cast<float>(std::max(result, 0.0));
+		}
+	};
+
+	// Sorted (low, high) position pairs of every triangle edge, one per use
+	static std::vector<std::pair<uint32_t, uint32_t>> collectEdges(const std::vector<uint32_t>& triangles)
+	{
+		std::vector<std::pair<uint32_t, uint32_t>> edges;
+		edges.reserve(triangles.size());
+		for (size_t t = 0; t < triangles.size(); t += 3)
+		{
+			for (int c = 0; c < 3; c++)
+			{
+				uint32_t a = triangles[t + c], b = triangles[t + (c + 1) % 3];
+				edges.push_back(a < b ? std::make_pair(a, b) : std::make_pair(b, a));
+			}
+		}
+		std::sort(edges.begin(), edges.end());
+		return edges;
+	}
+
+	// True when moving from onto to turns any surviving triangle around
+	static bool flips(const std::vector<uint32_t>& triangles, const std::vector<glm::vec3>& positions,
+		const std::vector<uint32_t>& adjacency, uint32_t begin, uint32_t end, uint32_t from, uint32_t to)
+	{
+		for (uint32_t a = begin; a < end; a++)
+		{
+			const uint32_t* triangle = &triangles[adjacency[a] * 3];
+			if (triangle[0] == to || triangle[1] == to || triangle[2] == to)
+			{
+				continue;
+			}
+			glm::vec3 before[3], after[3];
+			for (int c = 0; c < 3; c++)
+			{
+				before[c] = positions[triangle[c]];
+				after[c] = triangle[c] == from ? positions[to] : before[c];
+			}
+			glm::vec3 normalBefore = glm::cross(before[1] - before[0], before[2] - before[0]);
+			glm::vec3 normalAfter = glm::cross(after[1] - after[0], after[2] - after[0]);
+			if (glm::dot(normalBefore, normalAfter) <= 0.f)
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+
+	static float score(int cachePosition, uint32_t remaining)
+	{
+		if (remaining == 0)
+		{
+			return -1.f;
+		}
+		float result = 0.f;
+		if (cachePosition >= 0)
+		{
+			if (cachePosition < 3)
+			{
+				result = 0.75f;
+			}
+			else
+			{
+				float scaled = 1.f - static_cast<float>(cachePosition - 3) / static_cast<float>(cacheSize - 3);
+				result = std::pow(scaled, 1.5f);
+			}
+		}
+		return result + 2.f / std::sqrt(static_cast<float>(remaining));
+	}
+};
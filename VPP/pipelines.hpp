@@ -0,0 +1,196 @@
+#pragma once
+
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <vulkan/vulkan.hpp>
+
+#include "hash.hpp"
+#include "instance.hpp"
+#include "utility.hpp"
+
+// Shader modules and graphics pipelines shared by every shader of a Scene.
+// Modules are keyed by a hash of their SPIR-V and pipelines by a hash of
+// everything Instance::createPipeline is given, so asking twice for the
+// same description returns the objects created the first time. Lookups are
+// locked, creation is not, so background builds stay parallel.
+class PipelineRegistry
+{
+public:
+	vk::ShaderModule module(Instance& instance, const std::vector<uint32_t>& spirv)
+	{
+		uint64_t key = Hash::Bytes(spirv.data(), spirv.size() * sizeof(uint32_t));
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			moduleRequests++;
+			vk::ShaderModule found = findModule(key, spirv);
+			if (found)
+			{
+				return found;
+			}
+		}
+		vk::ShaderModule created = instance.createShaderModule(instance.device, spirv);
+		std::lock_guard<std::mutex> lock(mutex);
+		vk::ShaderModule found = findModule(key, spirv);
+		if (found)
+		{
+			// Another thread created the same module meanwhile
+			instance.device.destroyShaderModule(created);
+			return found;
+		}
+		modules.insert(std::make_pair(key, ModuleEntry{ spirv, created }));
+		modulesCreated++;
+		return created;
+	}
+
+	// cache follows Instance::createPipeline
+	vk::Pipeline pipeline(Instance& instance, const std::vector<uint32_t>& vertex, const std::vector<uint32_t>& fragment,
+		vk::PipelineLayout layout, uint32_t vertexStride, const std::vector<vk::VertexInputAttributeDescription>& attributes,
+		const PipelineState& state = PipelineState(), vk::PipelineCache cache = vk::PipelineCache())
+	{
+		vk::ShaderModule vertexModule = module(instance, vertex);
+		vk::ShaderModule fragmentModule = module(instance, fragment);
+		uint64_t key = Hash::Value(static_cast<VkShaderModule>(vertexModule));
+		key = Hash::Value(static_cast<VkShaderModule>(fragmentModule), key);
+		key = Hash::Value(static_cast<VkPipelineLayout>(layout), key);
+		key = Hash::Value(static_cast<VkRenderPass>(instance.renderPass), key);
+		key = Hash::Value(vertexStride, key);
+		for (const auto& attribute : attributes)
+		{
+			key = Hash::Value(attribute.location, key);
+			key = Hash::Value(attribute.binding, key);
+			key = Hash::Value(attribute.format, key);
+			key = Hash::Value(attribute.offset, key);
+		}
+		key = Hash::Combine(key, hashState(state));
+		PipelineEntry description = { vertexModule, fragmentModule, layout, instance.renderPass, vertexStride, attributes, state, vk::Pipeline() };
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			pipelineRequests++;
+			vk::Pipeline found = findPipeline(key, description);
+			if (found)
+			{
+				return found;
+			}
+		}
+		vk::Pipeline created = instance.createPipeline(instance.device, vertexModule, fragmentModule, layout,
+			vertexStride, attributes, state, cache);
+		std::lock_guard<std::mutex> lock(mutex);
+		vk::Pipeline found = findPipeline(key, description);
+		if (found)
+		{
+			instance.device.destroyPipeline(created);
+			return found;
+		}
+		description.pipeline = created;
+		pipelines.insert(std::make_pair(key, description));
+		pipelinesCreated++;
+		return created;
+	}
+
+	// Destroys every module and pipeline, for shutdown. The GPU must be done
+	// with them.
+	void clear(Instance& instance)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		for (auto& pipeline : pipelines)
+		{
+			instance.device.destroyPipeline(pipeline.second.pipeline);
+		}
+		for (auto& module : modules)
+		{
+			instance.device.destroyShaderModule(module.second.module);
+		}
+		pipelines.clear();
+		modules.clear();
+	}
+
+	std::string statistics()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		char text[128];
+		snprintf(text, sizeof(text), "%zu of %zu pipelines and %zu of %zu shader modules created",
+			pipelinesCreated, pipelineRequests, modulesCreated, moduleRequests);
+		return text;
+	}
+
+	size_t moduleRequests = 0;
+	size_t modulesCreated = 0;
+	size_t pipelineRequests = 0;
+	size_t pipelinesCreated = 0;
+
+private:
+	static uint64_t hashState(const PipelineState& state)
+	{
+		uint64_t hash = Hash::Value(state.topology);
+		hash = Hash::Value(state.polygonMode, hash);
+		hash = Hash::Value(static_cast<VkCullModeFlags>(state.cullMode), hash);
+		hash = Hash::Value(state.frontFace, hash);
+		hash = Hash::Value(state.depthTest, hash);
+		hash = Hash::Value(state.depthWrite, hash);
+		hash = Hash::Value(state.depthCompare, hash);
+		return Hash::Value(state.alphaBlend, hash);
+	}
+
+	// The SPIR-V is kept to tell apart code whose hashes collide
+	struct ModuleEntry
+	{
+		std::vector<uint32_t> spirv;
+		vk::ShaderModule module;
+	};
+
+	vk::ShaderModule findModule(uint64_t key, const std::vector<uint32_t>& spirv) const
+	{
+		auto candidates = modules.equal_range(key);
+		for (auto candidate = candidates.first; candidate != candidates.second; ++candidate)
+		{
+			if (candidate->second.spirv == spirv)
+			{
+				return candidate->second.module;
+			}
+		}
+		return vk::ShaderModule();
+	}
+
+	// The whole description, compared on a hash match like ModuleEntry
+	struct PipelineEntry
+	{
+		vk::ShaderModule vertex;
+		vk::ShaderModule fragment;
+		vk::PipelineLayout layout;
+		vk::RenderPass renderPass;
+		uint32_t vertexStride;
+		std::vector<vk::VertexInputAttributeDescription> attributes;
+		PipelineState state;
+		vk::Pipeline pipeline;
+
+		bool describes(const PipelineEntry& other) const
+		{
+			return vertex == other.vertex && fragment == other.fragment && layout == other.layout
+				&& renderPass == other.renderPass && vertexStride == other.vertexStride && attributes == other.attributes
+				&& state.topology == other.state.topology && state.polygonMode == other.state.polygonMode
+				&& state.cullMode == other.state.cullMode && state.frontFace == other.state.frontFace
+				&& state.depthTest == other.state.depthTest && state.depthWrite == other.state.depthWrite
+				&& state.depthCompare == other.state.depthCompare && state.alphaBlend == other.state.alphaBlend;
+		}
+	};
+
+	vk::Pipeline findPipeline(uint64_t key, const PipelineEntry& description) const
+	{
+		auto candidates = pipelines.equal_range(key);
+		for (auto candidate = candidates.first; candidate != candidates.second; ++candidate)
+		{
+			if (candidate->second.describes(description))
+			{
+				return candidate->second.pipeline;
+			}
+		}
+		return vk::Pipeline();
+	}
+
+	std::mutex mutex;
+	std::multimap<uint64_t, ModuleEntry> modules;
+	std::multimap<uint64_t, PipelineEntry> pipelines;
+};
@@ -0,0 +1,216 @@
+#pragma once
+
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vulkan/vulkan.hpp>
+
+#include "hash.hpp"
+#include "instance.hpp"
+#include "texture.hpp"
+#include "utility.hpp"
+
+// Images and samplers shared between Drawables. Images are keyed by format,
+// tiling and Texture::contentHash(), samplers by a hash of their create info,
+// so identical resources are created once and reference counted. A hash
+// match is only shared after the texels or create info compare equal.
+class ResourceCache
+{
+public:
+	// Returns an image, view and sampler for texture in format, creating
+	// whichever of them is not resident yet. Every acquire needs a release.
+	ImageMemory acquire(Instance& instance, const Texture& texture, vk::Format format, bool linear, float maxAnisotropy)
+	{
+		uint32_t levels = linear ? 1 : texture.mipLevels();
+		uint64_t bytes = linear ? texture.mips[0].size : texture.byteSize();
+		uint64_t key = Hash::Value(format);
+		key = Hash::Value(linear, key);
+		key = Hash::Combine(key, texture.contentHash());
+
+		imageRequests++;
+		auto image = images.end();
+		auto candidates = images.equal_range(key);
+		for (auto candidate = candidates.first; candidate != candidates.second; ++candidate)
+		{
+			const ImageEntry& entry = candidate->second;
+			if (entry.format == format && entry.linear == linear && !entry.source.empty() && entry.source.sameContents(texture))
+			{
+				image = candidate;
+				break;
+			}
+		}
+		if (image == images.end())
+		{
+			ImageEntry entry = ImageEntry();
+			entry.source = texture;
+			entry.format = format;
+			entry.linear = linear;
+			if (linear)
+			{
+				instance.createLinearImage(instance.device, entry.image, format, texture.data(), texture.mips[0]);
+			}
+			else
+			{
+				instance.createSampledImage(instance.device, entry.image, format, texture.data(), texture.mips);
+			}
+			entry.bytes = bytes;
+			imagesCreated++;
+			bytesUploaded += bytes;
+			image = images.insert(std::make_pair(key, entry));
+		}
+		else
+		{
+			bytesSaved += bytes;
+		}
+		image->second.references++;
+
+		vk::SamplerCreateInfo samplerInfo = instance.samplerInfo(levels, maxAnisotropy);
+		uint64_t samplerKey = hashSampler(samplerInfo);
+		samplerRequests++;
+		auto sampler = samplers.end();
+		auto samplerCandidates = samplers.equal_range(samplerKey);
+		for (auto candidate = samplerCandidates.first; candidate != samplerCandidates.second; ++candidate)
+		{
+			if (candidate->second.info == samplerInfo)
+			{
+				sampler = candidate;
+				break;
+			}
+		}
+		if (sampler == samplers.end())
+		{
+			SamplerEntry entry = SamplerEntry();
+			entry.info = samplerInfo;
+			entry.sampler = instance.createSampler(instance.device, samplerInfo);
+			samplersCreated++;
+			sampler = samplers.insert(std::make_pair(samplerKey, entry));
+		}
+		sampler->second.references++;
+
+		ImageMemory result = image->second.image;
+		result.sampler = sampler->second.sampler;
+		return result;
+	}
+
+	// Drops one reference to the image and sampler and destroys them once
+	// nothing uses them any more. The GPU must be done with them.
+	void release(Instance& instance, ImageMemory& imageMemory)
+	{
+		for (auto image = images.begin(); image != images.end(); ++image)
+		{
+			if (image->second.image.image == imageMemory.image && --image->second.references == 0)
+			{
+				destroyImage(instance, image->second.image);
+				images.erase(image);
+				break;
+			}
+		}
+		for (auto sampler = samplers.begin(); sampler != samplers.end(); ++sampler)
+		{
+			if (sampler->second.sampler == imageMemory.sampler && --sampler->second.references == 0)
+			{
+				instance.device.destroySampler(sampler->second.sampler);
+				samplers.erase(sampler);
+				break;
+			}
+		}
+		imageMemory = ImageMemory();
+	}
+
+	// Frees the copies of decoded textures kept to confirm hash matches,
+	// once a batch of objects has acquired its images. Textures mapped from
+	// .vtex only hold a reference to the mapping and stay comparable; the
+	// others are no longer shared with later acquires.
+	void dropSources()
+	{
+		for (auto& image : images)
+		{
+			if (!image.second.source.pixels.empty())
+			{
+				image.second.source = Texture();
+			}
+		}
+	}
+
+	// Destroys everything regardless of references, for shutdown
+	void clear(Instance& instance)
+	{
+		for (auto& image : images)
+		{
+			destroyImage(instance, image.second.image);
+		}
+		for (auto& sampler : samplers)
+		{
+			instance.device.destroySampler(sampler.second.sampler);
+		}
+		images.clear();
+		samplers.clear();
+	}
+
+	std::string statistics() const
+	{
+		char text[192];
+		snprintf(text, sizeof(text), "%zu of %zu images and %zu of %zu samplers created, %llu KB uploaded, %llu KB saved by sharing",
+			imagesCreated, imageRequests, samplersCreated, samplerRequests,
+			static_cast<unsigned long long>(bytesUploaded >> 10), static_cast<unsigned long long>(bytesSaved >> 10));
+		return text;
+	}
+
+	size_t imageRequests = 0;
+	size_t imagesCreated = 0;
+	size_t samplerRequests = 0;
+	size_t samplersCreated = 0;
+	uint64_t bytesUploaded = 0;
+	uint64_t bytesSaved = 0;
+
+private:
+	struct ImageEntry
+	{
+		ImageMemory image;
+		// What the image was created from, to tell apart textures whose
+		// hashes collide, until dropSources. Textures loaded from .vtex share
+		// the mapping.
+		Texture source;
+		vk::Format format;
+		bool linear;
+		uint64_t bytes;
+		uint32_t references;
+	};
+
+	struct SamplerEntry
+	{
+		vk::SamplerCreateInfo info;
+		vk::Sampler sampler;
+		uint32_t references;
+	};
+
+	static uint64_t hashSampler(const vk::SamplerCreateInfo& info)
+	{
+		uint64_t hash = Hash::Value(info.flags);
+		hash = Hash::Value(info.magFilter, hash);
+		hash = Hash::Value(info.minFilter, hash);
+		hash = Hash::Value(info.mipmapMode, hash);
+		hash = Hash::Value(info.addressModeU, hash);
+		hash = Hash::Value(info.addressModeV, hash);
+		hash = Hash::Value(info.addressModeW, hash);
+		hash = Hash::Value(info.mipLodBias, hash);
+		hash = Hash::Value(info.anisotropyEnable, hash);
+		hash = Hash::Value(info.maxAnisotropy, hash);
+		hash = Hash::Value(info.compareEnable, hash);
+		hash = Hash::Value(info.compareOp, hash);
+		hash = Hash::Value(info.minLod, hash);
+		hash = Hash::Value(info.maxLod, hash);
+		hash = Hash::Value(info.borderColor, hash);
+		return Hash::Value(info.unnormalizedCoordinates, hash);
+	}
+
+	static void destroyImage(Instance& instance, ImageMemory& image)
+	{
+		instance.device.destroyImageView(image.view);
+		instance.device.destroyImage(image.image);
+		instance.device.freeMemory(image.memory);
+	}
+
+	std::multimap<uint64_t, ImageEntry> images;
+	std::multimap<uint64_t, SamplerEntry> samplers;
+};
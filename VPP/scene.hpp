@@ -6,11 +6,19 @@
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_vulkan.h>
 #include <string>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <future>
 #include <map>
 #include <vector>
 
 #include "instance.hpp"
+#include "atlas.hpp"
 #include "object.hpp"
+#include "pipelines.hpp"
+#include "resources.hpp"
 #include "shader.hpp"
 
 class Scene
@@ -20,6 +28,35 @@ public:
 	const uint32_t height = 600;
 	const float fps = 60.f;
 	bool enableSkybox = false;
+	// A coarser LOD is used once its error projects to less than
+	// lodPixelError * lodHysteresis pixels, and given up again once it
+	// exceeds lodPixelError. The gap between the two keeps LODs from popping
+	// back and forth at a fixed distance.
+	float lodPixelError = 1.f;
+	float lodHysteresis = 0.5f;
+	// Full-detail objects are drawn meshlet by meshlet, skipping those that
+	// are outside the frustum or face away from the camera
+	bool enableClusterCulling = true;
+	size_t clustersDrawn = 0;
+	size_t clustersTotal = 0;
+	// The projection is GL's (y up) and the viewport does not flip it, so
+	// Vulkan sees every triangle mirrored and, with eCounterClockwise front
+	// faces, keeps those whose OBJ normal points away from the camera.
+	// Cone culling has to agree with the rasterizer.
+	const float frontFaceSign = -1.f;
+	// Upper bound for anisotropic texture filtering, clamped to the device
+	// limit; 1 leaves plain trilinear filtering
+	float maxAnisotropy = 8.f;
+	// Upload textures as linearly tiled HOST_VISIBLE images (top level only)
+	// instead of optimally tiled DEVICE_LOCAL ones, to compare sampling cost
+	bool linearTextures = false;
+	// Set when the device supports descriptor indexing. All textures then
+	// live in one array bound as set 1 and shaders get BINDLESS_TEXTURES.
+	bool bindlessTextures = false;
+	const uint32_t bindlessCapacity = 4096;
+	// Pack textures of at most TextureAtlas::maxTextureSize into shared pages
+	bool atlasTextures = true;
+	TextureAtlas atlas;
 
 	struct Environment
 	{
@@ -44,8 +81,18 @@ public:
 		glm::float32_t far;
 	} camera;
 
+	// Set 0 of every object; the shaders declare the same block
+	struct Transforms
+	{
+		glm::mat4 model;
+		glm::mat4 view;
+		glm::mat4 perpective;
+		Mesh::Dequantization dequantization;
+	};
+
 	vk::Pipeline defaultPipeline;
 	vk::Pipeline currentPipeline;
+	std::string currentShader;
 	Texture defaultImage;
 	vk::PipelineLayout pipelineLayout;
 	std::vector<vk::DescriptorSetLayout> descriptorSetLayouts;
@@ -53,6 +100,28 @@ public:
 
 	std::map<std::string, std::shared_ptr<Drawable>> objects;
 	std::map<std::string, vk::Pipeline> pipelines;
+	// Added with AddShader and not compiled yet
+	std::vector<std::string> pendingShaders;
+	// Pipelines being created on the thread pool, keyed like pipelines
+	struct PendingPipeline
+	{
+		std::string key;
+		vk::PipelineCache cache;
+		std::future<vk::Pipeline> pipeline;
+	};
+	std::vector<PendingPipeline> pendingPipelines;
+	std::chrono::steady_clock::time_point pipelineBuildStart;
+	size_t pipelinesBuilt = 0;
+	std::map<std::string, MeshRange> meshRanges;
+	ResourceCache resources;
+	// Owns every pipeline and shader module; pipelines only names them
+	PipelineRegistry registry;
+	std::vector<std::vector<vk::CommandBuffer>> secondaryBuffers;
+	// Built by Draw. Each swapchain image records them again when it is next
+	// acquired, so a changed draw list never waits for the whole device.
+	std::vector<DrawItem> drawItems;
+	uint64_t drawVersion = 0;
+	std::vector<uint64_t> recordedVersions;
 
 	Instance instance;
 	SDL_Window* window;
@@ -106,25 +175,60 @@ public:
 		instance.initDepthBuffers();
 		instance.initRenderPass();
 		instance.initFrameBuffer();
+		instance.initGeometryPool(64u << 20, 32u << 20);
+		instance.initStagingRing(16u << 20);
+		instance.initPipelineCache("pipeline.cache");
 
-		Shader defaultShader = Shader().Load("default");
-		defaultImage = Texture("default.bmp");
-		auto vertex = instance.createShaderModule(instance.device, defaultShader.vertex);
-		auto fragment = instance.createShaderModule(instance.device, defaultShader.fragment);
+		bindlessTextures = instance.initBindless(bindlessCapacity);
+		Shader defaultShader = Shader().Load("default", shaderDefines(VertexFormat::Standard));
+		defaultImage = Texture::Load("default");
 		
 		auto descriptorSets = instance.createDescriptorSets(instance.device, pipelineLayout, descriptorSetLayouts, 4, 
 			vk::DescriptorType::eUniformBuffer, vk::ShaderStageFlagBits::eVertex,
 			vk::DescriptorType::eCombinedImageSampler, vk::ShaderStageFlagBits::eFragment, 
 			vk::DescriptorType::eUniformBuffer, vk::ShaderStageFlagBits::eVertex, 
 			vk::DescriptorType::eUniformBuffer, vk::ShaderStageFlagBits::eVertex);
-		defaultPipeline = instance.createPipeline(instance.device, vertex, fragment, pipelineLayout);
+		if (bindlessTextures)
+		{
+			instance.createBindlessPipelineLayout(instance.device, pipelineLayout, descriptorSetLayouts);
+		}
+		defaultPipeline = createPipeline(defaultShader, VertexFormat::Standard);
 		pipelines.insert(std::pair<std::string, vk::Pipeline>("default", defaultPipeline));
 		descriptorWrites = std::vector<vk::WriteDescriptorSet>(4);
 		currentPipeline = defaultPipeline;
+		currentShader = "default";
 	}
 
 	~Scene()
 	{
+		if (instance.device)
+		{
+			instance.device.waitIdle();
+			meshRanges.clear();
+			for (auto& item : objects)
+			{
+				if (item.second->sampledImage.image)
+				{
+					resources.release(instance, item.second->sampledImage);
+				}
+			}
+			resources.clear(instance);
+			for (auto& pending : pendingPipelines)
+			{
+				pipelines.insert(std::make_pair(pending.key, pending.pipeline.get()));
+				instance.mergePipelineCache(pending.cache);
+			}
+			pendingPipelines.clear();
+			instance.destroyPipelineCache();
+			Log::Info("pipelines", registry.statistics());
+			registry.clear(instance);
+			if (bindlessTextures)
+			{
+				instance.destroyBindless();
+			}
+			instance.destroyGeometryPool();
+			instance.destroyStagingRing();
+		}
 		SDL_DestroyWindow(window);
 		SDL_Quit();
 		objects.clear();
@@ -141,72 +245,528 @@ public:
 		enableSkybox = false;
 	}
 
+	// Only registers the shader. Everything registered is compiled as one
+	// batch by CompileShaders, which InitObjects runs before it needs any
+	// pipeline.
 	void AddShader(std::string shaderName)
 	{
-		Shader shader = Shader().Load(shaderName);
-		auto vertex = instance.createShaderModule(instance.device, shader.vertex);
-		auto fragment = instance.createShaderModule(instance.device, shader.fragment);
-
-		auto pipeline = instance.createPipeline(instance.device, vertex, fragment, pipelineLayout);
-		pipelines.insert(std::pair<std::string, vk::Pipeline>(shaderName, pipeline));
+		if (pipelines.find(shaderName) == pipelines.end() && !isPending(shaderName))
+		{
+			pendingShaders.push_back(shaderName);
+		}
 	}
 
 	void UseShader(std::string shaderName)
 	{
 		auto res = pipelines.find(shaderName);
-		if (res == pipelines.end())
+		if (res != pipelines.end())
 		{
+			currentPipeline = res->second;
+			currentShader = shaderName;
+		}
+		else if (isPending(shaderName))
+		{
+			// Resolved once CompileShaders has run
 			currentPipeline = defaultPipeline;
+			currentShader = shaderName;
 		}
 		else
 		{
-			currentPipeline = res->second;
+			currentPipeline = defaultPipeline;
+			currentShader = "default";
+		}
+	}
+
+	// Compiles the registered shaders and every other variant the objects
+	// need in a single batch on the thread pool. The default shader's
+	// pipelines are created right away since they stand in for the others,
+	// which are created in the background (see UpdatePipelines).
+	void CompileShaders()
+	{
+		std::vector<std::pair<std::string, VertexFormat>> needed;
+		for (const auto& name : pendingShaders)
+		{
+			needed.push_back(std::make_pair(name, VertexFormat::Standard));
+		}
+		for (const auto& item : objects)
+		{
+			const Drawable& obj = *item.second;
+			if (pipelines.find(PipelineKey(obj.shader, obj.vertexFormat)) == pipelines.end())
+			{
+				needed.push_back(std::make_pair(obj.shader, obj.vertexFormat));
+				needed.push_back(std::make_pair(std::string("default"), obj.vertexFormat));
+			}
+		}
+		std::sort(needed.begin(), needed.end());
+		needed.erase(std::unique(needed.begin(), needed.end()), needed.end());
+		needed.erase(std::remove_if(needed.begin(), needed.end(), [this](const std::pair<std::string, VertexFormat>& variant)
+		{
+			std::string key = PipelineKey(variant.first, variant.second);
+			return pipelines.find(key) != pipelines.end() || isBuilding(key);
+		}), needed.end());
+		pendingShaders.clear();
+		if (needed.empty())
+		{
+			return;
+		}
+
+		std::vector<std::pair<std::string, std::string>> variants;
+		for (const auto& variant : needed)
+		{
+			variants.push_back(std::make_pair(variant.first, shaderDefines(variant.second)));
+		}
+		auto start = std::chrono::steady_clock::now();
+		std::vector<Shader> shaders = Shader::LoadAll(variants);
+		std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+		char report[96];
+		snprintf(report, sizeof(report), "%zu stages compiled in %.1f ms", 2 * shaders.size(), elapsed.count());
+		Log::Info("shaders", report);
+
+		for (size_t i = 0; i < shaders.size(); i++)
+		{
+			if (needed[i].first == "default")
+			{
+				pipelines.insert(std::make_pair(PipelineKey(needed[i].first, needed[i].second), createPipeline(shaders[i], needed[i].second)));
+			}
+			else
+			{
+				buildPipeline(needed[i].first, needed[i].second, shaders[i]);
+			}
+		}
+	}
+
+	// Variants other than the standard one are kept under "<shader>#<variant>".
+	// Those CompileShaders missed are built in the background on first use.
+	// Until a pipeline is ready the default shader's in the same vertex
+	// format stands in for it.
+	vk::Pipeline getPipeline(const std::string& shaderName, VertexFormat format)
+	{
+		std::string key = PipelineKey(shaderName, format);
+		auto res = pipelines.find(key);
+		if (res != pipelines.end())
+		{
+			return res->second;
+		}
+		if (shaderName == "default")
+		{
+			auto pipeline = createPipeline(Shader().Load(shaderName, shaderDefines(format)), format);
+			pipelines.insert(std::make_pair(key, pipeline));
+			return pipeline;
+		}
+		if (format != VertexFormat::Standard && !isBuilding(key))
+		{
+			buildPipeline(shaderName, format, Shader());
+		}
+		return getPipeline("default", format);
+	}
+
+	// Creates the pipeline on the thread pool against a cache of its own,
+	// compiling the shader there too when it comes without SPIR-V
+	void buildPipeline(const std::string& shaderName, VertexFormat format, const Shader& shader)
+	{
+		if (pendingPipelines.empty())
+		{
+			pipelineBuildStart = std::chrono::steady_clock::now();
+			pipelinesBuilt = 0;
+		}
+		PendingPipeline pending;
+		pending.key = PipelineKey(shaderName, format);
+		pending.cache = instance.createWorkerPipelineCache();
+		vk::PipelineCache cache = pending.cache;
+		std::string preamble = shaderDefines(format);
+		pending.pipeline = ThreadPool::Shared().submit([this, shaderName, format, preamble, shader, cache]()
+		{
+			if (shader.vertex.empty())
+			{
+				return createPipeline(Shader().Load(shaderName, preamble), format, cache);
+			}
+			return createPipeline(shader, format, cache);
+		});
+		pendingPipelines.push_back(std::move(pending));
+	}
+
+	bool isBuilding(const std::string& key) const
+	{
+		return std::any_of(pendingPipelines.begin(), pendingPipelines.end(),
+			[&key](const PendingPipeline& pending) { return pending.key == key; });
+	}
+
+	// Takes over pipelines that finished building and moves their objects
+	// onto them, without waiting for the rest. Returns whether any object
+	// changed pipeline, in which case the command buffers need re-recording.
+	bool UpdatePipelines()
+	{
+		bool changed = false;
+		for (size_t i = 0; i < pendingPipelines.size();)
+		{
+			PendingPipeline& pending = pendingPipelines[i];
+			if (pending.pipeline.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+			{
+				i++;
+				continue;
+			}
+			vk::Pipeline pipeline = pending.pipeline.get();
+			instance.mergePipelineCache(pending.cache);
+			pipelines.insert(std::make_pair(pending.key, pipeline));
+			for (auto& item : objects)
+			{
+				Drawable& obj = *item.second;
+				if (obj.pipeline != pipeline && PipelineKey(obj.shader, obj.vertexFormat) == pending.key)
+				{
+					obj.pipeline = pipeline;
+					changed = true;
+				}
+			}
+			pendingPipelines.erase(pendingPipelines.begin() + i);
+			pipelinesBuilt++;
 		}
+		if (pipelinesBuilt > 0 && pendingPipelines.empty())
+		{
+			std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - pipelineBuildStart;
+			char report[96];
+			snprintf(report, sizeof(report), "%zu built in the background in %.1f ms with a %s cache", pipelinesBuilt,
+				elapsed.count(), instance.pipelineCacheWarm ? "warm" : "cold");
+			Log::Info("pipelines", report);
+			instance.savePipelineCache();
+			pipelinesBuilt = 0;
+		}
+		return changed;
+	}
+
+	bool isPending(const std::string& shaderName) const
+	{
+		return std::find(pendingShaders.begin(), pendingShaders.end(), shaderName) != pendingShaders.end();
+	}
+
+	static std::string PipelineKey(const std::string& shaderName, VertexFormat format)
+	{
+		return format == VertexFormat::Quantized ? shaderName + "#quantized" : shaderName;
+	}
+
+	// Through the registry, so an identical description (the same SPIR-V
+	// under another name, say) reuses the existing pipeline. Safe on any
+	// thread as long as cache is only used by that thread.
+	vk::Pipeline createPipeline(const Shader& shader, VertexFormat format, vk::PipelineCache cache = vk::PipelineCache())
+	{
+		return registry.pipeline(instance, shader.vertex, shader.fragment, pipelineLayout,
+			VertexFormats::Stride(format), VertexFormats::Describe(format), PipelineState(), cache);
+	}
+
+	// Preamble selecting the shader variant for format and the texture binding
+	std::string shaderDefines(VertexFormat format) const
+	{
+		return ShaderDefines(format, bindlessTextures);
+	}
+
+	static std::string ShaderDefines(VertexFormat format, bool bindless)
+	{
+		std::string defines;
+		if (format == VertexFormat::Quantized)
+		{
+			defines += "#define QUANTIZED_VERTEX\n";
+		}
+		if (bindless)
+		{
+			defines += "#define BINDLESS_TEXTURES\n";
+		}
+		return defines;
+	}
+
+	// Every preamble shaderDefines can return, for embedding shaders
+	static std::vector<std::string> ShaderVariants()
+	{
+		std::vector<std::string> variants;
+		for (VertexFormat format : { VertexFormat::Standard, VertexFormat::Quantized })
+		{
+			variants.push_back(ShaderDefines(format, false));
+			variants.push_back(ShaderDefines(format, true));
+		}
+		return variants;
 	}
 
 	void AddObject(Drawable* obj)
 	{
+		obj->shader = currentShader;
 		obj->pipeline = currentPipeline;
 		objects.insert(std::pair<std::string, Drawable*>(obj->name, obj));
 	}
 
+	// Packs the small textures of objects whose uvs stay inside [0, 1] into
+	// atlas pages. Tiled uvs need an image of their own to wrap.
+	void BuildAtlas()
+	{
+		const float slack = 1e-3f;
+		std::vector<Drawable*> candidates;
+		std::vector<const Texture*> textures;
+		for (auto& item : objects)
+		{
+			auto& obj = *item.second;
+			if (!TextureAtlas::Fits(obj.texture)
+				|| glm::any(glm::lessThan(obj.mesh.uvMin, glm::vec2(-slack)))
+				|| glm::any(glm::greaterThan(obj.mesh.uvMax, glm::vec2(1.f + slack))))
+			{
+				continue;
+			}
+			candidates.push_back(&obj);
+			textures.push_back(&obj.texture);
+		}
+		if (textures.size() < 2)
+		{
+			return;
+		}
+		atlas = TextureAtlas::Build(textures);
+		for (size_t i = 0; i < candidates.size(); i++)
+		{
+			const TextureAtlas::Placement& placement = atlas.placements[i];
+			if (placement.page != TextureAtlas::noPage)
+			{
+				candidates[i]->atlasPage = placement.page;
+				candidates[i]->uvTransform = placement.uvTransform;
+				candidates[i]->texture = Texture();
+			}
+		}
+		Log::Info("atlas", atlas.statistics());
+	}
+
 	void InitObjects()
 	{
+		CompileShaders();
+		// Textures have been decoding since the objects were created
+		for (auto& item : objects)
+		{
+			item.second->finishLoading();
+		}
+		Texture::ForgetLoads();
+		if (atlasTextures)
+		{
+			BuildAtlas();
+		}
 		for (auto& item : objects)
 		{
 			auto& obj = *item.second;
 
-			obj.descriptorSets = instance.createDescriptorSets(instance.device, pipelineLayout, descriptorSetLayouts, 4,
-				vk::DescriptorType::eUniformBuffer, vk::ShaderStageFlagBits::eVertex,
-				vk::DescriptorType::eCombinedImageSampler, vk::ShaderStageFlagBits::eFragment,
-				vk::DescriptorType::eUniformBuffer, vk::ShaderStageFlagBits::eVertex,
-				vk::DescriptorType::eUniformBuffer, vk::ShaderStageFlagBits::eVertex);
+			VertexFormat format = obj.vertexFormat;
+			obj.pipeline = getPipeline(obj.shader, format);
+
+			// Each source mesh is uploaded into the geometry pool once per vertex
+			// format and the range is reused by every Drawable and every re-record
+			std::string key = format == VertexFormat::Quantized ? obj.mesh.source + "#quantized" : obj.mesh.source;
+			auto resident = meshRanges.find(key);
+			if (resident == meshRanges.end())
+			{
+				const Mesh& mesh = obj.mesh;
+				MeshRange range = MeshRange();
+				if (!instance.allocateMesh(instance.device, static_cast<uint32_t>(mesh.vertexCount()),
+					VertexFormats::Stride(format), static_cast<uint32_t>(mesh.indexCount()),
+					[&mesh, format](void* dst) { mesh.writeVertices(dst, format); },
+					[&mesh](void* dst) { mesh.writeIndices(dst); },
+					range))
+				{
+					range = MeshRange();
+				}
+				else if (format == VertexFormat::Quantized)
+				{
+					Log::Info(obj.name.c_str(), mesh.quantizationReport());
+				}
+				resident = meshRanges.insert(std::make_pair(key, range)).first;
+			}
+			obj.meshRange = resident->second;
 
-			obj.sampledImage.sampler = instance.createSampler(instance.device);
-			if (obj.texture.pixels.size() == 0)
+			if (bindlessTextures)
 			{
-				instance.createSampledImage(instance.device, obj.sampledImage, vk::Format::eR32G32B32A32Sfloat,
-					defaultImage.width, defaultImage.height, defaultImage.pixels.data(), defaultImage.pixels.size() * sizeof(float));
+				// Only the uniform buffer sets are per object, set 1 is shared
+				obj.descriptorSets = instance.allocateDescriptorSets(instance.device,
+					{ descriptorSetLayouts[0], descriptorSetLayouts[2], descriptorSetLayouts[3] }, vk::DescriptorType::eUniformBuffer);
+				obj.descriptorSets.insert(obj.descriptorSets.begin() + 1, instance.bindless.set);
 			}
 			else
 			{
-				instance.createSampledImage(instance.device, obj.sampledImage, vk::Format::eR32G32B32A32Sfloat,
-					obj.texture.width, obj.texture.height, obj.texture.pixels.data(), obj.texture.pixels.size() * sizeof(float));
+				obj.descriptorSets = instance.createDescriptorSets(instance.device, pipelineLayout, descriptorSetLayouts, 4,
+					vk::DescriptorType::eUniformBuffer, vk::ShaderStageFlagBits::eVertex,
+					vk::DescriptorType::eCombinedImageSampler, vk::ShaderStageFlagBits::eFragment,
+					vk::DescriptorType::eUniformBuffer, vk::ShaderStageFlagBits::eVertex,
+					vk::DescriptorType::eUniformBuffer, vk::ShaderStageFlagBits::eVertex);
+			}
+
+			Texture& texture = obj.atlasPage != TextureAtlas::noPage ? atlas.pages[obj.atlasPage]
+				: obj.texture.empty() ? defaultImage : obj.texture;
+			vk::Format textureFormat = texture.format(instance.swapchainFormat);
+			vk::ImageTiling tiling = linearTextures ? vk::ImageTiling::eLinear : vk::ImageTiling::eOptimal;
+			if (texture.compression != TextureCompression::None && !instance.supportsSampledImage(textureFormat, tiling))
+			{
+				Log::Info(obj.name.c_str(), "block compressed textures are not supported, decompressing");
+				texture.decompress();
+				textureFormat = texture.format(instance.swapchainFormat);
 			}
-			instance.setImageLayout(obj.sampledImage.image, vk::ImageAspectFlagBits::eColor, vk::ImageLayout::ePreinitialized,
-				vk::ImageLayout::eShaderReadOnlyOptimal, vk::AccessFlagBits(), vk::PipelineStageFlagBits::eTopOfPipe,
-				vk::PipelineStageFlagBits::eFragmentShader);
-			instance.createUniformBuffer(instance.device, obj.mvpMemoryBuffer, nullptr, sizeof(glm::mat4) * 3);
+			// Identical images (every untextured object shares defaultImage) and
+			// samplers are created once
+			obj.sampledImage = resources.acquire(instance, texture, textureFormat, linearTextures, maxAnisotropy);
+			instance.createUniformBuffer(instance.device, obj.mvpMemoryBuffer, nullptr, sizeof(Transforms));
 			instance.createUniformBuffer(instance.device, obj.lightMemoryBuffer, nullptr, sizeof(directional));
 			instance.createUniformBuffer(instance.device, obj.cameraMemoryBuffer, nullptr, sizeof(camera));
 
-			instance.pushDescriptor(instance.device, descriptorWrites, 0, obj.descriptorSets[0], obj.mvpMemoryBuffer.buffer, sizeof(glm::mat4) * 3);
-			instance.pushDescriptor(instance.device, descriptorWrites, 1, obj.descriptorSets[1], obj.sampledImage.sampler, obj.sampledImage.view);
+			instance.pushDescriptor(instance.device, descriptorWrites, 0, obj.descriptorSets[0], obj.mvpMemoryBuffer.buffer, sizeof(Transforms));
+			if (bindlessTextures)
+			{
+				if (instance.registerBindless(obj.sampledImage, obj.textureIndex))
+				{
+					ImageMemory& slot = instance.bindless.images[obj.textureIndex];
+					instance.pushDescriptor(instance.device, descriptorWrites, 1, obj.descriptorSets[1], slot.sampler, slot.view, obj.textureIndex);
+				}
+				else
+				{
+					// The shared array is full, this object binds a set of its own
+					Log::Info(obj.name.c_str(), "bindless texture array is full, using a separate set");
+					obj.descriptorSets[1] = instance.allocateBindlessSet();
+					obj.textureIndex = 0;
+					instance.pushDescriptor(instance.device, descriptorWrites, 1, obj.descriptorSets[1], obj.sampledImage.sampler, obj.sampledImage.view);
+				}
+			}
+			else
+			{
+				instance.pushDescriptor(instance.device, descriptorWrites, 1, obj.descriptorSets[1], obj.sampledImage.sampler, obj.sampledImage.view);
+			}
 			instance.pushDescriptor(instance.device, descriptorWrites, 2, obj.descriptorSets[2], obj.lightMemoryBuffer.buffer, sizeof(directional));
 			instance.pushDescriptor(instance.device, descriptorWrites, 3, obj.descriptorSets[3], obj.cameraMemoryBuffer.buffer, sizeof(camera));
 			instance.writeDescriptor(instance.device, descriptorWrites);
 		}
+		resources.dropSources();
+		Log::Info("textures", resources.statistics());
+	}
+
+	// Picks the LOD of every object from the screen-space size of its
+	// simplification error. Returns true when any selection changed, in
+	// which case the command buffers have to be recorded again.
+	bool UpdateLods()
+	{
+		// Pixels covered by one unit at distance one
+		float pixelsPerUnit = getPerpectiveMatrix()[1][1] * 0.5f * static_cast<float>(height);
+		bool changed = false;
+		for (auto& item : objects)
+		{
+			auto& obj = *item.second;
+			const auto& lods = obj.mesh.lods;
+			if (lods.size() < 2)
+			{
+				continue;
+			}
+			glm::vec3 worldCenter;
+			float radius;
+			obj.transform.getWorldSphere(obj.mesh.sphereCenter, obj.mesh.sphereRadius, worldCenter, radius);
+			float maxScale = obj.transform.getMaxScale();
+			float distance = glm::length(worldCenter - camera.position) - radius;
+
+			uint32_t lod = obj.lod < lods.size() ? obj.lod : 0;
+			if (distance <= camera.near)
+			{
+				lod = 0;
+			}
+			else
+			{
+				float pixels = pixelsPerUnit * maxScale / distance;
+				while (lod > 0 && lods[lod].error * pixels > lodPixelError)
+				{
+					lod--;
+				}
+				while (lod + 1 < lods.size() && lods[lod + 1].error * pixels < lodPixelError * lodHysteresis)
+				{
+					lod++;
+				}
+			}
+			if (lod != obj.lod)
+			{
+				obj.lod = lod;
+				changed = true;
+			}
+		}
+		return changed;
+	}
+
+	// Culls the meshlets of every full-detail object against the view
+	// frustum and their normal cones. Returns true when any visible set
+	// changed, in which case the draw list has to be built again.
+	bool UpdateClusters()
+	{
+		glm::mat4 viewProjection = getPerpectiveMatrix() * getViewMatrix();
+		glm::vec4 rows[4];
+		for (int i = 0; i < 4; i++)
+		{
+			rows[i] = glm::vec4(viewProjection[0][i], viewProjection[1][i], viewProjection[2][i], viewProjection[3][i]);
+		}
+		glm::vec4 planes[6] = { rows[3] + rows[0], rows[3] - rows[0], rows[3] + rows[1], rows[3] - rows[1], rows[3] + rows[2], rows[3] - rows[2] };
+		for (auto& plane : planes)
+		{
+			plane = plane / glm::length(glm::vec3(plane));
+		}
 
+		bool changed = false;
+		clustersDrawn = 0;
+		clustersTotal = 0;
+		for (auto& item : objects)
+		{
+			auto& obj = *item.second;
+			const auto& meshlets = obj.mesh.meshlets;
+			if (!enableClusterCulling || obj.lod != 0 || meshlets.empty())
+			{
+				if (!obj.visibleMeshlets.empty())
+				{
+					obj.visibleMeshlets.clear();
+					changed = true;
+				}
+				continue;
+			}
+
+			glm::mat4 model = obj.transform.getModelMatrix();
+			glm::vec3 scale = glm::abs(obj.transform.scale);
+			float maxScale = obj.transform.getMaxScale();
+			// Non-uniform scale distorts the normal cones
+			bool cullCones = scale.x == scale.y && scale.y == scale.z;
+			std::vector<bool> visible(meshlets.size());
+			// Objects entirely outside the frustum skip the per-meshlet tests
+			glm::vec3 worldMin, worldMax;
+			Transform::TransformBounds(model, obj.mesh.boundsMin, obj.mesh.boundsMax, worldMin, worldMax);
+			bool objectInside = true;
+			for (const auto& plane : planes)
+			{
+				glm::vec3 farthest = glm::vec3(plane.x >= 0.f ? worldMax.x : worldMin.x,
+					plane.y >= 0.f ? worldMax.y : worldMin.y, plane.z >= 0.f ? worldMax.z : worldMin.z);
+				if (glm::dot(glm::vec3(plane), farthest) + plane.w < 0.f)
+				{
+					objectInside = false;
+					break;
+				}
+			}
+			for (size_t i = 0; objectInside && i < meshlets.size(); i++)
+			{
+				const Meshlet& meshlet = meshlets[i];
+				glm::vec3 center = glm::vec3(model * glm::vec4(meshlet.center[0], meshlet.center[1], meshlet.center[2], 1.f));
+				float radius = meshlet.radius * maxScale;
+				bool inside = true;
+				for (const auto& plane : planes)
+				{
+					if (glm::dot(glm::vec3(plane), center) + plane.w < -radius)
+					{
+						inside = false;
+						break;
+					}
+				}
+				if (inside && cullCones && meshlet.coneCutoff < 1.f)
+				{
+					glm::vec3 axis = glm::normalize(glm::vec3(model * glm::vec4(meshlet.coneAxis[0], meshlet.coneAxis[1], meshlet.coneAxis[2], 0.f)));
+					glm::vec3 toCenter = center - camera.position;
+					inside = glm::dot(toCenter, axis * frontFaceSign) < meshlet.coneCutoff * glm::length(toCenter) + radius;
+				}
+				visible[i] = inside;
+				clustersDrawn += inside ? 1 : 0;
+			}
+			clustersTotal += meshlets.size();
+			if (visible != obj.visibleMeshlets)
+			{
+				obj.visibleMeshlets.swap(visible);
+				changed = true;
+			}
+		}
+		return changed;
 	}
 
 	void Draw()
@@ -217,22 +777,96 @@ public:
 			instance.Prepared();
 		}
 
-		for (uint32_t i = 0; i < instance.swapchainImageCount; i++)
+		// Sorted so pipelines and index types change as rarely as possible
+		drawItems.clear();
+		size_t fullTriangles = 0;
+		size_t drawnTriangles = 0;
+		for (auto& item : objects)
 		{
-			instance.currentBuffer = i;
-			auto cmd = instance.getCurrentCommandBuffer();
-			std::vector<vk::CommandBuffer> secondarys = std::vector<vk::CommandBuffer>();
-			instance.BeginCommandBuffer(cmd);
-			for (auto& item : objects)
+			auto& obj = *item.second;
+			DrawItem drawItem;
+			drawItem.pipeline = obj.pipeline;
+			drawItem.descriptorSets = &obj.descriptorSets;
+			drawItem.textureIndex = obj.textureIndex;
+			drawItem.mesh = obj.meshRange;
+			const auto& lods = obj.mesh.lods;
+			const auto& meshlets = obj.mesh.meshlets;
+			if (drawItem.mesh.indexCount > 0 && obj.lod < lods.size())
 			{
-				auto obj = *item.second;
-				auto vertexBuffer = instance.createVertexBuffer(instance.device, obj.mesh.wrapData());
-				auto sec = instance.DrawCommandBuffer(instance.device, cmd, obj.pipeline, pipelineLayout, obj.descriptorSets,
-					vertexBuffer.second, vertexBuffer.first);
-				secondarys.push_back(sec);
+				fullTriangles += lods[0].indexCount / 3;
+				drawItem.mesh.firstIndex += lods[obj.lod].firstIndex;
+				drawItem.mesh.indexCount = lods[obj.lod].indexCount;
 			}
-			instance.Draw(cmd, secondarys);
+			else
+			{
+				fullTriangles += drawItem.mesh.indexCount / 3;
+			}
+			if (drawItem.mesh.indexCount > 0 && !meshlets.empty() && obj.visibleMeshlets.size() == meshlets.size())
+			{
+				// One sub-draw per run of consecutive visible meshlets
+				for (size_t i = 0; i < meshlets.size();)
+				{
+					if (!obj.visibleMeshlets[i])
+					{
+						i++;
+						continue;
+					}
+					DrawItem run = drawItem;
+					run.mesh.firstIndex = obj.meshRange.firstIndex + meshlets[i].firstIndex;
+					run.mesh.indexCount = 0;
+					for (; i < meshlets.size() && obj.visibleMeshlets[i]; i++)
+					{
+						run.mesh.indexCount += meshlets[i].indexCount;
+					}
+					drawnTriangles += run.mesh.indexCount / 3;
+					drawItems.push_back(run);
+				}
+				continue;
+			}
+			drawnTriangles += drawItem.mesh.indexCount / 3;
+			drawItems.push_back(drawItem);
+		}
+		if (fullTriangles > drawnTriangles)
+		{
+			char text[160];
+			snprintf(text, sizeof(text), "%zu of %zu triangles (%.1f%%), %zu of %zu clusters", drawnTriangles, fullTriangles,
+				100.0 * drawnTriangles / fullTriangles, clustersDrawn, clustersTotal);
+			Log::Info("Draw", std::string(text));
 		}
+		std::stable_sort(drawItems.begin(), drawItems.end(), [](const DrawItem& a, const DrawItem& b)
+		{
+			if (a.pipeline != b.pipeline)
+			{
+				return a.pipeline < b.pipeline;
+			}
+			return a.mesh.indexType < b.mesh.indexType;
+		});
+		drawVersion++;
+	}
+
+	// Records the current draw list for the acquired swapchain image unless
+	// it already holds it. AcquireFrame has waited for the image's last
+	// submission, so only this image's command buffers are replaced.
+	void RecordFrame()
+	{
+		uint32_t image = instance.currentBuffer;
+		secondaryBuffers.resize(instance.swapchainImageCount);
+		recordedVersions.resize(instance.swapchainImageCount, 0);
+		if (recordedVersions[image] == drawVersion)
+		{
+			return;
+		}
+		auto cmd = instance.getCurrentCommandBuffer();
+		std::vector<vk::CommandBuffer>& secondarys = secondaryBuffers[image];
+		if (!secondarys.empty())
+		{
+			instance.device.freeCommandBuffers(instance.commandPool, static_cast<uint32_t>(secondarys.size()), secondarys.data());
+			secondarys.clear();
+		}
+		instance.BeginCommandBuffer(cmd);
+		secondarys.push_back(instance.DrawCommandBuffer(instance.device, cmd, pipelineLayout, drawItems, bindlessTextures));
+		instance.Draw(cmd, secondarys);
+		recordedVersions[image] = drawVersion;
 	}
 
 	void Present()
@@ -240,18 +874,25 @@ public:
 		for (const auto& item : objects)
 		{
 			auto obj = item.second;
-			glm::mat4 mvp[3];
-			mvp[0] = obj->transform.getModelMatrix();
-			mvp[1] = getViewMatrix();
-			mvp[2] = getPerpectiveMatrix();
+			Transforms mvp;
+			mvp.model = obj->transform.getModelMatrix();
+			mvp.view = getViewMatrix();
+			mvp.perpective = getPerpectiveMatrix();
+			mvp.dequantization = obj->mesh.dequantization(obj->vertexFormat);
+			// The atlas placement applies on top of the vertex format's own uv decoding
+			glm::vec4& uv = mvp.dequantization.uvTransform;
+			uv = glm::vec4(glm::vec2(obj->uvTransform) + glm::vec2(obj->uvTransform.z, obj->uvTransform.w) * glm::vec2(uv),
+				glm::vec2(obj->uvTransform.z, obj->uvTransform.w) * glm::vec2(uv.z, uv.w));
 
-			instance.CopyData(instance.device, obj->mvpMemoryBuffer.memory, mvp, sizeof(glm::mat4) * 3);
+			instance.CopyData(instance.device, obj->mvpMemoryBuffer.memory, &mvp, sizeof(mvp));
 
 			instance.CopyData(instance.device, obj->lightMemoryBuffer.memory, &directional, sizeof(directional));
 			instance.CopyData(instance.device, obj->cameraMemoryBuffer.memory, &camera, sizeof(camera));
 			
 		}
-		instance.Present(instance.device);
+		instance.AcquireFrame(instance.device);
+		RecordFrame();
+		instance.SubmitFrame(instance.device);
 	}
 
 	glm::mat4 getViewMatrix()
@@ -290,6 +931,8 @@ public:
 		}
 		float cameraAngle = 225.f;
 
+		UpdateLods();
+		UpdateClusters();
 		Draw();
 
 		uint32_t timePerFrame = (uint32_t)(1000 / fps);
@@ -400,9 +1043,22 @@ public:
 				}
 				//skybox.transform.position = camera.position;
 				///Render Begin
+				if (UpdateLods())
+				{
+					changed = true;
+				}
+				if (UpdateClusters())
+				{
+					changed = true;
+				}
+				if (UpdatePipelines())
+				{
+					changed = true;
+				}
 				if (changed)
 				{
 					Draw();
+					changed = false;
 				}
 
 				Present();
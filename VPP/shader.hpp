@@ -2,6 +2,9 @@
 
 #include <vulkan/vulkan.hpp>
 #include <glm/glm.hpp>
+#include <string>
+#include <utility>
+#include <vector>
 #include "utility.hpp"
 
 class Shader
@@ -13,14 +16,35 @@ public:
 
 	Shader() : name(), vertex(), fragment() {}
 
-	Shader& Load(const std::string name)
+	Shader& Load(const std::string name, const std::string& preamble = std::string())
 	{
+		std::vector<Shader> loaded = LoadAll({ std::make_pair(name, preamble) });
 		this->name = name;
-		vertex = ShaderUtil::Create((name + ".vert").c_str(), vk::ShaderStageFlagBits::eVertex);
-		fragment = ShaderUtil::Create((name + ".frag").c_str(), vk::ShaderStageFlagBits::eFragment);
+		vertex.swap(loaded[0].vertex);
+		fragment.swap(loaded[0].fragment);
 		return *this;
 	}
 
+	// Loads each (name, preamble) with all stages compiled as one batch
+	static std::vector<Shader> LoadAll(const std::vector<std::pair<std::string, std::string>>& variants)
+	{
+		std::vector<ShaderUtil::Request> requests;
+		for (const auto& variant : variants)
+		{
+			requests.push_back(ShaderUtil::Request{ variant.first + ".vert", vk::ShaderStageFlagBits::eVertex, variant.second });
+			requests.push_back(ShaderUtil::Request{ variant.first + ".frag", vk::ShaderStageFlagBits::eFragment, variant.second });
+		}
+		std::vector<std::vector<uint32_t>> spirv = ShaderUtil::CreateBatch(requests);
+		std::vector<Shader> shaders(variants.size());
+		for (size_t i = 0; i < variants.size(); i++)
+		{
+			shaders[i].name = variants[i].first;
+			shaders[i].vertex.swap(spirv[2 * i]);
+			shaders[i].fragment.swap(spirv[2 * i + 1]);
+		}
+		return shaders;
+	}
+
 	~Shader()
 	{
 		name.clear();
@@ -0,0 +1,8 @@
+#pragma once
+
+// SSE2 is part of x86-64, so MSVC x64 builds always get it; 32-bit builds
+// need /arch:SSE2. Everything using it keeps a scalar path.
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define VPP_SSE2 1
+#include <emmintrin.h>
+#endif
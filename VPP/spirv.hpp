@@ -0,0 +1,227 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#endif
+
+#include "hash.hpp"
+#include "mapping.hpp"
+
+// Precompiled SPIR-V of one shader variant, as written by
+// SpirvCache::WriteHeader for VPP_EMBEDDED_SHADERS builds
+struct EmbeddedShader
+{
+	const char* file;
+	const char* preamble;
+	const uint32_t* words;
+	size_t count;
+};
+
+#ifdef VPP_EMBEDDED_SHADERS
+#include "embedded_shaders.hpp"
+#endif
+
+// Compiled SPIR-V on disk, one file per variant under Directory(). Files
+// are named after a hash of the GLSL source, the preamble, the stage and
+// the compiler options, so editing any of them simply misses the cache.
+// Each file also keeps those inputs, and a hit only counts when they are
+// the same, so two variants whose keys collide never share code.
+class SpirvCache
+{
+public:
+	static const uint32_t spirvMagic = 0x07230203;
+
+	// Bump when the cache file layout changes
+	static const uint32_t cacheVersion = 2;
+
+	static const char* Directory()
+	{
+		return "shadercache";
+	}
+
+	static uint64_t Key(const std::vector<char>& source, const std::string& preamble, uint32_t stage, uint64_t options)
+	{
+		uint64_t key = Hash::Bytes(source.data(), source.size());
+		key = Hash::Bytes(preamble.data(), preamble.size(), key);
+		key = Hash::Value(stage, key);
+		return Hash::Value(options, key);
+	}
+
+	// The arguments after key are the ones it was made from
+	static bool Load(uint64_t key, const std::vector<char>& source, const std::string& preamble, uint32_t stage, uint64_t options,
+		std::vector<uint32_t>& spirv)
+	{
+		MappedFile file;
+		if (!file.open(path(key).c_str()) || file.size < sizeof(FileHeader))
+		{
+			return false;
+		}
+		FileHeader header;
+		memcpy(&header, file.data, sizeof(header));
+		uint64_t wordOffset = sizeof(header) + header.sourceSize + header.preambleSize;
+		if (memcmp(header.magic, "VSPV", 4) != 0 || header.version != cacheVersion || header.key != key
+			|| header.stage != stage || header.options != options
+			|| header.sourceSize != source.size() || header.preambleSize != preamble.size()
+			|| header.wordCount == 0 || wordOffset + static_cast<uint64_t>(header.wordCount) * sizeof(uint32_t) != file.size)
+		{
+			return false;
+		}
+		const char* storedSource = file.data + sizeof(header);
+		const char* storedPreamble = storedSource + source.size();
+		if (memcmp(storedSource, source.data(), source.size()) != 0 || memcmp(storedPreamble, preamble.data(), preamble.size()) != 0)
+		{
+			return false;
+		}
+		std::vector<uint32_t> words(header.wordCount);
+		memcpy(words.data(), file.data + wordOffset, words.size() * sizeof(uint32_t));
+		if (words[0] != spirvMagic || Hash::Bytes(words.data(), words.size() * sizeof(uint32_t)) != header.checksum)
+		{
+			return false;
+		}
+		spirv.swap(words);
+		return true;
+	}
+
+	static bool Store(uint64_t key, const std::vector<char>& source, const std::string& preamble, uint32_t stage, uint64_t options,
+		const std::vector<uint32_t>& spirv)
+	{
+		if (spirv.empty())
+		{
+			return false;
+		}
+#ifdef _WIN32
+		_mkdir(Directory());
+#else
+		mkdir(Directory(), 0755);
+#endif
+		FileHeader header = {};
+		memcpy(header.magic, "VSPV", 4);
+		header.version = cacheVersion;
+		header.key = key;
+		header.wordCount = static_cast<uint32_t>(spirv.size());
+		header.stage = stage;
+		header.checksum = Hash::Bytes(spirv.data(), spirv.size() * sizeof(uint32_t));
+		header.options = options;
+		header.sourceSize = source.size();
+		header.preambleSize = preamble.size();
+
+		std::string filename = path(key);
+		std::string temporary = MappedFile::TemporaryName(filename.c_str());
+		FILE* output = fopen(temporary.c_str(), "wb");
+		if (output == nullptr)
+		{
+			return false;
+		}
+		bool written = fwrite(&header, sizeof(header), 1, output) == 1
+			&& fwrite(source.data(), 1, source.size(), output) == source.size()
+			&& fwrite(preamble.data(), 1, preamble.size(), output) == preamble.size()
+			&& fwrite(spirv.data(), sizeof(uint32_t), spirv.size(), output) == spirv.size();
+		written = fclose(output) == 0 && written;
+		if (!written)
+		{
+			remove(temporary.c_str());
+			return false;
+		}
+		return MappedFile::Publish(temporary, filename.c_str());
+	}
+
+	// The embedded variant of file compiled with preamble, empty when the
+	// build has none
+	static std::vector<uint32_t> Embedded(const char* file, const std::string& preamble)
+	{
+#ifdef VPP_EMBEDDED_SHADERS
+		for (const auto& shader : embeddedShaders)
+		{
+			if (strcmp(shader.file, file) == 0 && preamble == shader.preamble)
+			{
+				return std::vector<uint32_t>(shader.words, shader.words + shader.count);
+			}
+		}
+#else
+		(void)file;
+		(void)preamble;
+#endif
+		return std::vector<uint32_t>();
+	}
+
+	// Writes shaders as constexpr arrays plus the embeddedShaders table
+	// that Embedded() searches
+	static bool WriteHeader(const char* filename, const std::vector<EmbeddedShader>& shaders)
+	{
+		FILE* output = fopen(filename, "w");
+		if (output == nullptr)
+		{
+			return false;
+		}
+		fprintf(output, "#pragma once\n\n// Generated with VPP --embed-shaders, do not edit\n\n#include <cstdint>\n\n");
+		for (size_t i = 0; i < shaders.size(); i++)
+		{
+			fprintf(output, "constexpr uint32_t embeddedSpirv%zu[] = {", i);
+			for (size_t word = 0; word < shaders[i].count; word++)
+			{
+				fprintf(output, "%s0x%08xu,", word % 8 == 0 ? "\n\t" : " ", shaders[i].words[word]);
+			}
+			fprintf(output, "\n};\n\n");
+		}
+		fprintf(output, "constexpr EmbeddedShader embeddedShaders[] = {\n");
+		for (size_t i = 0; i < shaders.size(); i++)
+		{
+			fprintf(output, "\t{ \"%s\", \"%s\", embeddedSpirv%zu, %zu },\n", shaders[i].file, escape(shaders[i].preamble).c_str(),
+				i, shaders[i].count);
+		}
+		fprintf(output, "};\n");
+		return fclose(output) == 0;
+	}
+
+private:
+	// Followed by the GLSL source, the preamble and the SPIR-V words
+	struct FileHeader
+	{
+		char magic[4];
+		uint32_t version;
+		uint64_t key;
+		uint32_t wordCount;
+		uint32_t stage;
+		uint64_t checksum;
+		uint64_t options;
+		uint64_t sourceSize;
+		uint64_t preambleSize;
+	};
+
+	static std::string path(uint64_t key)
+	{
+		char name[32];
+		snprintf(name, sizeof(name), "/%016llx.spv", static_cast<unsigned long long>(key));
+		return Directory() + std::string(name);
+	}
+
+	// Preambles are lists of #defines separated by newlines
+	static std::string escape(const char* text)
+	{
+		std::string escaped;
+		for (; *text != '\0'; text++)
+		{
+			if (*text == '\n')
+			{
+				escaped += "\\n";
+			}
+			else
+			{
+				if (*text == '"' || *text == '\\')
+				{
+					escaped += '\\';
+				}
+				escaped += *text;
+			}
+		}
+		return escaped;
+	}
+};
@@ -1,49 +1,753 @@
 #pragma once
 
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
 #include <vector>
 #include <SDL2/SDL.h>
+#include <vulkan/vulkan.hpp>
 
+#include "compressor.hpp"
+#include "hash.hpp"
+#include "jobs.hpp"
+#include "mapping.hpp"
+#include "simd.hpp"
+
+// One level of a mip chain inside a texel buffer
+struct MipLevel
+{
+	uint32_t width;
+	uint32_t height;
+	uint64_t offset;
+	uint64_t size;
+};
+
+// 8-bit RGBA texels, rows tightly packed, followed by the rest of the mip
+// chain down to 1x1, or the same chain as BC blocks once compressed. BMPs
+// are authored in sRGB, so color textures are tagged srgb and sampled
+// through an sRGB format when the swapchain encodes the output again.
 class Texture
 {
 public:
+	static const uint32_t bytesPerPixel = 4;
+
 	uint32_t height;
 	uint32_t width;
 	uint32_t pitch;
-	std::vector<float> pixels;
-	Texture() : height(0), width(0), pitch(0), pixels() {}
-	Texture(const char* filename)
+	bool srgb;
+	TextureCompression compression;
+	std::vector<uint8_t> pixels;
+	std::vector<MipLevel> mips;
+	Texture() : height(0), width(0), pitch(0), srgb(true), compression(TextureCompression::None), pixels(), mips(), cache(), cacheHeader() {}
+	Texture(const char* filename, bool srgb = true, bool mipmapped = true)
+		: height(0), width(0), pitch(0), srgb(srgb), compression(TextureCompression::None), pixels(), mips(), cache(), cacheHeader()
 	{
 		auto surf = SDL_LoadBMP(filename);
 		if (surf == nullptr)
 		{
 			return;
 		}
-		pitch = surf->pitch;
-		height = surf->h;
-		width = surf->w;
-		pixels = std::vector<float>(height * width * 4u);
-		float temp[] = { 0.f, 0.f, 0.f, 1.f };
-		uint8_t colorSize = pitch / width;
+		// Anything that is not plain 24/32-bit RGB goes through SDL once
+		uint32_t sourceFormat = surf->format->format;
+		if (sourceFormat != SDL_PIXELFORMAT_BGR24 && sourceFormat != SDL_PIXELFORMAT_RGB24
+			&& sourceFormat != SDL_PIXELFORMAT_BGRA32 && sourceFormat != SDL_PIXELFORMAT_RGBA32)
+		{
+			auto converted = SDL_ConvertSurfaceFormat(surf, SDL_PIXELFORMAT_RGBA32, 0);
+			SDL_FreeSurface(surf);
+			if (converted == nullptr)
+			{
+				return;
+			}
+			surf = converted;
+			sourceFormat = SDL_PIXELFORMAT_RGBA32;
+		}
+		allocate(surf->w, surf->h, mipmapped ? UINT32_MAX : 1);
 
-		uint8_t* data = (uint8_t*)(surf->pixels);
-		for (unsigned int i = 0; i < height; i++)
+		SDL_LockSurface(surf);
+		const uint8_t* data = static_cast<const uint8_t*>(surf->pixels);
+		size_t sourcePitch = static_cast<size_t>(surf->pitch);
+		ForRowBands(height, [&](uint32_t begin, uint32_t end)
 		{
-			for (unsigned int j = 0; j < width; j++)
+			for (uint32_t i = begin; i < end; i++)
 			{
-				for (unsigned int k = 0; k < colorSize; k++)
+				const uint8_t* src = data + i * sourcePitch;
+				uint8_t* dst = &pixels[static_cast<size_t>(i) * pitch];
+				switch (sourceFormat)
 				{
-					temp[k] = data[i * pitch + j * colorSize + k] * 1.f / 255u;
+				case SDL_PIXELFORMAT_BGR24:
+					rgbToRgba(src, dst, width, true);
+					break;
+				case SDL_PIXELFORMAT_RGB24:
+					rgbToRgba(src, dst, width, false);
+					break;
+				case SDL_PIXELFORMAT_BGRA32:
+					bgraToRgba(src, dst, width);
+					break;
+				default:
+					memcpy(dst, src, pitch);
+					break;
 				}
-				for (unsigned int k = 0; k < 4u; k++)
+			}
+		});
+		SDL_UnlockSurface(surf);
+		SDL_FreeSurface(surf);
+		generateMips();
+	}
+	~Texture()
+	{
+		pixels.clear();
+		mips.clear();
+	}
+	// The destructor would otherwise turn every move into a texel copy
+	Texture(const Texture&) = default;
+	Texture(Texture&&) = default;
+	Texture& operator=(const Texture&) = default;
+	Texture& operator=(Texture&&) = default;
+
+	// Transparent black RGBA8 image with at most maxLevels mip levels, for
+	// callers that fill level 0 themselves and then call generateMips()
+	static Texture Create(uint32_t width, uint32_t height, bool srgb = true, uint32_t maxLevels = UINT32_MAX)
+	{
+		Texture texture;
+		texture.srgb = srgb;
+		texture.allocate(width, height, maxLevels);
+		return texture;
+	}
+
+	// Rebuilds every level below the top one from level 0. Each level
+	// needs the previous one, so only the rows of a level run in parallel.
+	void generateMips()
+	{
+		assert(compression == TextureCompression::None);
+		for (size_t level = 1; level < mips.size(); level++)
+		{
+			const MipLevel& source = mips[level - 1];
+			const MipLevel& target = mips[level];
+			ForRowBands(target.height, [&](uint32_t begin, uint32_t end) { downsample(source, target, begin, end); });
+		}
+		hash = 0;
+	}
+
+	// Starts Load on the shared pool. Decoding, conversion and mip
+	// generation of one image are split further into row bands, so many
+	// small textures and a few large ones both keep every core busy. Each
+	// name and setting is loaded once; later calls share the first load
+	// until ForgetLoads.
+	static std::shared_future<Texture> LoadAsync(const std::string& name, TextureCompression compression = TextureCompression::Auto, bool srgb = true)
+	{
+		std::string key = name + "#" + std::to_string(static_cast<int>(compression)) + (srgb ? "#srgb" : "#unorm");
+		Loads& loads = SharedLoads();
+		std::lock_guard<std::mutex> lock(loads.mutex);
+		auto found = loads.pending.find(key);
+		if (found == loads.pending.end())
+		{
+			std::shared_future<Texture> load = ThreadPool::Shared().submit([name, compression, srgb]() { return Load(name, compression, srgb); }).share();
+			found = loads.pending.insert(std::make_pair(key, load)).first;
+		}
+		return found->second;
+	}
+
+	// Drops the results LoadAsync keeps for sharing, once every caller has
+	// taken its copy
+	static void ForgetLoads()
+	{
+		Loads& loads = SharedLoads();
+		std::lock_guard<std::mutex> lock(loads.mutex);
+		loads.pending.clear();
+	}
+
+	// Hash of the stored texels and their layout, computed once. Identical
+	// images loaded by different objects hash the same.
+	uint64_t contentHash() const
+	{
+		if (hash == 0 && !empty())
+		{
+			hash = Hash::Value(compression);
+			hash = Hash::Value(width, hash);
+			hash = Hash::Value(height, hash);
+			hash = Hash::Value(srgb, hash);
+			hash = Hash::Bytes(mips.data(), mips.size() * sizeof(MipLevel), hash);
+			hash = Hash::Bytes(data(), static_cast<size_t>(byteSize()), hash);
+		}
+		return hash;
+	}
+
+	// Whether other stores exactly the same texels in the same layout. Hash
+	// matches are confirmed with this before anything is shared.
+	bool sameContents(const Texture& other) const
+	{
+		return width == other.width && height == other.height && srgb == other.srgb && compression == other.compression
+			&& mips.size() == other.mips.size() && byteSize() == other.byteSize()
+			&& (mips.empty() || memcmp(mips.data(), other.mips.data(), mips.size() * sizeof(MipLevel)) == 0)
+			&& (data() == other.data() || memcmp(data(), other.data(), static_cast<size_t>(byteSize())) == 0);
+	}
+
+	// Loads name.bmp through the name.vtex cache next to it. On a miss the
+	// image is decoded, mipmapped, block compressed and the cache written,
+	// so later runs map the blocks straight from disk.
+	static Texture Load(const std::string& name, TextureCompression compression = TextureCompression::Auto, bool srgb = true)
+	{
+		std::string sourcePath = name + ".bmp";
+		std::string cachePath = name + ".vtex";
+		MappedFile::Info sourceInfo = {};
+		MappedFile::Info cacheInfo = {};
+		bool hasSource = MappedFile::Stat(sourcePath.c_str(), sourceInfo);
+		if (compression != TextureCompression::None && MappedFile::Stat(cachePath.c_str(), cacheInfo))
+		{
+			Texture texture;
+			if (texture.loadCache(cachePath.c_str(), cacheInfo, hasSource ? sourcePath.c_str() : nullptr, hasSource ? &sourceInfo : nullptr,
+				compression, srgb))
+			{
+				return texture;
+			}
+		}
+
+		Texture texture(sourcePath.c_str(), srgb);
+		if (!texture.empty() && compression != TextureCompression::None)
+		{
+			texture.compress(compression);
+			uint64_t sourceHash = 0;
+			if (hashSource(sourcePath.c_str(), sourceHash))
+			{
+				texture.saveCache(cachePath.c_str(), sourceInfo, sourceHash);
+			}
+		}
+		return texture;
+	}
+
+	bool empty() const
+	{
+		return mips.empty();
+	}
+
+	// Level i starts at data() + mips[i].offset
+	const uint8_t* data() const
+	{
+		return cache ? reinterpret_cast<const uint8_t*>(cache->data) + cacheHeader.dataOffset : pixels.data();
+	}
+
+	uint32_t mipLevels() const
+	{
+		return static_cast<uint32_t>(mips.size());
+	}
+
+	uint64_t byteSize() const
+	{
+		return mips.empty() ? 0 : mips.back().offset + mips.back().size;
+	}
+
+	// Encoded values pass straight through a UNORM swapchain, so sRGB
+	// decoding is only wanted when the target encodes them again
+	vk::Format format(vk::Format target) const
+	{
+		bool decode = srgb && IsSrgb(target);
+		switch (compression)
+		{
+		case TextureCompression::BC1:
+			return decode ? vk::Format::eBc1RgbSrgbBlock : vk::Format::eBc1RgbUnormBlock;
+		case TextureCompression::BC3:
+			return decode ? vk::Format::eBc3SrgbBlock : vk::Format::eBc3UnormBlock;
+		case TextureCompression::BC7:
+			return decode ? vk::Format::eBc7SrgbBlock : vk::Format::eBc7UnormBlock;
+		default:
+			return decode ? vk::Format::eR8G8B8A8Srgb : vk::Format::eR8G8B8A8Unorm;
+		}
+	}
+
+	// Encodes every mip level into BC blocks, one block row per task.
+	// Auto picks BC1 when the top level is fully opaque, BC3 otherwise.
+	void compress(TextureCompression requested)
+	{
+		if (empty() || compression != TextureCompression::None || requested == TextureCompression::None)
+		{
+			return;
+		}
+		if (requested == TextureCompression::Auto)
+		{
+			bool opaque = true;
+			for (uint64_t i = 3; i < mips[0].size && opaque; i += bytesPerPixel)
+			{
+				opaque = pixels[static_cast<size_t>(i)] == 255;
+			}
+			requested = opaque ? TextureCompression::BC1 : TextureCompression::BC3;
+		}
+		uint32_t blockSize = BlockCompressor::BlockSize(requested);
+		std::vector<MipLevel> levels(mips.size());
+		std::vector<std::pair<uint32_t, uint32_t>> rows;
+		uint64_t offset = 0;
+		for (size_t level = 0; level < mips.size(); level++)
+		{
+			uint32_t blocksX = (mips[level].width + 3) / 4;
+			uint32_t blocksY = (mips[level].height + 3) / 4;
+			levels[level] = MipLevel{ mips[level].width, mips[level].height, offset, static_cast<uint64_t>(blocksX) * blocksY * blockSize };
+			offset += levels[level].size;
+			for (uint32_t y = 0; y < blocksY; y++)
+			{
+				rows.push_back(std::make_pair(static_cast<uint32_t>(level), y));
+			}
+		}
+		std::vector<uint8_t> blocks(static_cast<size_t>(offset));
+		ThreadPool::Shared().parallelFor(rows.size(), [&](size_t i)
+		{
+			const MipLevel& source = mips[rows[i].first];
+			const MipLevel& target = levels[rows[i].first];
+			uint32_t blockY = rows[i].second;
+			uint32_t blocksX = (source.width + 3) / 4;
+			uint8_t texels[64];
+			for (uint32_t blockX = 0; blockX < blocksX; blockX++)
+			{
+				// Edge blocks repeat the last row and column
+				for (uint32_t y = 0; y < 4; y++)
 				{
-					pixels[i * pitch + j * 4u + k] = temp[k];
+					uint32_t sy = std::min(blockY * 4 + y, source.height - 1);
+					for (uint32_t x = 0; x < 4; x++)
+					{
+						uint32_t sx = std::min(blockX * 4 + x, source.width - 1);
+						memcpy(&texels[(y * 4 + x) * 4], &pixels[static_cast<size_t>(source.offset + (static_cast<uint64_t>(sy) * source.width + sx) * bytesPerPixel)], 4);
+					}
 				}
+				BlockCompressor::Encode(requested, texels,
+					&blocks[static_cast<size_t>(target.offset + (static_cast<uint64_t>(blockY) * blocksX + blockX) * blockSize)]);
 			}
+		});
+		pixels.swap(blocks);
+		mips.swap(levels);
+		compression = requested;
+		hash = 0;
+		pitch = (width + 3) / 4 * blockSize;
+	}
+
+	// Expands the blocks back into RGBA8, for devices that cannot sample
+	// the compressed format
+	void decompress()
+	{
+		if (compression == TextureCompression::None)
+		{
+			return;
 		}
-		SDL_FreeSurface(surf);
+		uint32_t blockSize = BlockCompressor::BlockSize(compression);
+		std::vector<MipLevel> levels(mips.size());
+		uint64_t offset = 0;
+		for (size_t level = 0; level < mips.size(); level++)
+		{
+			levels[level] = MipLevel{ mips[level].width, mips[level].height, offset,
+				static_cast<uint64_t>(mips[level].width) * mips[level].height * bytesPerPixel };
+			offset += levels[level].size;
+		}
+		std::vector<uint8_t> texels(static_cast<size_t>(offset));
+		const uint8_t* blocks = data();
+		ThreadPool::Shared().parallelFor(levels.size(), [&](size_t level)
+		{
+			const MipLevel& source = mips[level];
+			const MipLevel& target = levels[level];
+			uint32_t blocksX = (source.width + 3) / 4;
+			uint32_t blocksY = (source.height + 3) / 4;
+			uint8_t block[64];
+			for (uint32_t blockY = 0; blockY < blocksY; blockY++)
+			{
+				for (uint32_t blockX = 0; blockX < blocksX; blockX++)
+				{
+					BlockCompressor::Decode(compression, blocks + source.offset + (static_cast<uint64_t>(blockY) * blocksX + blockX) * blockSize, block);
+					for (uint32_t y = 0; y < 4 && blockY * 4 + y < target.height; y++)
+					{
+						for (uint32_t x = 0; x < 4 && blockX * 4 + x < target.width; x++)
+						{
+							memcpy(&texels[static_cast<size_t>(target.offset + ((static_cast<uint64_t>(blockY) * 4 + y) * target.width + blockX * 4 + x) * bytesPerPixel)],
+								&block[(y * 4 + x) * 4], 4);
+						}
+					}
+				}
+			}
+		});
+		pixels.swap(texels);
+		mips.swap(levels);
+		compression = TextureCompression::None;
+		pitch = width * bytesPerPixel;
+		cache.reset();
+		hash = 0;
 	}
-	~Texture()
+
+	std::string statistics() const
+	{
+		static const char* names[] = { "RGBA8", "BC1", "BC3", "BC7" };
+		uint64_t uncompressed = 0;
+		for (const auto& mip : mips)
+		{
+			uncompressed += static_cast<uint64_t>(mip.width) * mip.height * bytesPerPixel;
+		}
+		char text[128];
+		snprintf(text, sizeof(text), "%s %ux%u, %u levels, %llu KB (RGBA8 %llu KB)", names[static_cast<uint32_t>(compression) & 3],
+			width, height, mipLevels(), static_cast<unsigned long long>(byteSize() >> 10), static_cast<unsigned long long>(uncompressed >> 10));
+		return text;
+	}
+
+	static bool IsSrgb(vk::Format format)
+	{
+		return format == vk::Format::eB8G8R8A8Srgb || format == vk::Format::eR8G8B8A8Srgb
+			|| format == vk::Format::eA8B8G8R8SrgbPack32;
+	}
+
+private:
+	// Layout of a .vtex file: this header, the MipLevel table and the block
+	// data, each 16-byte aligned. Level offsets are relative to dataOffset.
+	struct CacheHeader
+	{
+		char magic[4];
+		uint32_t version;
+		uint64_t sourceSize;
+		uint64_t sourceHash;
+		int64_t sourceModified;
+		uint32_t width;
+		uint32_t height;
+		uint32_t compression;
+		uint32_t srgb;
+		uint32_t levelCount;
+		uint32_t reserved;
+		uint64_t levelOffset;
+		uint64_t dataOffset;
+		uint64_t dataSize;
+	};
+	static const uint32_t cacheVersion = 2;
+
+	std::shared_ptr<MappedFile> cache;
+	CacheHeader cacheHeader;
+	mutable uint64_t hash = 0;
+
+	// Lays out an RGBA8 chain of up to maxLevels levels and zeroes it
+	void allocate(uint32_t levelWidth, uint32_t levelHeight, uint32_t maxLevels)
+	{
+		width = levelWidth;
+		height = levelHeight;
+		pitch = width * bytesPerPixel;
+		uint64_t levelSize = static_cast<uint64_t>(pitch) * height;
+		mips.clear();
+		mips.push_back(MipLevel{ width, height, 0, levelSize });
+		uint64_t chainSize = levelSize;
+		for (uint32_t w = width, h = height; mips.size() < maxLevels && (w > 1 || h > 1);)
+		{
+			w = std::max(w / 2, 1u);
+			h = std::max(h / 2, 1u);
+			levelSize = static_cast<uint64_t>(w) * h * bytesPerPixel;
+			mips.push_back(MipLevel{ w, h, chainSize, levelSize });
+			chainSize += levelSize;
+		}
+		pixels = std::vector<uint8_t>(static_cast<size_t>(chainSize));
+		hash = 0;
+	}
+
+	static uint64_t alignOffset(uint64_t offset)
 	{
+		return (offset + 15) & ~static_cast<uint64_t>(15);
+	}
+
+	static bool hashSource(const char* filename, uint64_t& hash)
+	{
+		MappedFile file;
+		if (!file.open(filename))
+		{
+			return false;
+		}
+		hash = Hash::Bytes(file.data, file.size);
+		return true;
+	}
+
+	// info is the cache file's own; sourcePath and source describe the BMP,
+	// both nullptr when it is gone. Validated like Mesh::loadCache.
+	bool loadCache(const char* filename, const MappedFile::Info& info, const char* sourcePath, const MappedFile::Info* source,
+		TextureCompression requested, bool requestedSrgb)
+	{
+		auto file = std::make_shared<MappedFile>();
+		if (!file->open(filename) || file->size < sizeof(CacheHeader))
+		{
+			return false;
+		}
+		CacheHeader header;
+		memcpy(&header, file->data, sizeof(header));
+		TextureCompression stored = static_cast<TextureCompression>(header.compression);
+		if (memcmp(header.magic, "VTEX", 4) != 0 || header.version != cacheVersion || header.srgb != (requestedSrgb ? 1u : 0u)
+			|| (stored != TextureCompression::BC1 && stored != TextureCompression::BC3 && stored != TextureCompression::BC7)
+			|| (requested != TextureCompression::Auto && requested != stored)
+			|| (requested == TextureCompression::Auto && stored == TextureCompression::BC7))
+		{
+			return false;
+		}
+		if (source != nullptr && header.sourceSize != source->size)
+		{
+			return false;
+		}
+		// A BMP of the same dimensions always has the same size, so an edit in
+		// the tick the cache was written or an older file restored with cp -p
+		// is only caught by comparing contents
+		MappedFile::Info recorded = { header.sourceSize, header.sourceModified };
+		bool stamped = source == nullptr || MappedFile::Unchanged(*source, recorded, info);
+		uint64_t sourceHash = 0;
+		if (!stamped && (!hashSource(sourcePath, sourceHash) || sourceHash != header.sourceHash))
+		{
+			return false;
+		}
+		if (header.levelCount == 0 || header.levelOffset + static_cast<uint64_t>(header.levelCount) * sizeof(MipLevel) > file->size
+			|| header.dataOffset + header.dataSize > file->size)
+		{
+			return false;
+		}
+		std::vector<MipLevel> table(header.levelCount);
+		memcpy(table.data(), file->data + header.levelOffset, table.size() * sizeof(MipLevel));
+		uint32_t blockSize = BlockCompressor::BlockSize(stored);
+		for (const auto& level : table)
+		{
+			uint64_t blocks = static_cast<uint64_t>((level.width + 3) / 4) * ((level.height + 3) / 4);
+			if (level.size != blocks * blockSize || level.offset % blockSize != 0 || level.offset + level.size > header.dataSize)
+			{
+				return false;
+			}
+		}
+		if (table[0].width != header.width || table[0].height != header.height)
+		{
+			return false;
+		}
+
+		// The BMP was only touched, so stamp the cache with its new time and
+		// let the next run skip the hash
+		if (!stamped)
+		{
+			header.sourceModified = source->modified;
+			MappedFile::Patch(filename, 0, &header, sizeof(header));
+		}
+
+		width = header.width;
+		height = header.height;
+		pitch = (width + 3) / 4 * blockSize;
+		srgb = requestedSrgb;
+		compression = stored;
 		pixels.clear();
+		mips.swap(table);
+		cacheHeader = header;
+		cache = file;
+		return true;
+	}
+
+	bool saveCache(const char* filename, const MappedFile::Info& source, uint64_t sourceHash) const
+	{
+		CacheHeader header = {};
+		memcpy(header.magic, "VTEX", 4);
+		header.version = cacheVersion;
+		header.sourceSize = source.size;
+		header.sourceHash = sourceHash;
+		header.sourceModified = source.modified;
+		header.width = width;
+		header.height = height;
+		header.compression = static_cast<uint32_t>(compression);
+		header.srgb = srgb ? 1 : 0;
+		header.levelCount = mipLevels();
+		header.levelOffset = alignOffset(sizeof(header));
+		header.dataOffset = alignOffset(header.levelOffset + mips.size() * sizeof(MipLevel));
+		header.dataSize = byteSize();
+
+		std::string temporary = MappedFile::TemporaryName(filename);
+		FILE* output = fopen(temporary.c_str(), "wb");
+		if (output == nullptr)
+		{
+			return false;
+		}
+		static const char padding[16] = {};
+		size_t headerPadding = static_cast<size_t>(header.levelOffset - sizeof(header));
+		size_t levelPadding = static_cast<size_t>(header.dataOffset - header.levelOffset - mips.size() * sizeof(MipLevel));
+		bool written = fwrite(&header, sizeof(header), 1, output) == 1
+			&& fwrite(padding, 1, headerPadding, output) == headerPadding
+			&& fwrite(mips.data(), sizeof(MipLevel), mips.size(), output) == mips.size()
+			&& fwrite(padding, 1, levelPadding, output) == levelPadding
+			&& fwrite(data(), 1, static_cast<size_t>(header.dataSize), output) == header.dataSize;
+		written = fclose(output) == 0 && written;
+		if (!written)
+		{
+			remove(temporary.c_str());
+			return false;
+		}
+		return MappedFile::Publish(temporary, filename);
+	}
+
+	struct Loads
+	{
+		std::mutex mutex;
+		std::map<std::string, std::shared_future<Texture>> pending;
+	};
+
+	static Loads& SharedLoads()
+	{
+		static Loads loads;
+		return loads;
+	}
+
+	// Rows per task when an image is split over the pool
+	static const uint32_t bandRows = 64;
+
+	// Calls body(begin, end) for consecutive bands of rows covering
+	// [0, rows); a single band runs on the calling thread
+	template<typename F>
+	static void ForRowBands(uint32_t rows, F&& body)
+	{
+		uint32_t bands = (rows + bandRows - 1) / bandRows;
+		ThreadPool::Shared().parallelFor(bands, [&](size_t band)
+		{
+			uint32_t begin = static_cast<uint32_t>(band) * bandRows;
+			body(begin, std::min(rows, begin + bandRows));
+		});
+	}
+
+	// 2x2 box filter of rows [rowBegin, rowEnd) of target from the level
+	// above. Odd edges repeat their last texel. sRGB color is averaged in
+	// linear light so mips do not darken; alpha and UNORM data are
+	// averaged as stored.
+	void downsample(const MipLevel& source, const MipLevel& target, uint32_t rowBegin, uint32_t rowEnd)
+	{
+		const uint8_t* src = &pixels[static_cast<size_t>(source.offset)];
+		uint8_t* dst = &pixels[static_cast<size_t>(target.offset)];
+		size_t srcPitch = static_cast<size_t>(source.width) * bytesPerPixel;
+		for (uint32_t y = rowBegin; y < rowEnd; y++)
+		{
+			const uint8_t* row0 = src + std::min(2 * y, source.height - 1) * srcPitch;
+			const uint8_t* row1 = src + std::min(2 * y + 1, source.height - 1) * srcPitch;
+			uint8_t* out = dst + static_cast<size_t>(y) * target.width * bytesPerPixel;
+			uint32_t x = 0;
+			if (srgb)
+			{
+				const SrgbTables& tables = Tables();
+				for (; x < target.width; x++)
+				{
+					uint32_t x0 = std::min(2 * x, source.width - 1) * bytesPerPixel;
+					uint32_t x1 = std::min(2 * x + 1, source.width - 1) * bytesPerPixel;
+					for (uint32_t c = 0; c < 3; c++)
+					{
+						float sum = tables.toLinear[row0[x0 + c]] + tables.toLinear[row0[x1 + c]]
+							+ tables.toLinear[row1[x0 + c]] + tables.toLinear[row1[x1 + c]];
+						out[x * 4 + c] = tables.fromLinear[static_cast<uint32_t>(sum * 0.25f * (SrgbTables::steps - 1) + 0.5f)];
+					}
+					out[x * 4 + 3] = static_cast<uint8_t>((row0[x0 + 3] + row0[x1 + 3] + row1[x0 + 3] + row1[x1 + 3] + 2) / 4);
+				}
+				continue;
+			}
+#ifdef VPP_SSE2
+			// Two output texels from four input texels of each row: widen to
+			// 16 bits, add the rows, then add horizontal neighbours
+			const __m128i zero = _mm_setzero_si128();
+			const __m128i round = _mm_set1_epi16(2);
+			for (; 2 * x + 3 < source.width && x + 1 < target.width; x += 2)
+			{
+				__m128i top = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row0 + x * 8));
+				__m128i bottom = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row1 + x * 8));
+				__m128i left = _mm_add_epi16(_mm_unpacklo_epi8(top, zero), _mm_unpacklo_epi8(bottom, zero));
+				__m128i right = _mm_add_epi16(_mm_unpackhi_epi8(top, zero), _mm_unpackhi_epi8(bottom, zero));
+				left = _mm_add_epi16(left, _mm_srli_si128(left, 8));
+				right = _mm_add_epi16(right, _mm_srli_si128(right, 8));
+				__m128i sum = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(left, right), round), 2);
+				_mm_storel_epi64(reinterpret_cast<__m128i*>(out + x * 4), _mm_packus_epi16(sum, zero));
+			}
+#endif
+			for (; x < target.width; x++)
+			{
+				uint32_t x0 = std::min(2 * x, source.width - 1) * bytesPerPixel;
+				uint32_t x1 = std::min(2 * x + 1, source.width - 1) * bytesPerPixel;
+				for (uint32_t c = 0; c < 4; c++)
+				{
+					out[x * 4 + c] = static_cast<uint8_t>((row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c] + 2) / 4);
+				}
+			}
+		}
+	}
+
+	struct SrgbTables
+	{
+		static const uint32_t steps = 16384;
+		float toLinear[256];
+		uint8_t fromLinear[steps];
+
+		SrgbTables()
+		{
+			for (uint32_t i = 0; i < 256; i++)
+			{
+				float c = i / 255.f;
+				toLinear[i] = c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+			}
+			for (uint32_t i = 0; i < steps; i++)
+			{
+				float l = i / static_cast<float>(steps - 1);
+				float c = l <= 0.0031308f ? l * 12.92f : 1.055f * std::pow(l, 1.f / 2.4f) - 0.055f;
+				fromLinear[i] = static_cast<uint8_t>(std::min(255.f, c * 255.f + 0.5f));
+			}
+		}
+	};
+
+	static const SrgbTables& Tables()
+	{
+		static const SrgbTables tables;
+		return tables;
+	}
+
+#ifdef VPP_SSE2
+	// Swaps bytes 0 and 2 of every texel and forces alpha to 255 if asked
+	static __m128i swapRedBlue(__m128i texels, __m128i alpha)
+	{
+		const __m128i greenAlpha = _mm_set1_epi32(static_cast<int>(0xFF00FF00u));
+		const __m128i red = _mm_set1_epi32(0x00FF0000);
+		const __m128i blue = _mm_set1_epi32(0x000000FF);
+		__m128i swapped = _mm_or_si128(_mm_and_si128(_mm_slli_epi32(texels, 16), red), _mm_and_si128(_mm_srli_epi32(texels, 16), blue));
+		return _mm_or_si128(_mm_or_si128(_mm_and_si128(texels, greenAlpha), swapped), alpha);
+	}
+#endif
+
+	static void bgraToRgba(const uint8_t* src, uint8_t* dst, uint32_t count)
+	{
+		uint32_t i = 0;
+#ifdef VPP_SSE2
+		for (; i + 4 <= count; i += 4)
+		{
+			__m128i texels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 4));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 4), swapRedBlue(texels, _mm_setzero_si128()));
+		}
+#endif
+		for (; i < count; i++)
+		{
+			dst[i * 4 + 0] = src[i * 4 + 2];
+			dst[i * 4 + 1] = src[i * 4 + 1];
+			dst[i * 4 + 2] = src[i * 4 + 0];
+			dst[i * 4 + 3] = src[i * 4 + 3];
+		}
+	}
+
+	// 3-byte texels to 4-byte ones with opaque alpha. swap turns BGR into RGB.
+	static void rgbToRgba(const uint8_t* src, uint8_t* dst, uint32_t count, bool swap)
+	{
+		uint32_t i = 0;
+#ifdef VPP_SSE2
+		// Four texels come from one 16-byte load, so the last few are left to
+		// the scalar loop to stay inside the row. Texel k starts at byte 3k:
+		// shifting by 0, 3, 6 and 9 bytes and interleaving puts it in dword k.
+		const __m128i alpha = _mm_set1_epi32(static_cast<int>(0xFF000000u));
+		const __m128i rgb = _mm_set1_epi32(0x00FFFFFF);
+		for (; i + 6 <= count; i += 4)
+		{
+			__m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 3));
+			__m128i low = _mm_unpacklo_epi32(bytes, _mm_srli_si128(bytes, 3));
+			__m128i high = _mm_unpacklo_epi32(_mm_srli_si128(bytes, 6), _mm_srli_si128(bytes, 9));
+			__m128i texels = _mm_and_si128(_mm_unpacklo_epi64(low, high), rgb);
+			texels = swap ? swapRedBlue(texels, alpha) : _mm_or_si128(texels, alpha);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 4), texels);
+		}
+#endif
+		for (; i < count; i++)
+		{
+			dst[i * 4 + 0] = src[i * 3 + (swap ? 2 : 0)];
+			dst[i * 4 + 1] = src[i * 3 + 1];
+			dst[i * 4 + 2] = src[i * 3 + (swap ? 0 : 2)];
+			dst[i * 4 + 3] = 255;
+		}
 	}
-};
\ No newline at end of file
+};
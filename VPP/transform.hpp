@@ -1,5 +1,6 @@
 #pragma once
 
+#include <algorithm>
 #include <glm/glm.hpp>
 #include <glm/ext.hpp>
 
@@ -18,6 +19,39 @@ public:
 		model = glm::scale(model, scale);
 		return model;
 	}
+
+	// World-space AABB of a local one, in center/extent form (Arvo,
+	// "Transforming Axis-Aligned Bounding Boxes", Graphics Gems): one point
+	// transform and a 3x3 abs-multiply instead of transforming eight corners.
+	static void TransformBounds(const glm::mat4& model, const glm::vec3& localMin, const glm::vec3& localMax, glm::vec3& worldMin, glm::vec3& worldMax)
+	{
+		glm::vec3 center = (localMin + localMax) * 0.5f;
+		glm::vec3 extent = (localMax - localMin) * 0.5f;
+		glm::vec3 worldCenter = glm::vec3(model * glm::vec4(center, 1.f));
+		glm::vec3 worldExtent = glm::abs(glm::vec3(model[0])) * extent.x
+			+ glm::abs(glm::vec3(model[1])) * extent.y
+			+ glm::abs(glm::vec3(model[2])) * extent.z;
+		worldMin = worldCenter - worldExtent;
+		worldMax = worldCenter + worldExtent;
+	}
+
+	void getWorldBounds(const glm::vec3& localMin, const glm::vec3& localMax, glm::vec3& worldMin, glm::vec3& worldMax)
+	{
+		TransformBounds(getModelMatrix(), localMin, localMax, worldMin, worldMax);
+	}
+
+	// Rotation keeps a sphere a sphere, so only the largest scale grows it
+	void getWorldSphere(const glm::vec3& localCenter, float localRadius, glm::vec3& worldCenter, float& worldRadius)
+	{
+		worldCenter = glm::vec3(getModelMatrix() * glm::vec4(localCenter, 1.f));
+		worldRadius = localRadius * getMaxScale();
+	}
+
+	float getMaxScale() const
+	{
+		glm::vec3 size = glm::abs(scale);
+		return std::max(size.x, std::max(size.y, size.z));
+	}
 public:
 	glm::vec3 position;
 	glm::vec3 rotation;
@@ -2,8 +2,13 @@
 
 #include <iostream>
 #include <vulkan/vulkan.hpp>
+#ifndef VPP_EMBEDDED_SHADERS
 #include <glslang/Public/ShaderLang.h>
 #include <SPIRV/GlslangToSpv.h>
+#endif
+
+#include "jobs.hpp"
+#include "spirv.hpp"
 
 class Log
 {
@@ -30,8 +35,25 @@ public:
 class ShaderUtil
 {
 public:
-	static std::vector<uint32_t> Create(const char* filename, vk::ShaderStageFlagBits type)
+	// Bump when InitResources or the glslang version changes, so stale
+	// SPIR-V is not picked up from the cache
+	static const uint32_t compilerRevision = 1;
+	static const int glslVersion = 140;
+
+	// preamble is inserted after #version, typically a list of #defines that
+	// selects a variant of the shader. Compiled variants are kept in
+	// SpirvCache; builds with VPP_EMBEDDED_SHADERS only look them up in the
+	// generated embedded_shaders.hpp.
+	static std::vector<uint32_t> Create(const char* filename, vk::ShaderStageFlagBits type, const std::string& preamble = std::string())
 	{
+#ifdef VPP_EMBEDDED_SHADERS
+		std::vector<uint32_t> embedded = SpirvCache::Embedded(filename, preamble);
+		if (embedded.empty())
+		{
+			Log::Error(std::string("No embedded SPIR-V for ") + filename);
+		}
+		return embedded;
+#else
 		FILE* input = fopen(filename, "rb");
 		assert(input != nullptr);
 		fseek(input, 0, SEEK_END);
@@ -43,24 +65,103 @@ public:
 		content[fileSize] = '\0';
 		fclose(input);
 		//Log::Info("filename:", content.data());
-		InitGlslang();
+		uint32_t stage = static_cast<uint32_t>(type);
+		uint64_t key = SpirvCache::Key(content, preamble, stage, CompilerOptions());
 		std::vector<uint32_t> result;
-		if (GLSLtoSPV(type, content.data(), result))
+		if (SpirvCache::Load(key, content, preamble, stage, CompilerOptions(), result))
 		{
-			FinalizeGlslang();
+			return result;
+		}
+		InitGlslang();
+		if (GLSLtoSPV(type, content.data(), preamble.c_str(), result))
+		{
+			bool stored = SpirvCache::Store(key, content, preamble, stage, CompilerOptions(), result);
 			content.clear();
+			if (!stored)
+			{
+				Log::Info("SpirvCache", std::string("could not store ") + filename);
+			}
 			return result;
 		}
 		else
 		{
-			FinalizeGlslang();
 			content.clear();
 			return std::vector<uint32_t>();
 		}
+#endif
+	}
+
+	struct Request
+	{
+		std::string filename;
+		vk::ShaderStageFlagBits type;
+		std::string preamble;
+	};
+
+	// Create for every request at once, spread over the thread pool. Results
+	// are in request order.
+	static std::vector<std::vector<uint32_t>> CreateBatch(const std::vector<Request>& requests)
+	{
+		std::vector<std::vector<uint32_t>> results(requests.size());
+		ThreadPool::Shared().parallelFor(requests.size(), [&requests, &results](size_t i)
+		{
+			results[i] = Create(requests[i].filename.c_str(), requests[i].type, requests[i].preamble);
+		});
+		return results;
+	}
+
+#ifndef VPP_EMBEDDED_SHADERS
+	// Compiles every .vert/.frag pair in names with every preamble and writes
+	// them to a header that VPP_EMBEDDED_SHADERS builds include
+	static bool EmbedShaders(const char* filename, const std::vector<std::string>& names, const std::vector<std::string>& preambles)
+	{
+		std::vector<Request> requests;
+		for (const auto& name : names)
+		{
+			for (const auto& preamble : preambles)
+			{
+				requests.push_back(Request{ name + ".vert", vk::ShaderStageFlagBits::eVertex, preamble });
+				requests.push_back(Request{ name + ".frag", vk::ShaderStageFlagBits::eFragment, preamble });
+			}
+		}
+		std::vector<std::vector<uint32_t>> spirv = CreateBatch(requests);
+		std::vector<EmbeddedShader> shaders;
+		for (size_t i = 0; i < requests.size(); i++)
+		{
+			if (spirv[i].empty())
+			{
+				Log::Error("Could not compile " + requests[i].filename);
+				return false;
+			}
+			shaders.push_back(EmbeddedShader{ requests[i].filename.c_str(), requests[i].preamble.c_str(), spirv[i].data(), spirv[i].size() });
+		}
+		if (!SpirvCache::WriteHeader(filename, shaders))
+		{
+			Log::Error(std::string("Could not write ") + filename);
+			return false;
+		}
+		Log::Info("Embedded shaders", shaders.size());
+		return true;
 	}
 
 private:
-	static bool GLSLtoSPV(const vk::ShaderStageFlagBits shaderType, const char *pShader, std::vector<uint32_t> &spirv)
+	static EShMessages Messages()
+	{
+		// Enable SPIR-V and Vulkan rules when parsing GLSL
+		return static_cast<EShMessages>(EShMsgSpvRules | EShMsgVulkanRules);
+	}
+
+	// Everything besides the source and preamble that changes the SPIR-V
+	static uint64_t CompilerOptions()
+	{
+		const uint32_t revision = compilerRevision;
+		const int version = glslVersion;
+		uint64_t options = Hash::Value(revision);
+		options = Hash::Value(version, options);
+		return Hash::Value(Messages(), options);
+	}
+
+	static bool GLSLtoSPV(const vk::ShaderStageFlagBits shaderType, const char *pShader, const char *pPreamble, std::vector<uint32_t> &spirv)
 	{
 		using namespace glslang;
 		EShLanguage stage = MapLanguage(shaderType);
@@ -70,12 +171,12 @@ private:
 		TBuiltInResource Resources;
 		InitResources(Resources);
 
-		// Enable SPIR-V and Vulkan rules when parsing GLSL
-		EShMessages messages = (EShMessages)(EShMsgSpvRules | EShMsgVulkanRules);
+		EShMessages messages = Messages();
 
 		shaderStrings[0] = pShader;
 		shader.setStrings(shaderStrings, 1);
-		if (!shader.parse(&Resources, 140, false, messages)) {
+		shader.setPreamble(pPreamble);
+		if (!shader.parse(&Resources, glslVersion, false, messages)) {
 			Log::Error(shader.getInfoLog());
 			Log::Error(shader.getInfoDebugLog());
 			return false;  // something didn't work
@@ -118,9 +219,17 @@ private:
 		}
 	}
 
+	// glslang is set up on the first compile and torn down at exit. Each
+	// GLSLtoSPV call owns its TShader and TProgram, so compiles on different
+	// threads share nothing else.
 	static void InitGlslang()
 	{
-		glslang::InitializeProcess();
+		struct Process
+		{
+			Process() { glslang::InitializeProcess(); }
+			~Process() { glslang::FinalizeProcess(); }
+		};
+		static Process process;
 	}
 
 	static void InitResources(TBuiltInResource &Resources) {
@@ -217,10 +326,7 @@ private:
 		Resources.limits.generalVariableIndexing = 1;
 		Resources.limits.generalConstantMatrixVectorIndexing = 1;
 	}
-
-	static void FinalizeGlslang() {
-		glslang::FinalizeProcess();
-	}
+#endif
 };
 
 bool GetPhysicalMemoryType(const vk::PhysicalDevice& gpu, vk::MemoryRequirements reqs, vk::MemoryPropertyFlags desiredMask, uint32_t& typeIndex)
@@ -246,10 +352,48 @@ struct BufferMemory
 	vk::Buffer buffer;
 };
 
+// Where a mesh lives inside Instance's geometry pool. Offsets are in bytes,
+// baseVertex and firstIndex are what drawIndexed expects.
+struct MeshRange
+{
+	vk::DeviceSize vertexOffset;
+	vk::DeviceSize vertexSize;
+	vk::DeviceSize indexOffset;
+	vk::DeviceSize indexSize;
+	int32_t baseVertex;
+	uint32_t firstIndex;
+	uint32_t indexCount;
+	vk::IndexType indexType;
+};
+
+struct DrawItem
+{
+	vk::Pipeline pipeline;
+	const std::vector<vk::DescriptorSet>* descriptorSets;
+	MeshRange mesh;
+	// Slot in the bindless texture array, unused without bindless textures
+	uint32_t textureIndex;
+};
+
 struct ImageMemory
 {
 	vk::Image image;
 	vk::Sampler sampler;
 	vk::ImageView view;
 	vk::DeviceMemory memory;
+};
+
+// Fixed-function state Instance::createPipeline lets callers choose. The
+// defaults are what every shader has used so far.
+struct PipelineState
+{
+	vk::PrimitiveTopology topology = vk::PrimitiveTopology::eTriangleList;
+	vk::PolygonMode polygonMode = vk::PolygonMode::eFill;
+	vk::CullModeFlags cullMode = vk::CullModeFlagBits::eBack;
+	vk::FrontFace frontFace = vk::FrontFace::eCounterClockwise;
+	bool depthTest = true;
+	bool depthWrite = true;
+	vk::CompareOp depthCompare = vk::CompareOp::eLessOrEqual;
+	// Straight alpha blending over the target
+	bool alphaBlend = false;
 };
\ No newline at end of file
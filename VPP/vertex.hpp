@@ -0,0 +1,341 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <glm/glm.hpp>
+#include <vulkan/vulkan.hpp>
+
+// Layout of the vertex stream a mesh is packed into. Quantized is opt-in per
+// Drawable and halves vertex memory and fetch bandwidth.
+enum class VertexFormat
+{
+	Standard,
+	Quantized,
+};
+
+// One vertex in float form, as the importer produces it
+struct VertexData
+{
+	glm::vec3 position;
+	glm::vec3 normal;
+	glm::vec2 uv;
+};
+
+// Per-mesh ranges that quantized attributes are encoded against
+struct VertexEncoding
+{
+	glm::vec3 positionOffset;
+	glm::vec3 positionExtent;
+	glm::vec3 positionScale;
+	glm::vec2 uvOffset;
+	glm::vec2 uvExtent;
+	glm::vec2 uvScale;
+
+	static VertexEncoding Create(const glm::vec3& boundsMin, const glm::vec3& boundsMax, const glm::vec2& uvMin, const glm::vec2& uvMax)
+	{
+		VertexEncoding encoding;
+		encoding.positionOffset = boundsMin;
+		encoding.positionExtent = boundsMax - boundsMin;
+		encoding.uvOffset = uvMin;
+		encoding.uvExtent = uvMax - uvMin;
+		// Flat axes get a zero scale so they quantize to 0 and decode to the minimum
+		for (int i = 0; i < 3; i++)
+		{
+			encoding.positionScale[i] = encoding.positionExtent[i] > 0.f ? 1.f / encoding.positionExtent[i] : 0.f;
+		}
+		for (int i = 0; i < 2; i++)
+		{
+			encoding.uvScale[i] = encoding.uvExtent[i] > 0.f ? 1.f / encoding.uvExtent[i] : 0.f;
+		}
+		return encoding;
+	}
+};
+
+class Quantize
+{
+public:
+	static uint16_t Unorm16(float value)
+	{
+		value = std::min(1.f, std::max(0.f, value));
+		return static_cast<uint16_t>(value * 65535.f + 0.5f);
+	}
+
+	static int16_t Snorm16(float value)
+	{
+		value = std::min(1.f, std::max(-1.f, value));
+		return static_cast<int16_t>(std::floor(value * 32767.f + 0.5f));
+	}
+
+	static float FromUnorm16(uint16_t value)
+	{
+		return static_cast<float>(value) / 65535.f;
+	}
+
+	static float FromSnorm16(int16_t value)
+	{
+		return std::max(static_cast<float>(value) / 32767.f, -1.f);
+	}
+
+	// Octahedral mapping of a unit vector onto [-1, 1]^2 (Cigolle et al.,
+	// "A Survey of Efficient Representations for Independent Unit Vectors")
+	static glm::vec2 OctahedralEncode(const glm::vec3& normal)
+	{
+		float sum = std::fabs(normal.x) + std::fabs(normal.y) + std::fabs(normal.z);
+		if (sum == 0.f)
+		{
+			return glm::vec2(0.f);
+		}
+		glm::vec2 result = glm::vec2(normal.x, normal.y) / sum;
+		if (normal.z < 0.f)
+		{
+			result = glm::vec2((1.f - std::fabs(result.y)) * (result.x >= 0.f ? 1.f : -1.f),
+				(1.f - std::fabs(result.x)) * (result.y >= 0.f ? 1.f : -1.f));
+		}
+		return result;
+	}
+
+	// Must match octahedralDecode in the vertex shaders
+	static glm::vec3 OctahedralDecode(const glm::vec2& encoded)
+	{
+		glm::vec3 normal = glm::vec3(encoded.x, encoded.y, 1.f - std::fabs(encoded.x) - std::fabs(encoded.y));
+		if (normal.z < 0.f)
+		{
+			normal = glm::vec3((1.f - std::fabs(encoded.y)) * (encoded.x >= 0.f ? 1.f : -1.f),
+				(1.f - std::fabs(encoded.x)) * (encoded.y >= 0.f ? 1.f : -1.f), normal.z);
+		}
+		return glm::normalize(normal);
+	}
+};
+
+// Vertex attributes. Each one is a shader input location: its byte size, its
+// Vulkan format and how a VertexData is packed into and read back from it.
+
+struct PositionFloat
+{
+	static const uint32_t size = sizeof(float) * 3;
+	static vk::Format Format() { return vk::Format::eR32G32B32Sfloat; }
+
+	static void Pack(const VertexData& vertex, const VertexEncoding&, char* out)
+	{
+		const float packed[3] = { vertex.position.x, vertex.position.y, vertex.position.z };
+		memcpy(out, packed, sizeof(packed));
+	}
+
+	static void Unpack(const char* in, const VertexEncoding&, VertexData& vertex)
+	{
+		float packed[3];
+		memcpy(packed, in, sizeof(packed));
+		vertex.position = glm::vec3(packed[0], packed[1], packed[2]);
+	}
+};
+
+struct NormalFloat
+{
+	static const uint32_t size = sizeof(float) * 3;
+	static vk::Format Format() { return vk::Format::eR32G32B32Sfloat; }
+
+	static void Pack(const VertexData& vertex, const VertexEncoding&, char* out)
+	{
+		const float packed[3] = { vertex.normal.x, vertex.normal.y, vertex.normal.z };
+		memcpy(out, packed, sizeof(packed));
+	}
+
+	static void Unpack(const char* in, const VertexEncoding&, VertexData& vertex)
+	{
+		float packed[3];
+		memcpy(packed, in, sizeof(packed));
+		vertex.normal = glm::vec3(packed[0], packed[1], packed[2]);
+	}
+};
+
+struct UvFloat
+{
+	static const uint32_t size = sizeof(float) * 2;
+	static vk::Format Format() { return vk::Format::eR32G32Sfloat; }
+
+	static void Pack(const VertexData& vertex, const VertexEncoding&, char* out)
+	{
+		const float packed[2] = { vertex.uv.x, vertex.uv.y };
+		memcpy(out, packed, sizeof(packed));
+	}
+
+	static void Unpack(const char* in, const VertexEncoding&, VertexData& vertex)
+	{
+		float packed[2];
+		memcpy(packed, in, sizeof(packed));
+		vertex.uv = glm::vec2(packed[0], packed[1]);
+	}
+};
+
+// unorm16 within the mesh AABB, w is padding
+struct PositionUnorm16
+{
+	static const uint32_t size = sizeof(uint16_t) * 4;
+	static vk::Format Format() { return vk::Format::eR16G16B16A16Unorm; }
+
+	static void Pack(const VertexData& vertex, const VertexEncoding& encoding, char* out)
+	{
+		glm::vec3 position = (vertex.position - encoding.positionOffset) * encoding.positionScale;
+		const uint16_t packed[4] = { Quantize::Unorm16(position.x), Quantize::Unorm16(position.y), Quantize::Unorm16(position.z), 0 };
+		memcpy(out, packed, sizeof(packed));
+	}
+
+	static void Unpack(const char* in, const VertexEncoding& encoding, VertexData& vertex)
+	{
+		uint16_t packed[4];
+		memcpy(packed, in, sizeof(packed));
+		vertex.position = encoding.positionOffset + encoding.positionExtent
+			* glm::vec3(Quantize::FromUnorm16(packed[0]), Quantize::FromUnorm16(packed[1]), Quantize::FromUnorm16(packed[2]));
+	}
+};
+
+struct NormalOctahedral16
+{
+	static const uint32_t size = sizeof(int16_t) * 2;
+	static vk::Format Format() { return vk::Format::eR16G16Snorm; }
+
+	static void Pack(const VertexData& vertex, const VertexEncoding&, char* out)
+	{
+		glm::vec2 octahedral = Quantize::OctahedralEncode(vertex.normal);
+		const int16_t packed[2] = { Quantize::Snorm16(octahedral.x), Quantize::Snorm16(octahedral.y) };
+		memcpy(out, packed, sizeof(packed));
+	}
+
+	static void Unpack(const char* in, const VertexEncoding&, VertexData& vertex)
+	{
+		int16_t packed[2];
+		memcpy(packed, in, sizeof(packed));
+		vertex.normal = Quantize::OctahedralDecode(glm::vec2(Quantize::FromSnorm16(packed[0]), Quantize::FromSnorm16(packed[1])));
+	}
+};
+
+// unorm16 within the mesh's uv bounds
+struct UvUnorm16
+{
+	static const uint32_t size = sizeof(uint16_t) * 2;
+	static vk::Format Format() { return vk::Format::eR16G16Unorm; }
+
+	static void Pack(const VertexData& vertex, const VertexEncoding& encoding, char* out)
+	{
+		glm::vec2 uv = (vertex.uv - encoding.uvOffset) * encoding.uvScale;
+		const uint16_t packed[2] = { Quantize::Unorm16(uv.x), Quantize::Unorm16(uv.y) };
+		memcpy(out, packed, sizeof(packed));
+	}
+
+	static void Unpack(const char* in, const VertexEncoding& encoding, VertexData& vertex)
+	{
+		uint16_t packed[2];
+		memcpy(packed, in, sizeof(packed));
+		vertex.uv = encoding.uvOffset + encoding.uvExtent * glm::vec2(Quantize::FromUnorm16(packed[0]), Quantize::FromUnorm16(packed[1]));
+	}
+};
+
+// Walks the attribute list at compile time. Offset and location of every
+// attribute are template arguments, so Pack/Unpack inline into straight-line
+// code with no per-attribute branching.
+template<uint32_t Offset, uint32_t Location, typename... Attributes>
+struct VertexAttributeList
+{
+	static const uint32_t size = 0;
+
+	static void Describe(std::vector<vk::VertexInputAttributeDescription>&) {}
+	static void Pack(const VertexData&, const VertexEncoding&, char*) {}
+	static void Unpack(const char*, const VertexEncoding&, VertexData&) {}
+};
+
+template<uint32_t Offset, uint32_t Location, typename First, typename... Rest>
+struct VertexAttributeList<Offset, Location, First, Rest...>
+{
+	typedef VertexAttributeList<Offset + First::size, Location + 1, Rest...> Next;
+
+	static const uint32_t size = First::size + Next::size;
+
+	static void Describe(std::vector<vk::VertexInputAttributeDescription>& attributes)
+	{
+		attributes.push_back(vk::VertexInputAttributeDescription()
+			.setBinding(0)
+			.setLocation(Location)
+			.setFormat(First::Format())
+			.setOffset(Offset));
+		Next::Describe(attributes);
+	}
+
+	static void Pack(const VertexData& vertex, const VertexEncoding& encoding, char* out)
+	{
+		First::Pack(vertex, encoding, out + Offset);
+		Next::Pack(vertex, encoding, out);
+	}
+
+	static void Unpack(const char* in, const VertexEncoding& encoding, VertexData& vertex)
+	{
+		First::Unpack(in + Offset, encoding, vertex);
+		Next::Unpack(in, encoding, vertex);
+	}
+};
+
+// A vertex format defined by its attribute list, in shader location order.
+// Adding a format only takes a new typedef (and a VertexFormat entry).
+template<typename... Attributes>
+struct VertexLayout
+{
+	typedef VertexAttributeList<0, 0, Attributes...> List;
+
+	static const uint32_t stride = List::size;
+
+	static std::vector<vk::VertexInputAttributeDescription> Describe()
+	{
+		std::vector<vk::VertexInputAttributeDescription> attributes;
+		attributes.reserve(sizeof...(Attributes));
+		List::Describe(attributes);
+		return attributes;
+	}
+
+	static void Pack(const VertexData& vertex, const VertexEncoding& encoding, char* out)
+	{
+		List::Pack(vertex, encoding, out);
+	}
+
+	static void Unpack(const char* in, const VertexEncoding& encoding, VertexData& vertex)
+	{
+		List::Unpack(in, encoding, vertex);
+	}
+};
+
+template<typename... Attributes>
+const uint32_t VertexLayout<Attributes...>::stride;
+
+typedef VertexLayout<PositionFloat, NormalFloat, UvFloat> StandardVertex;
+typedef VertexLayout<PositionUnorm16, NormalOctahedral16, UvUnorm16> QuantizedVertex;
+
+// Maps the runtime VertexFormat onto its layout type
+class VertexFormats
+{
+public:
+	// Calls visitor(Layout()) with the layout of format, so generic lambdas
+	// can instantiate their work once per layout
+	template<typename F>
+	static auto Visit(VertexFormat format, F&& visitor) -> decltype(visitor(StandardVertex()))
+	{
+		switch (format)
+		{
+		case VertexFormat::Quantized:
+			return visitor(QuantizedVertex());
+		case VertexFormat::Standard:
+		default:
+			return visitor(StandardVertex());
+		}
+	}
+
+	static uint32_t Stride(VertexFormat format)
+	{
+		return Visit(format, [](auto layout) { return decltype(layout)::stride; });
+	}
+
+	static std::vector<vk::VertexInputAttributeDescription> Describe(VertexFormat format)
+	{
+		return Visit(format, [](auto layout) { return decltype(layout)::Describe(); });
+	}
+};
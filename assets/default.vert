@@ -6,13 +6,25 @@ layout (std140, set = 0, binding = 0) uniform MVP {
     mat4 model;
     mat4 view;
     mat4 perpective;
+    vec4 positionOffset;
+    vec4 positionScale;
+    vec4 uvTransform;
 } mvp;
 
+#ifdef QUANTIZED_VERTEX
+layout (location = 0) in vec4 quantizedPosition;
+layout (location = 1) in vec2 quantizedNormal;
+layout (location = 2) in vec2 quantizedUv;
+#else
 layout (location = 0) in vec3 position;
 layout (location = 1) in vec3 normal;
 layout (location = 2) in vec3 uv;
+#endif
 
 void main() {
+#ifdef QUANTIZED_VERTEX
+	vec3 position = mvp.positionOffset.xyz + mvp.positionScale.xyz * quantizedPosition.xyz;
+#endif
     mat4 mat = mvp.perpective * mvp.view * mvp.model;
     gl_Position = mat * vec4(position,1.0);
 }
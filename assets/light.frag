@@ -1,7 +1,16 @@
 #version 400
 #extension GL_ARB_separate_shader_objects : enable
 #extension GL_ARB_shading_language_420pack : enable
+#ifdef BINDLESS_TEXTURES
+#extension GL_EXT_nonuniform_qualifier : enable
+layout (set = 1, binding = 0) uniform sampler2D textures[];
+layout (push_constant) uniform Material {
+	uint textureIndex;
+} material;
+#define tex textures[material.textureIndex]
+#else
 layout (set = 1, binding = 0) uniform sampler2D tex;
+#endif
 layout (location = 0) in vec2 texcoord;
 layout (location = 1) in vec4 lightColor;
 layout (location = 0) out vec4 outColor;
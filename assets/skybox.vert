@@ -5,6 +5,9 @@ layout (std140, set = 0, binding = 0) uniform MVP {
     mat4 model;
 	mat4 view;
     mat4 perpective;
+    vec4 positionOffset;
+    vec4 positionScale;
+    vec4 uvTransform;
 } mvp;
 layout (std140, set = 2, binding = 0) uniform Light {
 	vec4 color;
@@ -20,12 +23,24 @@ layout (std140, set = 3, binding = 0) uniform Camera {
 	float near;
 	float far;
 } camera;
+#ifdef QUANTIZED_VERTEX
+layout (location = 0) in vec4 quantizedPosition;
+layout (location = 1) in vec2 quantizedNormal;
+layout (location = 2) in vec2 quantizedUv;
+#else
 layout (location = 0) in vec3 position;
 layout (location = 1) in vec3 normal;
-layout (location = 2) in vec3 uv;
+layout (location = 2) in vec3 vertexUv;
+#endif
 layout (location = 0) out vec2 texcoord;
 layout (location = 1) out vec4 lightColor;
 void main() {
+#ifdef QUANTIZED_VERTEX
+	vec3 position = mvp.positionOffset.xyz + mvp.positionScale.xyz * quantizedPosition.xyz;
+	vec2 uv = mvp.uvTransform.xy + mvp.uvTransform.zw * quantizedUv;
+#else
+	vec2 uv = mvp.uvTransform.xy + mvp.uvTransform.zw * vertexUv.xy;
+#endif
 	mat4 mat = mvp.perpective * mvp.view * mvp.model;
 	gl_Position = mat * vec4(position, 1.0f);
 	texcoord = vec2(uv.x, 1.f - uv.y);